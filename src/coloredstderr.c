@@ -30,17 +30,22 @@
 # define NDEBUG
 #endif
 
-#ifndef TLS
+#ifdef TLS
+# define HAVE_TLS 1
+#else
 # define TLS
 #endif
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #ifdef HAVE_ERR_H
@@ -49,9 +54,56 @@
 #ifdef HAVE_ERROR_H
 # include <error.h>
 #endif
-#ifdef HAVE_STRUCT__IO_FILE__FILENO
+#ifdef HAVE_LIBIO_H
 # include <libio.h>
 #endif
+#if defined(DEBUG) && defined(HAVE_CLOCK_GETTIME)
+# include <time.h>
+#endif
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+# include <sys/mman.h>
+#endif
+#if defined(HAVE_SYS_AUXV_H) && defined(HAVE_GETAUXVAL)
+# include <sys/auxv.h>
+#endif
+#if defined(HAVE_FNMATCH_H) && defined(HAVE_FNMATCH)
+# include <fnmatch.h>
+#endif
+#if defined(HAVE_PTHREAD_KEY_CREATE) || defined(HAVE_PTHREAD_ATFORK) \
+        || defined(HAVE_PTHREAD_MUTEX_LOCK) \
+        || defined(HAVE_PTHREAD_SETCANCELSTATE) \
+        || defined(HAVE_PTHREAD_CLEANUP_PUSH)
+# include <pthread.h>
+#endif
+#ifdef HAVE_WCHAR_H
+# include <wchar.h>
+#endif
+#if defined(HAVE_STDIO_EXT_H) && defined(HAVE___FPURGE)
+# include <stdio_ext.h>
+#else
+# undef HAVE___FPURGE
+#endif
+#if defined(HAVE_SYS_SENDFILE_H) && defined(HAVE_SENDFILE)
+# include <sys/sendfile.h>
+#else
+# undef HAVE_SENDFILE
+#endif
+#if defined(HAVE_SENDFILE) || defined(HAVE_SPLICE) \
+        || defined(HAVE_COPY_FILE_RANGE)
+# define HAVE_TRANSFER 1
+# include <poll.h>
+#endif
+#ifdef HAVE_SYS_SINGLE_THREADED_H
+# include <sys/single_threaded.h>
+#endif
+#if defined(HAVE_SPAWN_H) && defined(HAVE_POSIX_SPAWN) \
+        && defined(HAVE_POSIX_SPAWNP)
+# define HAVE_SPAWN 1
+# include <signal.h>
+# include <spawn.h>
+# include <stdlib.h>
+# include <sys/wait.h>
+#endif
 
 /* The following functions may be macros. Undefine them or they cause build
  * failures when used in our hook macros below. */
@@ -71,17 +123,77 @@
 # undef putchar_unlocked
 #endif
 
+#if defined(HAVE_CLOSE_RANGE) && !defined(CLOSE_RANGE_CLOEXEC)
+/* Linux's value, not always defined by the libc. */
+# define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+/* Descriptors can be closed in bulk, see close_fd_range(). */
+#if defined(HAVE_CLOSE_RANGE) || defined(HAVE_CLOSEFROM)
+# define HAVE_CLOSE_FD_RANGE 1
+#endif
+
+/* Minimum required by POSIX. */
+#ifndef IOV_MAX
+# define IOV_MAX 16
+#endif
+
+
+extern char **environ;
 
 /* Used by various functions, including debug(). */
 static ssize_t (*real_write)(int, void const *, size_t);
+static ssize_t (*real_writev)(int, struct iovec const *, int);
+#ifdef HAVE_PWRITEV2
+static ssize_t (*real_pwritev2)(int, struct iovec const *, int, off_t, int);
+#endif
+#ifdef HAVE_VDPRINTF
+static int (*real_vdprintf)(int, char const *, va_list);
+#endif
+#if defined(HAVE___VDPRINTF_CHK) && defined(HAVE___VSNPRINTF_CHK)
+static int (*real___vdprintf_chk)(int, int, char const *, va_list);
+#endif
 static int (*real_close)(int);
 static size_t (*real_fwrite)(void const *, size_t, size_t, FILE *);
+#ifdef HAVE_SENDFILE
+static ssize_t (*real_sendfile)(int, int, off_t *, size_t);
+#endif
+#ifdef HAVE_SPLICE
+static ssize_t (*real_splice)(int, off64_t *, int, off64_t *, size_t,
+                              unsigned int);
+#endif
+#ifdef HAVE_COPY_FILE_RANGE
+static ssize_t (*real_copy_file_range)(int, off64_t *, int, off64_t *, size_t,
+                                       unsigned int);
+#endif
+#ifdef HAVE_WCHAR_H
+static int (*real_fputws)(wchar_t const *, FILE *);
+static wint_t (*real_fputwc)(wchar_t, FILE *);
+#endif
 
+#include "constants.h"
+
+/* Data used by each hook call. Kept together in a single cache line. */
+static struct {
+    /* Bitmap of tracked file descriptors < TRACKFDS_STATIC_COUNT, see
+     * trackfds.h. */
+    unsigned long tracked_fds[TRACKFDS_STATIC_WORDS];
+
+    /* Strings written before/after each handled call, see
+     * init_pre_post_string(). */
+    char const *pre_string;
+    char const *post_string;
+    unsigned int pre_string_size;
+    unsigned int post_string_size;
+
+    /* Force hooked writes even when not writing to a tty. Used for tests. */
+    int force_write_to_non_tty;
+    /* Descriptor + 1 whose post string was deferred, 0 if none. See
+     * color_defer(). */
+    int color_pending;
+} state cacheline_aligned;
 /* Did we already (try to) parse the environment and setup the necessary
  * variables? */
 static int initialized;
-/* Force hooked writes even when not writing to a tty. Used for tests. */
-static int force_write_to_non_tty;
 /* Was ENV_NAME_FDS found and used when init_from_environment() was called?
  * This is not true if the process set it manually after initialization. */
 static int used_fds_set_by_user;
@@ -93,187 +205,2083 @@ static int used_fds_set_by_user;
 static TLS int handle_recursive;
 
 
-#include "constants.h"
-#ifdef WARNING
-# include "debug.h"
+#ifdef WARNING
+# include "debug.h"
+#endif
+
+#include "hookmacros.h"
+#include "trackfds.h"
+
+/* Use the real vfork() and keep the changes of the child in an overlay, see
+ * vfork() below. Requires an assembler trampoline for each architecture. */
+#if defined(HAVE_VFORK) && defined(HAVE_FORK) && defined(HAVE_TLS) \
+        && defined(HAVE___ATTRIBUTE__) && defined(__ELF__) \
+        && defined(__x86_64__)
+# define HAVE_VFORK_TRAMPOLINE 1
+/* Set while the child of vfork() runs. It shares our memory (including the
+ * TLS of this thread) and must not modify our tracked descriptors. */
+static TLS int vfork_child;
+static TLS int vfork_overflow;
+static TLS struct tracked_fds_changes vfork_changes;
+#endif
+
+/* Resolve the hooked functions without dlsym(), see hooks_resolve(). */
+#if defined(HAVE_ELF_H) && defined(HAVE_LINK_H) && defined(HAVE__R_DEBUG) \
+        && defined(HAVE_SYS_AUXV_H) && defined(HAVE_GETAUXVAL) \
+        && defined(HAVE___ATTRIBUTE__)
+# define HAVE_DYNLINK 1
+# include "dynlink.h"
+#endif
+
+
+
+/* See hookmacros.h for the decision if a function call is colored. */
+
+
+/* Prevent inlining into hook functions because it may increase the number of
+ * spilled registers unnecessarily. As it's only called once per tracked
+ * descriptor (the result is cached) accept the additional call. */
+static int isatty_noinline(int fd) noinline;
+static int isatty_noinline(int fd) {
+    assert(fd >= 0);
+
+    int saved_errno = errno;
+    int result = isatty(fd);
+    /* Don't cache the result if the descriptor is invalid. */
+    if (result || errno != EBADF) {
+        tracked_fds_set_tty(fd, result);
+    }
+    errno = saved_errno;
+
+    return result;
+}
+/* Use the cached isatty() result if available. */
+inline static int isatty_cached(int fd) always_inline;
+inline static int isatty_cached(int fd) {
+    int result = tracked_fds_get_tty(fd);
+    if (likely(result >= 0)) {
+        return result;
+    }
+    return isatty_noinline(fd);
+}
+
+
+static int ignored_binaries_check(void) noinline;
+/* Check ENV_NAME_IGNORED_BINARIES if not yet done. Necessary before the first
+ * colored write and before starting a child process. Returns 1 if this
+ * binary is ignored. */
+inline static int ignored_binaries_resolve(void) always_inline;
+inline static int ignored_binaries_resolve(void) {
+    if (likely(!ignored_binaries.pending)) {
+        return 0;
+    }
+    return ignored_binaries_check();
+}
+
+/* Check if a tracked descriptor should be handled. Not inlined to keep the
+ * hook functions small, it's only called for tracked descriptors. */
+static int check_handle(int fd) noinline;
+static int check_handle(int fd) {
+#ifdef HAVE_VFORK_TRAMPOLINE
+    /* Only descriptors tracked by us and the child are colored; descriptors
+     * tracked only by the child are missed. The isatty() cache belongs to
+     * us. */
+    if (unlikely(vfork_child)) {
+        if (!tracked_fds_changes_tracked(&vfork_changes, fd)) {
+            return 0;
+        }
+        if (state.force_write_to_non_tty) {
+            return 1;
+        }
+        int saved_errno = errno;
+        int result = isatty(fd);
+        errno = saved_errno;
+        return result;
+    }
+#endif
+    if (unlikely(ignored_binaries_resolve())) {
+        return 0;
+    }
+    if (unlikely(state.force_write_to_non_tty)) {
+        return 1;
+    }
+    return isatty_cached(fd);
+}
+
+
+/* Load alternative pre/post strings from the environment if available, fall
+ * back to default values. */
+static void init_pre_post_string(struct environment const *environment) {
+    state.pre_string = environment->pre_string;
+    if (!state.pre_string) {
+        state.pre_string = DEFAULT_PRE_STRING;
+    }
+    state.pre_string_size = (unsigned int)strlen(state.pre_string);
+
+    state.post_string = environment->post_string;
+    if (!state.post_string) {
+        state.post_string = DEFAULT_POST_STRING;
+    }
+    state.post_string_size = (unsigned int)strlen(state.post_string);
+}
+
+/* Initialization state, see hooks_init(). */
+enum {
+    INIT_NONE,
+    INIT_RUNNING,
+    INIT_DONE,
+};
+static int init_state;
+
+#ifdef HAVE___ATTRIBUTE__
+/* Provided by the linker, see hookmacros.h. */
+extern struct hook *__start_coloredstderr_hooks[]
+    __attribute__((visibility("hidden")));
+extern struct hook *__stop_coloredstderr_hooks[]
+    __attribute__((visibility("hidden")));
+#endif
+
+#ifdef HAVE_DYNLINK
+/* Look up all hooks in the objects loaded after us (like RTLD_NEXT) with a
+ * single walk over the loaded objects. Hooks which must be resolved with
+ * dlsym() are marked in pending[]. */
+static void hooks_resolve_dynlink(struct hook **hooks, char *pending,
+                                  size_t count) {
+    struct link_map *self, *map;
+    size_t i, j;
+
+    /* Find our own object, the lookup starts after it (like RTLD_NEXT). Not
+     * found if we are loaded in another namespace (dlmopen()). */
+    for (self = _r_debug.r_map; self; self = self->l_next) {
+        if (self->l_ld == _DYNAMIC) {
+            break;
+        }
+    }
+    if (!self) {
+        return;
+    }
+
+    /* The vDSO is in the list of loaded objects but not used by dlsym(). */
+    ElfW(Addr) vdso = (ElfW(Addr))getauxval(AT_SYSINFO_EHDR);
+
+    size_t objects_count = 0;
+    for (map = self->l_next; map; map = map->l_next) {
+        objects_count++;
+    }
+    if (objects_count == 0) {
+        return;
+    }
+
+    struct dynlink_object objects[objects_count];
+    for (map = self->l_next, j = 0; map; map = map->l_next) {
+        if (vdso != 0 && map->l_addr == vdso) {
+            continue;
+        }
+        /* Skipping an object could change the lookup order, let dlsym()
+         * handle everything. */
+        if (!dynlink_object_init(&objects[j++], map)) {
+            return;
+        }
+    }
+    objects_count = j;
+
+    for (i = 0; i < count; i++) {
+        char const *name = hooks[i]->name;
+        uint32_t hash = dynlink_gnu_hash(name);
+
+        /* Symbols not found at all would also fail with dlsym(), their stub
+         * tries again (and aborts) when called. */
+        pending[i] = 0;
+
+        for (j = 0; j < objects_count; j++) {
+            void *real;
+            int result = dynlink_lookup(&objects[j], name, hash, &real);
+            if (result == 0) {
+                continue;
+            }
+
+            if (result > 0) {
+                *hooks[i]->real = real;
+            } else {
+                pending[i] = 1;
+            }
+            break;
+        }
+    }
+}
+#endif
+
+#ifdef HAVE_DYNLINK_REBIND
+/* Descriptors are only tracked by duplicating already tracked descriptors.
+ * If nothing is tracked, nothing can be colored anymore. Bind the hooked
+ * functions in all loaded objects directly to the real functions so they
+ * cost nothing per call. The hooks which start new programs must stay to pass
+ * our settings to child processes. Libraries loaded later with dlopen() still
+ * use the hooks. */
+static int hook_starts_process(char const *name) {
+    return !strncmp(name, "exec", 4)
+        || !strcmp(name, "posix_spawn")
+        || !strcmp(name, "posix_spawnp")
+        || !strcmp(name, "system")
+        || !strcmp(name, "popen")
+        /* Must match our popen(). */
+        || !strcmp(name, "pclose");
+}
+/* The hooks which read input only write pending output (see
+ * output_flush_enabled). Without it they can be bound to the real functions
+ * even if descriptors are tracked. */
+static int hook_reads_input(char const *name) {
+    return !strcmp(name, "read")
+        || !strcmp(name, "fread")
+        || !strcmp(name, "fgets")
+        || !strcmp(name, "fgetc")
+        || !strcmp(name, "getc")
+        || !strcmp(name, "getchar")
+        || !strcmp(name, "getline")
+        || !strcmp(name, "getdelim");
+}
+static int hook_not_reads_input(char const *name) {
+    return !hook_reads_input(name);
+}
+/* Bind all hooks except those matching keep to the real functions. */
+static void hooks_dormant(int (*keep)(char const *name)) {
+    struct hook **hooks = __start_coloredstderr_hooks;
+    size_t count = (size_t)(__stop_coloredstderr_hooks
+                            - __start_coloredstderr_hooks);
+    size_t i, used;
+
+    if (count == 0) {
+        return;
+    }
+
+    struct dynlink_rebind rebind[count];
+    for (i = 0, used = 0; i < count; i++) {
+        struct hook *hook = hooks[i];
+
+        if (keep(hook->name)) {
+            continue;
+        }
+        /* Not resolved. */
+        if (!*hook->real
+                || *(void (**)(void))hook->real == hook->lazy) {
+            continue;
+        }
+
+        rebind[used].name = hook->name;
+        rebind[used].from = (ElfW(Addr))hook->hook;
+        rebind[used].to   = (ElfW(Addr))*hook->real;
+        used++;
+    }
+
+    size_t changed = dynlink_rebind(rebind, used);
+# ifdef DEBUG
+    debug("hooks_dormant(): %zu GOT entries changed\t[%d]\n",
+          changed, getpid());
+# else
+    (void)changed;
+# endif
+}
+#endif
+
+/* Ignored binaries (and their children) don't track any descriptors, see
+ * init_from_environment(). */
+static int ignored_binaries_check(void) {
+    int saved_errno = errno;
+
+    int ignored = is_program_ignored();
+    if (ignored) {
+        tracked_fds_clear();
+    }
+    ignored_binaries.pending = 0;
+
+#ifdef DEBUG
+    debug("ignored_binaries_check(): %d\t[%d]\n", ignored, getpid());
+#endif
+
+    errno = saved_errno;
+    return ignored;
+}
+/* Check the patterns matching the basename already on startup, ignored
+ * binaries can then become dormant (see hooks_init_constructor()). Only full
+ * paths (which need /proc/self/exe) are still checked later by
+ * ignored_binaries_check(). */
+static void ignored_binaries_check_name(void) {
+    if (!ignored_binaries.pending) {
+        return;
+    }
+
+    int ignored = is_program_name_ignored();
+    if (ignored < 0) {
+        return;
+    }
+    if (ignored) {
+        tracked_fds_clear();
+        ignored_binaries.pending = 0;
+    } else if (ignored_binaries.paths == 0) {
+        ignored_binaries.pending = 0;
+    }
+
+#ifdef DEBUG
+    debug("ignored_binaries_check_name(): %d\t[%d]\n", ignored, getpid());
+#endif
+}
+
+/* Resolve real_* of all hooks at once instead of a dlsym() in the first call
+ * of each hook. Functions missing in the libc are skipped, their stub aborts
+ * when called. Returns the number of necessary dlsym() calls. */
+static size_t hooks_resolve(void) {
+    size_t lookups = 0;
+
+#ifdef HAVE___ATTRIBUTE__
+    struct hook **hooks = __start_coloredstderr_hooks;
+    size_t count = (size_t)(__stop_coloredstderr_hooks
+                            - __start_coloredstderr_hooks);
+    size_t i;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    char pending[count];
+    memset(pending, 1, count);
+
+# ifdef HAVE_DYNLINK
+    hooks_resolve_dynlink(hooks, pending, count);
+# endif
+
+    for (i = 0; i < count; i++) {
+        if (!pending[i]) {
+            continue;
+        }
+
+        void *real = dlsym(RTLD_NEXT, hooks[i]->name);
+        if (real) {
+            *hooks[i]->real = real;
+        }
+        lookups++;
+    }
+#endif
+
+    return lookups;
+}
+
+#if defined(DEBUG) && defined(HAVE_CLOCK_GETTIME)
+static long timespec_diff_ns(struct timespec const *start,
+                             struct timespec const *end) {
+    return (long)(end->tv_sec - start->tv_sec) * 1000000000L
+           + (end->tv_nsec - start->tv_nsec);
+}
+#endif
+
+static void output_init(struct environment const *environment);
+
+/* Set if output can be pending (ENV_NAME_LINE_BUFFER or ENV_NAME_DEFER_POST),
+ * otherwise the hooks which read input only call the real function. */
+static int output_flush_enabled;
+
+/* Resolve all hooks, load the pre/post strings and the tracked descriptors
+ * from the environment. Called as constructor before main() or by the first
+ * hook called before that (e.g. from another library's constructor).
+ *
+ * Returns 1 when everything is initialized and 0 if the initialization is
+ * still running (recursive call or in another thread). */
+static int hooks_init(void) noinline;
+static int hooks_init(void) {
+    /* Pairs with the release below, everything initialized is visible. */
+    if (likely(atomic_load_acquire(&init_state) == INIT_DONE)) {
+        return 1;
+    }
+#ifdef HAVE___SYNC_BOOL_COMPARE_AND_SWAP
+    if (!__sync_bool_compare_and_swap(&init_state, INIT_NONE, INIT_RUNNING)) {
+        return 0;
+    }
+#else
+    if (init_state != INIT_NONE) {
+        return 0;
+    }
+    init_state = INIT_RUNNING;
+#endif
+
+    int saved_errno = errno;
+
+#if defined(DEBUG) && defined(HAVE_CLOCK_GETTIME)
+    struct timespec start, resolved, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+#endif
+
+    size_t lookups = hooks_resolve();
+#if defined(DEBUG) && defined(HAVE_CLOCK_GETTIME)
+    clock_gettime(CLOCK_MONOTONIC, &resolved);
+#endif
+    struct environment environment;
+    environment_load(&environment);
+    /* Before init_from_environment(), the strings must be available as soon
+     * as a descriptor is tracked. */
+    init_pre_post_string(&environment);
+    init_from_environment(&environment);
+    output_init(&environment);
+
+#ifdef DEBUG
+    /* Startup cost added to each process (the total includes the debug
+     * output of init_from_environment()). */
+# ifdef HAVE_CLOCK_GETTIME
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    debug("hooks_init(): resolve %ld ns (%zu dlsym() calls), total %ld ns"
+          "\t[%d]\n",
+          timespec_diff_ns(&start, &resolved), lookups,
+          timespec_diff_ns(&start, &end), getpid());
+# else
+    debug("hooks_init(): %zu dlsym() calls\t[%d]\n", lookups, getpid());
+# endif
+#else
+    (void)lookups;
+#endif
+
+    atomic_store_release(&init_state, INIT_DONE);
+
+    errno = saved_errno;
+    return 1;
+}
+static void hooks_init_constructor(void) constructor;
+static void hooks_init_constructor(void) {
+    hooks_init();
+    /* Ignored binaries (matched by name) track nothing and become dormant
+     * below. */
+    ignored_binaries_check_name();
+#ifdef HAVE_DYNLINK_REBIND
+    /* Only here, hooks_init() might also run inside a hook (e.g. a write()
+     * in a signal handler) where dl_iterate_phdr() and mprotect() must not
+     * be used. */
+    if (tracked_fds_empty()) {
+        hooks_dormant(hook_starts_process);
+    } else if (!output_flush_enabled) {
+        hooks_dormant(hook_not_reads_input);
+    }
+#endif
+}
+
+/* Called by the stub <name>_lazy() of a hook which is used before
+ * hooks_init() has finished. Returns 1 if the stub can call the hook, 0 if it
+ * must call real_<name> directly. */
+static int hook_lazy(struct hook *hook) noinline;
+static int hook_lazy(struct hook *hook) {
+    int done = hooks_init();
+
+    /* Not (yet) resolved by hooks_init(). */
+    if (*(void (**)(void))hook->real == hook->lazy) {
+        *hook->real = dlsym_function(hook->name);
+    }
+    return done;
+}
+
+
+/* newfd is a duplicate of oldfd, cloexec is its close-on-exec flag (e.g.
+ * dup3() with O_CLOEXEC). */
+static void dup_fd(int oldfd, int newfd, int cloexec) {
+#ifdef DEBUG
+    debug("%3d -> %3d%s\t\t\t[%d]\n", oldfd, newfd,
+          cloexec ? " (cloexec)" : "", getpid());
+#endif
+
+    assert(oldfd >= 0 && newfd >= 0);
+
+    hooks_init();
+
+    /* dup2(fd, fd) changes nothing, not even the close-on-exec flag. */
+    if (oldfd == newfd) {
+        return;
+    }
+
+#ifdef HAVE_VFORK_TRAMPOLINE
+    if (unlikely(vfork_child)) {
+        if (!tracked_fds_changes_set(&vfork_changes, newfd,
+                tracked_fds_changes_tracked(&vfork_changes, oldfd))
+                || (cloexec && !tracked_fds_changes_set_cloexec(&vfork_changes,
+                                                                newfd, 1))) {
+            vfork_overflow = 1;
+        }
+        return;
+    }
+#endif
+
+    /* We are already tracking this file descriptor, add newfd to the list as
+     * it will reference the same descriptor. */
+    if (tracked_fds_find(oldfd)) {
+        if (!tracked_fds_find(newfd)) {
+            tracked_fds_add(newfd);
+        /* newfd might have referenced a different file, clear the cached
+         * isatty() result. */
+        } else {
+            tracked_fds_reset_tty(newfd);
+        }
+        tracked_fds_set_cloexec(newfd, cloexec);
+    /* We are not tracking this file descriptor, remove newfd from the list
+     * (if present). */
+    } else {
+        tracked_fds_remove(newfd);
+    }
+}
+
+static void close_fd(int fd) {
+#ifdef DEBUG
+    debug("%3d ->   .\t\t\t[%d]\n", fd, getpid());
+#endif
+
+    assert(fd >= 0);
+
+    hooks_init();
+
+#ifdef HAVE_VFORK_TRAMPOLINE
+    if (unlikely(vfork_child)) {
+        if (!tracked_fds_changes_set(&vfork_changes, fd, 0)) {
+            vfork_overflow = 1;
+        }
+        return;
+    }
+#endif
+
+    tracked_fds_remove(fd);
+}
+/* The close-on-exec flag of fd was changed, e.g. with fcntl(F_SETFD). */
+static void cloexec_fd(int fd, int cloexec) {
+#ifdef DEBUG
+    debug("%3d -> %3d (cloexec %d)\t\t[%d]\n", fd, fd, cloexec, getpid());
+#endif
+
+    assert(fd >= 0);
+
+    hooks_init();
+
+#ifdef HAVE_VFORK_TRAMPOLINE
+    if (unlikely(vfork_child)) {
+        if (!tracked_fds_changes_set_cloexec(&vfork_changes, fd, cloexec)) {
+            vfork_overflow = 1;
+        }
+        return;
+    }
+#endif
+
+    tracked_fds_set_cloexec(fd, cloexec);
+}
+#ifdef HAVE_CLOSE_FD_RANGE
+/* Like close_fd() for all descriptors from first to last (inclusive), e.g.
+ * closed with close_range(). */
+static void close_fd_range(int first, int last) {
+#ifdef DEBUG
+    debug("%3d-%d ->   .\t\t\t[%d]\n", first, last, getpid());
+#endif
+
+    assert(first >= 0 && first <= last);
+
+    hooks_init();
+
+#ifdef HAVE_VFORK_TRAMPOLINE
+    if (unlikely(vfork_child)) {
+        if (!tracked_fds_changes_close_range(&vfork_changes, first, last)) {
+            vfork_overflow = 1;
+        }
+        return;
+    }
+#endif
+
+    tracked_fds_remove_range(first, last);
+}
+#endif
+#ifdef HAVE_CLOSE_RANGE
+/* Like cloexec_fd() for all descriptors from first to last (inclusive), e.g.
+ * close_range() with CLOSE_RANGE_CLOEXEC. */
+static void cloexec_fd_range(int first, int last) {
+#ifdef DEBUG
+    debug("%3d-%d (cloexec)\t\t\t[%d]\n", first, last, getpid());
+#endif
+
+    assert(first >= 0 && first <= last);
+
+    hooks_init();
+
+#ifdef HAVE_VFORK_TRAMPOLINE
+    if (unlikely(vfork_child)) {
+        if (!tracked_fds_changes_cloexec_range(&vfork_changes, first, last)) {
+            vfork_overflow = 1;
+        }
+        return;
+    }
+#endif
+
+    tracked_fds_set_cloexec_range(first, last);
+}
+#endif
+
+
+/* If enabled with ENV_NAME_DEFER_POST, the post string of a colored write is
+ * deferred until it's necessary. Consecutive colored writes to the same
+ * descriptor (e.g. many lines written to stderr) then need neither the post
+ * string after each write nor the pre string before the next one. The post
+ * string is written before any other output (including to untracked
+ * descriptors which might use the same terminal), before closing or
+ * replacing the descriptor, before reading input, exec*(), fork() and at
+ * exit. With multiple threads writing at the same time some output might not
+ * be colored. */
+static int color_defer_enabled;
+
+/* Write the pending post string (if any). */
+static void color_reset(void) noinline;
+static void color_reset(void) {
+#ifdef HAVE___SYNC_BOOL_COMPARE_AND_SWAP
+    int pending = __sync_lock_test_and_set(&state.color_pending, 0);
+#else
+    int pending = state.color_pending;
+    state.color_pending = 0;
+#endif
+    if (pending == 0) {
+        return;
+    }
+
+    int saved_errno = errno;
+
+    real_write(pending - 1, state.post_string, state.post_string_size);
+
+    errno = saved_errno;
+}
+inline static void color_reset_pending(void) always_inline;
+inline static void color_reset_pending(void) {
+    if (unlikely(state.color_pending != 0)) {
+        color_reset();
+    }
+}
+/* Write the post string if it's pending for fd. */
+inline static void color_reset_fd(int fd) always_inline;
+inline static void color_reset_fd(int fd) {
+    if (unlikely(state.color_pending != 0 && state.color_pending == fd + 1)) {
+        color_reset();
+    }
+}
+/* Write the post string if it's pending for a descriptor from first to last
+ * (inclusive). */
+inline static void color_reset_range(int first, int last) always_inline;
+inline static void color_reset_range(int first, int last) {
+    int pending = state.color_pending;
+    if (unlikely(pending != 0 && pending - 1 >= first
+                 && pending - 1 <= last)) {
+        color_reset();
+    }
+}
+/* Called before colored output to fd. Returns 1 if fd is still colored and
+ * the pre string must be skipped. */
+inline static int color_continue(int fd) always_inline;
+inline static int color_continue(int fd) {
+    if (likely(state.color_pending == 0)) {
+        return 0;
+    }
+    if (state.color_pending == fd + 1) {
+        return 1;
+    }
+    color_reset();
+    return 0;
+}
+/* Can the post string be deferred? Then the caller must skip it and call
+ * color_defer() after the output. */
+inline static int color_deferrable(void) always_inline;
+inline static int color_deferrable(void) {
+    if (likely(!color_defer_enabled)) {
+        return 0;
+    }
+#ifdef HAVE_VFORK_TRAMPOLINE
+    /* The child shares our state. */
+    if (vfork_child) {
+        return 0;
+    }
+#endif
+    return 1;
+}
+inline static void color_defer(int fd) always_inline;
+inline static void color_defer(int fd) {
+    state.color_pending = fd + 1;
+}
+
+/* Check if this descriptor should be handled, see hookmacros.h. Any other
+ * output might go to the same terminal and must not be colored. */
+inline static int hook_handle(int fd) always_inline;
+inline static int hook_handle(int fd) {
+    if (tracked_fds_find(fd) && check_handle(fd)) {
+        return 1;
+    }
+    color_reset_pending();
+    return 0;
+}
+
+/* Flush the line buffer before other output, see line_buffer_write(). */
+inline static void line_buffer_flush(void) always_inline;
+
+/* Write all pending output of this thread, e.g. before reading input. */
+inline static void output_flush(void) always_inline;
+inline static void output_flush(void) {
+    line_buffer_flush();
+    color_reset_pending();
+}
+
+
+/* "Action" handlers called when a file descriptor is matched. */
+
+/* Don't inline any of the pre/post functions. Keep the hook function as small
+ * as possible for speed reasons. */
+static void handle_fd_pre(int fd) noinline;
+static void handle_fd_post(int fd) noinline;
+static void handle_file_pre(FILE *stream) noinline;
+static int handle_file_post(FILE *stream) noinline;
+
+static void handle_fd_pre(int fd) {
+    if (handle_recursive++ > 0) {
+        return;
+    }
+
+    int saved_errno = errno;
+
+    line_buffer_flush();
+
+    if (!color_continue(fd)) {
+        real_write(fd, state.pre_string, state.pre_string_size);
+    }
+
+    errno = saved_errno;
+}
+static void handle_fd_post(int fd) {
+    if (--handle_recursive > 0) {
+        return;
+    }
+
+    if (color_deferrable()) {
+        color_defer(fd);
+        return;
+    }
+
+    int saved_errno = errno;
+
+    real_write(fd, state.post_string, state.post_string_size);
+
+    errno = saved_errno;
+}
+
+/* Write the complete buffer, used to finish the pre/post strings after a
+ * short write. Errors are ignored, there's nothing we can do. */
+static void write_all(int fd, char const *buf, size_t count) {
+    while (count > 0) {
+        ssize_t written = real_write(fd, buf, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        } else if (written == 0) {
+            break;
+        }
+        buf   += written;
+        count -= (size_t)written;
+    }
+}
+
+/* writev() or pwritev2() at the current position if flags are used. */
+static ssize_t writev_flags(int fd, struct iovec const *iov, int iovcnt,
+                            int flags) {
+#ifdef HAVE_PWRITEV2
+    if (flags != 0) {
+        return real_pwritev2(fd, iov, iovcnt, -1, flags);
+    }
+#else
+    (void)flags;
+#endif
+    return real_writev(fd, iov, iovcnt);
+}
+
+/* Write the caller's data in iov[1] to iov[iovcnt - 2] (count bytes) together
+ * with the pre string in iov[0] and the post string in iov[iovcnt - 1] with
+ * a single writev() instead of three system calls. This is faster and the
+ * colored output can't be interleaved with output of other threads or
+ * processes. The data is not copied. The return value only counts the
+ * caller's bytes like write() does. */
+static ssize_t writev_colored(int fd, struct iovec *iov, int iovcnt,
+                              size_t count, int flags) {
+    /* Skipped if deferred, see color_defer(). */
+    size_t pre_size  = color_continue(fd) ? 0 : state.pre_string_size;
+    int deferred = color_deferrable();
+    size_t post_size = deferred ? 0 : state.post_string_size;
+
+    iov[0].iov_base = (void *)state.pre_string;
+    iov[0].iov_len  = pre_size;
+    iov[iovcnt - 1].iov_base = (void *)state.post_string;
+    iov[iovcnt - 1].iov_len  = post_size;
+
+    ssize_t result = writev_flags(fd, iov, iovcnt, flags);
+    if (result < 0) {
+        return result;
+    }
+    size_t written = (size_t)result;
+
+    int saved_errno = errno;
+
+    /* Everything (maybe except parts of the post string) was written. */
+    if (likely(written >= pre_size + count)) {
+        written -= pre_size + count;
+        write_all(fd, state.post_string + written, post_size - written);
+        result = (ssize_t)count;
+
+    /* Short write in the middle of the data; reset the color so following
+     * output isn't colored, the caller will write the rest. */
+    } else if (written > pre_size) {
+        write_all(fd, state.post_string, post_size);
+        result = (ssize_t)(written - pre_size);
+
+    /* Not even the pre string was written completely. Finish it and write
+     * the data without the pre/post string to get its real result. */
+    } else {
+        write_all(fd, state.pre_string + written, pre_size - written);
+        result = writev_flags(fd, iov + 1, iovcnt - 2, flags);
+        saved_errno = errno;
+        write_all(fd, state.post_string, post_size);
+    }
+
+    if (deferred) {
+        color_defer(fd);
+    }
+
+    errno = saved_errno;
+    return result;
+}
+
+static ssize_t handle_fd_write(int fd, void const *buf, size_t count) noinline;
+static ssize_t handle_fd_write(int fd, void const *buf, size_t count) {
+    /* write() called recursively from a hooked function, the caller already
+     * printed the pre string. Also nothing to color for empty writes. */
+    if (handle_recursive > 0 || count == 0) {
+        return real_write(fd, buf, count);
+    }
+
+    line_buffer_flush();
+
+    /* Don't overflow writev()'s ssize_t result. */
+    if (unlikely(count > (size_t)SSIZE_MAX - state.pre_string_size
+                                           - state.post_string_size)) {
+        handle_fd_pre(fd);
+        ssize_t result = real_write(fd, buf, count);
+        handle_fd_post(fd);
+        return result;
+    }
+
+    struct iovec iov[3];
+    iov[1].iov_base = (void *)buf;
+    iov[1].iov_len  = count;
+    return writev_colored(fd, iov, 3, count, 0);
+}
+
+/* Like handle_fd_write() for writev(). The caller's entries are copied to a
+ * stack array with room for the pre/post string, see writev_colored(). */
+static ssize_t writev_colored_large(int fd, struct iovec const *iov,
+                                    int iovcnt, size_t count,
+                                    int flags) noinline;
+static ssize_t writev_colored_large(int fd, struct iovec const *iov,
+                                    int iovcnt, size_t count, int flags) {
+    /* Bounded by IOV_MAX, see handle_fd_writev_flags(). */
+    struct iovec copy[iovcnt + 2];
+    memcpy(copy + 1, iov, (size_t)iovcnt * sizeof(*iov));
+    return writev_colored(fd, copy, iovcnt + 2, count, flags);
+}
+static ssize_t handle_fd_writev_flags(int fd, struct iovec const *iov,
+                                      int iovcnt, int flags) {
+    if (handle_recursive > 0) {
+        return writev_flags(fd, iov, iovcnt, flags);
+    }
+
+    /* Don't overflow writev()'s ssize_t result, see handle_fd_write(). */
+    size_t max = (size_t)SSIZE_MAX - state.pre_string_size
+                                   - state.post_string_size;
+    size_t count = 0;
+    int i;
+    for (i = 0; i < iovcnt; i++) {
+        if (unlikely(iov[i].iov_len > max - count)) {
+            count = max + 1;
+            break;
+        }
+        count += iov[i].iov_len;
+    }
+    /* Nothing to color, also handles invalid counts. */
+    if (count == 0) {
+        return writev_flags(fd, iov, iovcnt, flags);
+    }
+
+    line_buffer_flush();
+
+    /* No room for the pre/post string, use separate system calls. */
+    if (unlikely(count > max || iovcnt > IOV_MAX - 2)) {
+        handle_fd_pre(fd);
+        ssize_t result = writev_flags(fd, iov, iovcnt, flags);
+        handle_fd_post(fd);
+        return result;
+    }
+
+    if (likely(iovcnt <= WRITEV_STACK_COUNT - 2)) {
+        struct iovec copy[WRITEV_STACK_COUNT];
+        memcpy(copy + 1, iov, (size_t)iovcnt * sizeof(*iov));
+        return writev_colored(fd, copy, iovcnt + 2, count, flags);
+    }
+    return writev_colored_large(fd, iov, iovcnt, count, flags);
+}
+static ssize_t handle_fd_writev(int fd, struct iovec const *iov,
+                                int iovcnt) noinline;
+static ssize_t handle_fd_writev(int fd, struct iovec const *iov,
+                                int iovcnt) {
+    return handle_fd_writev_flags(fd, iov, iovcnt, 0);
+}
+#ifdef HAVE_PWRITEV2
+static ssize_t handle_fd_pwritev2(int fd, struct iovec const *iov,
+                                  int iovcnt, off_t offset,
+                                  int flags) noinline;
+/* Only writes at the current position (offset -1) are colored. Writes to an
+ * explicit offset fail on terminals and pipes and the pre/post string would
+ * move the data in regular files. */
+static ssize_t handle_fd_pwritev2(int fd, struct iovec const *iov,
+                                  int iovcnt, off_t offset, int flags) {
+    if (offset != -1) {
+        return real_pwritev2(fd, iov, iovcnt, offset, flags);
+    }
+    return handle_fd_writev_flags(fd, iov, iovcnt, flags);
+}
+#endif
+
+#ifdef HAVE_TRANSFER
+/* Zero-copy transfers move the data inside the kernel, the pre/post strings
+ * can't be written in the same system call. */
+
+/* Can a transfer from in_fd to out_fd proceed? Invalid descriptors fail
+ * with EBADF. Blocking descriptors wait until the transfer can proceed, only
+ * nonblocking ones (or nonblock) need poll(): if they aren't ready the
+ * transfer fails with EAGAIN and an input at end of file transfers nothing.
+ * Regular files are always ready. */
+static int transfer_ready(int in_fd, int out_fd, int nonblock) {
+    if (in_fd < 0 || out_fd < 0) {
+        return 0;
+    }
+
+    int flags[2];
+    flags[0] = fcntl(in_fd, F_GETFL);
+    flags[1] = fcntl(out_fd, F_GETFL);
+    if (flags[0] == -1 || flags[1] == -1) {
+        return 0;
+    }
+    if (!nonblock && !((flags[0] | flags[1]) & O_NONBLOCK)) {
+        return 1;
+    }
+
+    struct pollfd fds[2];
+    fds[0].fd     = in_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd     = out_fd;
+    fds[1].events = POLLOUT;
+    /* Unknown, try to color it. */
+    if (poll(fds, 2, 0) == -1) {
+        return 1;
+    }
+
+    size_t i;
+    for (i = 0; i < 2; i++) {
+        short revents = fds[i].revents;
+        if (revents & fds[i].events) {
+            if (revents & (POLLERR | POLLNVAL)) {
+                return 0;
+            }
+            continue;
+        }
+        /* Closed (e.g. end of file of a pipe) or an error. */
+        if (revents != 0) {
+            return 0;
+        }
+        if (nonblock || (flags[i] & O_NONBLOCK)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Called before a transfer of count bytes from in_fd to the handled fd.
+ * Returns 1 if the pre string was written and transfer_post() must be
+ * called. */
+static int transfer_pre(int fd, int in_fd, size_t count, int nonblock) {
+    /* Nothing to color, see handle_fd_write(). */
+    if (handle_recursive > 0 || count == 0) {
+        return 0;
+    }
+
+    int saved_errno = errno;
+
+    line_buffer_flush();
+
+    int ready = transfer_ready(in_fd, fd, nonblock);
+    if (ready && !color_continue(fd)) {
+        write_all(fd, state.pre_string, state.pre_string_size);
+    }
+
+    errno = saved_errno;
+    return ready;
+}
+/* Called after the transfer if transfer_pre() returned 1. The post string
+ * resets the color even if the transfer failed after the pre string was
+ * written (e.g. end of a regular file or the destination failed meanwhile).
+ * errno of the transfer is kept. */
+static ssize_t transfer_post(int fd, ssize_t result) {
+    if (color_deferrable()) {
+        color_defer(fd);
+        return result;
+    }
+
+    int saved_errno = errno;
+
+    write_all(fd, state.post_string, state.post_string_size);
+
+    errno = saved_errno;
+    return result;
+}
+#endif
+#ifdef HAVE_SENDFILE
+static ssize_t handle_fd_sendfile(int out_fd, int in_fd, off_t *offset,
+                                  size_t count) noinline;
+static ssize_t handle_fd_sendfile(int out_fd, int in_fd, off_t *offset,
+                                  size_t count) {
+    if (!transfer_pre(out_fd, in_fd, count, 0)) {
+        return real_sendfile(out_fd, in_fd, offset, count);
+    }
+    return transfer_post(out_fd, real_sendfile(out_fd, in_fd, offset, count));
+}
+#endif
+#ifdef HAVE_SPLICE
+static ssize_t handle_fd_splice(int fd_in, off64_t *off_in, int fd_out,
+                                off64_t *off_out, size_t len,
+                                unsigned int flags) noinline;
+static ssize_t handle_fd_splice(int fd_in, off64_t *off_in, int fd_out,
+                                off64_t *off_out, size_t len,
+                                unsigned int flags) {
+    if (!transfer_pre(fd_out, fd_in, len,
+                      (flags & SPLICE_F_NONBLOCK) != 0)) {
+        return real_splice(fd_in, off_in, fd_out, off_out, len, flags);
+    }
+    return transfer_post(fd_out,
+            real_splice(fd_in, off_in, fd_out, off_out, len, flags));
+}
+#endif
+#ifdef HAVE_COPY_FILE_RANGE
+static ssize_t handle_fd_copy_file_range(int fd_in, off64_t *off_in,
+                                         int fd_out, off64_t *off_out,
+                                         size_t len,
+                                         unsigned int flags) noinline;
+static ssize_t handle_fd_copy_file_range(int fd_in, off64_t *off_in,
+                                         int fd_out, off64_t *off_out,
+                                         size_t len, unsigned int flags) {
+    if (!transfer_pre(fd_out, fd_in, len, 0)) {
+        return real_copy_file_range(fd_in, off_in, fd_out, off_out, len,
+                                    flags);
+    }
+    return transfer_post(fd_out,
+            real_copy_file_range(fd_in, off_in, fd_out, off_out, len, flags));
+}
+#endif
+
+/* Write buffer with the pre/post string, continue after short writes. Returns
+ * 0 on success and -1 on errors. */
+static int write_colored_all(int fd, char const *buffer, size_t length) {
+    size_t written = 0;
+    while (written < length) {
+        ssize_t result = handle_fd_write(fd, buffer + written,
+                                         length - written);
+        if (result < 0) {
+            return -1;
+        }
+        written += (size_t)result;
+    }
+    return 0;
+}
+
+/* vdprintf() writes the formatted output with a separate write() for each
+ * part of the format. Format it into a buffer on the stack instead and write
+ * it with the pre/post string in a single writev(). Larger outputs are
+ * written directly between pre and post string. Short writes are continued
+ * like vdprintf() does. */
+#ifdef HAVE_VDPRINTF
+static int handle_fd_vdprintf(int fd, char const *format,
+                              va_list ap) noinline;
+static int handle_fd_vdprintf(int fd, char const *format, va_list ap) {
+    if (handle_recursive > 0) {
+        return real_vdprintf(fd, format, ap);
+    }
+
+    char buffer[DPRINTF_BUFFER_SIZE];
+    va_list copy;
+    va_copy(copy, ap);
+
+    int result = vsnprintf(buffer, sizeof(buffer), format, ap);
+    if (likely(result >= 0 && (size_t)result < sizeof(buffer))) {
+        if (write_colored_all(fd, buffer, (size_t)result) != 0) {
+            result = -1;
+        }
+    } else {
+        handle_fd_pre(fd);
+        result = real_vdprintf(fd, format, copy);
+        handle_fd_post(fd);
+    }
+
+    va_end(copy);
+    return result;
+}
+#endif
+#if defined(HAVE___VDPRINTF_CHK) && defined(HAVE___VSNPRINTF_CHK)
+/* Only declared by glibc with -D_FORTIFY_SOURCE. */
+extern int __vsnprintf_chk(char *, size_t, int, size_t, char const *,
+                           va_list);
+
+static int handle_fd_vdprintf_chk(int fd, int flag, char const *format,
+                                  va_list ap) noinline;
+/* Like handle_fd_vdprintf(), but keeps the checks of flag. */
+static int handle_fd_vdprintf_chk(int fd, int flag, char const *format,
+                                  va_list ap) {
+    if (handle_recursive > 0) {
+        return real___vdprintf_chk(fd, flag, format, ap);
+    }
+
+    char buffer[DPRINTF_BUFFER_SIZE];
+    va_list copy;
+    va_copy(copy, ap);
+
+    int result = __vsnprintf_chk(buffer, sizeof(buffer), flag,
+                                 sizeof(buffer), format, ap);
+    if (likely(result >= 0 && (size_t)result < sizeof(buffer))) {
+        if (write_colored_all(fd, buffer, (size_t)result) != 0) {
+            result = -1;
+        }
+    } else {
+        handle_fd_pre(fd);
+        result = real___vdprintf_chk(fd, flag, format, copy);
+        handle_fd_post(fd);
+    }
+
+    va_end(copy);
+    return result;
+}
+#endif
+
+/* The libc writes the messages of error(), warn(), perror(), etc. in multiple
+ * parts, each with a separate write() (and pre/post string). Format the whole
+ * message into a buffer on the stack instead and write it with the pre/post
+ * string in a single writev(). Longer messages are written in parts as
+ * before. */
+struct diagnostic {
+    char buffer[DIAGNOSTIC_BUFFER_SIZE];
+    size_t length;
+    /* The message didn't fit in the buffer. */
+    int truncated;
+};
+
+/* Append to the message, diagnostic NULL writes to stderr instead. */
+static void diagnostic_vprintf(struct diagnostic *diagnostic,
+                               char const *format, va_list ap) {
+    if (!diagnostic) {
+        vfprintf(stderr, format, ap);
+        return;
+    }
+    if (diagnostic->truncated) {
+        return;
+    }
+
+    size_t space = sizeof(diagnostic->buffer) - diagnostic->length;
+    int result = vsnprintf(diagnostic->buffer + diagnostic->length, space,
+                           format, ap);
+    if (result < 0 || (size_t)result >= space) {
+        diagnostic->truncated = 1;
+        return;
+    }
+    diagnostic->length += (size_t)result;
+}
+static void diagnostic_printf(struct diagnostic *diagnostic,
+                              char const *format, ...) {
+    va_list ap;
+
+    va_start(ap, format);
+    diagnostic_vprintf(diagnostic, format, ap);
+    va_end(ap);
+}
+/* Append the message for errnum, strerror() is not thread-safe. */
+static void diagnostic_strerror(struct diagnostic *diagnostic, int errnum) {
+    char buffer[256];
+    char const *message;
+
+#if defined(HAVE_DECL_STRERROR_R) && HAVE_DECL_STRERROR_R
+# ifdef STRERROR_R_CHAR_P
+    message = strerror_r(errnum, buffer, sizeof(buffer));
+# else
+    message = buffer;
+    if (strerror_r(errnum, buffer, sizeof(buffer)) != 0) {
+        snprintf(buffer, sizeof(buffer), "Unknown error %d", errnum);
+    }
+# endif
+#else
+    (void)buffer;
+    message = strerror(errnum);
 #endif
+    diagnostic_printf(diagnostic, "%s", message);
+}
+static void diagnostic_init(struct diagnostic *diagnostic) {
+    /* Don't clear the buffer. */
+    diagnostic->length    = 0;
+    diagnostic->truncated = 0;
+}
+/* Write the message to stderr. Returns 0 if the caller must write it in
+ * parts, e.g. because it didn't fit in the buffer. */
+static int diagnostic_write(struct diagnostic *diagnostic) {
+    if (diagnostic->truncated) {
+        return 0;
+    }
 
-#include "hookmacros.h"
-#include "trackfds.h"
+    /* Keep the order with output still in the buffer of stderr. */
+    fflush(stderr);
+    int fd = fileno(stderr);
+    if (fd < 0 || !hook_handle(fd)) {
+        return 0;
+    }
+    write_colored_all(fd, diagnostic->buffer, diagnostic->length);
+    return 1;
+}
+/* The libc uses the wide functions for wide-oriented streams. */
+static int diagnostic_possible(void) {
+    if (handle_recursive > 0) {
+        return 0;
+    }
+#ifdef HAVE_WCHAR_H
+    if (fwide(stderr, 0) > 0) {
+        return 0;
+    }
+#endif
+    return 1;
+}
 
+static void handle_perror(void (*real)(char const *), char const *s) noinline;
+static void handle_perror(void (*real)(char const *), char const *s) {
+    int saved_errno = errno;
 
+    if (diagnostic_possible()) {
+        struct diagnostic diagnostic;
+        diagnostic_init(&diagnostic);
 
-/* See hookmacros.h for the decision if a function call is colored. */
+        /* Like glibc. */
+        if (s && *s) {
+            diagnostic_printf(&diagnostic, "%s: ", s);
+        }
+        diagnostic_strerror(&diagnostic, saved_errno);
+        diagnostic_printf(&diagnostic, "\n");
 
+        if (diagnostic_write(&diagnostic)) {
+            errno = saved_errno;
+            return;
+        }
+        errno = saved_errno;
+    }
 
-/* Prevent inlining into hook functions because it may increase the number of
- * spilled registers unnecessarily. As it's not called very often accept the
- * additional call. */
-static int isatty_noinline(int fd) noinline;
-static int isatty_noinline(int fd) {
-    assert(fd >= 0);
+    handle_fd_pre(STDERR_FILENO);
+    errno = saved_errno;
+    real(s);
+    handle_fd_post(STDERR_FILENO);
+}
 
+#if defined(HAVE_ERR_H) && defined(HAVE_DECL_PROGRAM_INVOCATION_SHORT_NAME) \
+        && HAVE_DECL_PROGRAM_INVOCATION_SHORT_NAME
+# define DIAGNOSTIC_WARN 1
+/* Like glibc's vwarn() (with_errno = 1) and vwarnx(). */
+static void handle_vwarn_common(void (*real)(char const *, va_list),
+                                int with_errno,
+                                char const *fmt, va_list ap) {
     int saved_errno = errno;
-    int result = isatty(fd);
+
+    if (diagnostic_possible()) {
+        struct diagnostic diagnostic;
+        diagnostic_init(&diagnostic);
+
+        /* __progname in glibc */
+        diagnostic_printf(&diagnostic, "%s: ",
+                          program_invocation_short_name);
+        if (fmt) {
+            va_list copy;
+            va_copy(copy, ap);
+            diagnostic_vprintf(&diagnostic, fmt, copy);
+            va_end(copy);
+            if (with_errno) {
+                diagnostic_printf(&diagnostic, ": ");
+            }
+        }
+        if (with_errno) {
+            diagnostic_strerror(&diagnostic, saved_errno);
+        }
+        diagnostic_printf(&diagnostic, "\n");
+
+        if (diagnostic_write(&diagnostic)) {
+            errno = saved_errno;
+            return;
+        }
+        errno = saved_errno;
+    }
+
+    handle_fd_pre(STDERR_FILENO);
     errno = saved_errno;
+    real(fmt, ap);
+    handle_fd_post(STDERR_FILENO);
+}
+static void handle_vwarn(void (*real)(char const *, va_list),
+                         char const *fmt, va_list ap) noinline;
+static void handle_vwarn(void (*real)(char const *, va_list),
+                         char const *fmt, va_list ap) {
+    handle_vwarn_common(real, 1, fmt, ap);
+}
+static void handle_vwarnx(void (*real)(char const *, va_list),
+                          char const *fmt, va_list ap) noinline;
+static void handle_vwarnx(void (*real)(char const *, va_list),
+                          char const *fmt, va_list ap) {
+    handle_vwarn_common(real, 0, fmt, ap);
+}
+#endif
+
+/* Writing to an unbuffered stream (e.g. stderr) causes a write() for the pre
+ * string, at least one for the data and one for the post string. To use only
+ * a single system call, the stream gets a temporary (per-thread) buffer for
+ * the duration of the hooked call which is flushed and removed in
+ * handle_file_post(). The stream stays locked meanwhile so other threads
+ * can't write into our buffer.
+ *
+ * Output errors are only reported when the buffer is flushed. Then the
+ * buffered data is dropped (like an unbuffered stream would have lost it) and
+ * the hooked function returns its error value, see _HOOK_FILE_ERROR().
+ *
+ * Only possible with glibc where we can check if the stream is unbuffered,
+ * and requires TLS. */
+#if defined(HAVE_STRUCT__IO_FILE__FILENO) && defined(HAVE_TLS)
+/* Internal flags in glibc, not exported by newer versions. */
+# ifndef _IO_UNBUFFERED
+#  define _IO_UNBUFFERED 0x0002
+# endif
+# ifndef _IO_ERR_SEEN
+#  define _IO_ERR_SEEN 0x0020
+# endif
+# ifndef _IO_CURRENTLY_PUTTING
+#  define _IO_CURRENTLY_PUTTING 0x0800
+# endif
+# define STAGE_UNBUFFERED_STREAMS 1
+
+static TLS char staging_buffer[STAGING_BUFFER_SIZE];
+/* Stream currently using staging_buffer (if any). */
+static TLS FILE *staging_stream;
+
+static void staging_start(FILE *stream) {
+    if (!(stream->_flags & _IO_UNBUFFERED)) {
+        return;
+    }
 
+    flockfile(stream);
+    if (setvbuf(stream, staging_buffer, _IOFBF, sizeof(staging_buffer))) {
+        funlockfile(stream);
+        return;
+    }
+    /* setvbuf() resets the write pointers but keeps this flag if the stream
+     * was already written to. glibc then doesn't set up the new buffer for
+     * writing and flushes it on the first write. */
+    stream->_flags &= ~_IO_CURRENTLY_PUTTING;
+    staging_stream = stream;
+}
+/* Returns -1 (with errno set) if the buffer couldn't be written. */
+static int staging_end(FILE *stream) {
+    if (staging_stream != stream) {
+        return 0;
+    }
+    staging_stream = NULL;
+
+    int result = 0;
+    /* Flushes the buffer (a single write()) and restores the unbuffered
+     * mode. On errors the buffer is kept, drop the data or the stream would
+     * keep using our buffer. */
+    if (setvbuf(stream, NULL, _IONBF, 0) != 0) {
+        int saved_errno = errno;
+# ifdef HAVE___FPURGE
+        __fpurge(stream);
+# endif
+        setvbuf(stream, NULL, _IONBF, 0);
+        stream->_flags |= _IO_ERR_SEEN;
+        errno = saved_errno;
+        result = -1;
+    }
+    funlockfile(stream);
     return result;
 }
+#endif
+
+/* Writing to a buffered stream (e.g. stdout redirected to stderr) copies the
+ * pre and post string of each call into the buffer of the stream. If enabled
+ * with ENV_NAME_MERGE_BUFFERED, a call directly following a colored call on
+ * the same stream removes the post string which is still at the end of the
+ * buffer and skips the pre string. Each flushed buffer then contains a single
+ * pre/post string per colored region instead of one pair per call.
+ *
+ * glibc writes the buffer to the descriptor with internal functions which
+ * can't be hooked, so the flushed data can't be colored directly.
+ *
+ * Rewinding the write pointer depends on the layout of glibc's FILE which is
+ * checked by configure (HAVE_IO_WRITE_PTR). Otherwise each call keeps its
+ * pre/post string. */
+#if defined(STAGE_UNBUFFERED_STREAMS) && defined(HAVE_IO_WRITE_PTR)
+# define MERGE_BUFFERED_STREAMS 1
+
+# ifdef HAVE_SYS_SINGLE_THREADED_H
+#  define single_threaded() __libc_single_threaded
+# else
+#  define single_threaded() 0
+# endif
+
+static int merge_buffered_enabled;
+/* Stream and its write pointer directly after our last post string. */
+static TLS FILE *merge_stream;
+static TLS char *merge_ptr;
+
+/* Remove the post string of the previous call if nothing was written to the
+ * stream since. Returns 1 if the pre string must be skipped. */
+static int merge_continue(FILE *stream) {
+    if (merge_stream != stream) {
+        return 0;
+    }
+    merge_stream = NULL;
 
+    size_t size = state.post_string_size;
+    int continued = 0;
 
-static void dup_fd(int oldfd, int newfd) {
-#ifdef DEBUG
-    debug("%3d -> %3d\t\t\t[%d]\n", oldfd, newfd, getpid());
+    /* Locking is expensive compared to the rest of this function, but other
+     * threads must not write to the buffer meanwhile. */
+    int locked = !single_threaded();
+    if (locked) {
+        flockfile(stream);
+    }
+    char *ptr = stream->_IO_write_ptr;
+    /* Also compare the buffer in case it was flushed and filled again (e.g.
+     * by putc_unlocked() which doesn't call a hooked function). */
+    if (ptr == merge_ptr && stream->_mode <= 0
+            && (size_t)(ptr - stream->_IO_write_base) >= size
+            && !memcmp(ptr - size, state.post_string, size)) {
+        stream->_IO_write_ptr = ptr - size;
+        continued = 1;
+    }
+    if (locked) {
+        funlockfile(stream);
+    }
+
+    return continued;
+}
+/* Remember the position of the post string just written to stream. */
+static void merge_record(FILE *stream) {
+    if (stream->_flags & _IO_UNBUFFERED) {
+        return;
+    }
+    merge_stream = stream;
+    merge_ptr = stream->_IO_write_ptr;
+}
 #endif
 
-    assert(oldfd >= 0 && newfd >= 0);
+/* Programs writing single characters (fputc(), putc(), ...) to an unbuffered
+ * stream cause a write() with pre and post string for each character. If
+ * enabled with ENV_NAME_LINE_BUFFER, the characters are collected per thread
+ * and written together with the pre/post string in a single write() at the
+ * end of the line or when the buffer is full. The buffer is also flushed
+ * before any other output of this thread to a tracked descriptor, before
+ * reading input, by fflush()/fclose() and before exec*(), fork() and exit.
+ * Complete lines can't be interleaved with output of other threads or
+ * processes.
+ *
+ * The buffers are taken from a static pool so they are still valid at exit
+ * when other threads might have unfinished lines. */
+#if defined(STAGE_UNBUFFERED_STREAMS) \
+        && defined(HAVE___SYNC_BOOL_COMPARE_AND_SWAP)
+# define LINE_BUFFER 1
+
+struct line_buffer {
+    FILE *stream;
+    size_t count;
+    /* Claimed by a thread, see line_buffer_get(). */
+    int used;
+    char data[LINE_BUFFER_SIZE];
+};
+static struct line_buffer line_buffers[LINE_BUFFER_SLOTS];
+/* Buffer of this thread, NULL if not yet used. */
+static TLS struct line_buffer *line_buffer;
+/* Set by line_buffer_init(), cleared when exiting. */
+static int line_buffer_enabled;
+# ifdef HAVE_PTHREAD_KEY_CREATE
+/* Used to flush and release the buffer when the thread exits. */
+static pthread_key_t line_buffer_key;
+# endif
+
+/* Write the collected characters with the pre/post string. Called by
+ * handle_*_pre() before they write anything, so it can't use them. */
+static void line_buffer_write(struct line_buffer *buffer) {
+    size_t count = buffer->count;
+    if (count == 0) {
+        return;
+    }
+    buffer->count = 0;
+
+    int saved_errno = errno;
 
-    if (unlikely(!initialized)) {
-        init_from_environment();
+    FILE *stream = buffer->stream;
+    int fd = _HOOK_FILENO(stream);
+    int continued = color_continue(fd);
+    staging_start(stream);
+    if (!continued) {
+        real_fwrite(state.pre_string, state.pre_string_size, 1, stream);
+    }
+    real_fwrite(buffer->data, 1, count, stream);
+    int deferred = staging_stream == stream && color_deferrable();
+    if (!deferred) {
+        real_fwrite(state.post_string, state.post_string_size, 1, stream);
+    }
+    staging_end(stream);
+    if (deferred) {
+        color_defer(fd);
     }
 
-    /* We are already tracking this file descriptor, add newfd to the list as
-     * it will reference the same descriptor. */
-    if (tracked_fds_find(oldfd)) {
-        if (!tracked_fds_find(newfd)) {
-            tracked_fds_add(newfd);
+    errno = saved_errno;
+}
+/* Flush the buffer of this thread if it contains anything. */
+inline static void line_buffer_flush(void) always_inline;
+inline static void line_buffer_flush(void) {
+    if (unlikely(line_buffer != NULL && line_buffer->count != 0)) {
+        line_buffer_write(line_buffer);
+    }
+}
+/* Flush the buffer of this thread if it's used for stream, or if stream is
+ * NULL (like fflush(NULL)). */
+static void line_buffer_flush_stream(FILE *stream) {
+    if (line_buffer != NULL
+            && (stream == NULL || stream == line_buffer->stream)) {
+        line_buffer_write(line_buffer);
+    }
+}
+/* Flush all buffers, used by output_exit(). Other threads might still write to
+ * their buffer, but a lost character is better than losing the lines. */
+static void line_buffer_flush_all(void) {
+    size_t i;
+
+    line_buffer_enabled = 0;
+    for (i = 0; i < LINE_BUFFER_SLOTS; i++) {
+        if (line_buffers[i].used) {
+            line_buffer_write(&line_buffers[i]);
         }
-    /* We are not tracking this file descriptor, remove newfd from the list
-     * (if present). */
-    } else {
-        tracked_fds_remove(newfd);
     }
 }
 
-static void close_fd(int fd) {
-#ifdef DEBUG
-    debug("%3d ->   .\t\t\t[%d]\n", fd, getpid());
-#endif
-
-    assert(fd >= 0);
+static struct line_buffer *line_buffer_get(void) {
+    size_t i;
 
-    if (unlikely(!initialized)) {
-        init_from_environment();
+    for (i = 0; i < LINE_BUFFER_SLOTS; i++) {
+        if (__sync_bool_compare_and_swap(&line_buffers[i].used, 0, 1)) {
+            line_buffer = &line_buffers[i];
+# ifdef HAVE_PTHREAD_KEY_CREATE
+            pthread_setspecific(line_buffer_key, line_buffer);
+# endif
+            return line_buffer;
+        }
     }
+    /* All buffers used, write unbuffered. */
+    return NULL;
+}
+# ifdef HAVE_PTHREAD_KEY_CREATE
+static void line_buffer_thread_exit(void *buffer) {
+    assert(buffer == line_buffer);
 
-    tracked_fds_remove(fd);
+    line_buffer_flush();
+    line_buffer = NULL;
+    __sync_lock_release(&((struct line_buffer *)buffer)->used);
+}
+# endif
+# ifdef HAVE_PTHREAD_ATFORK
+/* Only this thread exists in the child. Drop the (already written) lines of
+ * all other threads. */
+static void line_buffer_fork_child(void) {
+    size_t i;
+
+    for (i = 0; i < LINE_BUFFER_SLOTS; i++) {
+        if (&line_buffers[i] != line_buffer) {
+            line_buffers[i].count = 0;
+            line_buffers[i].used = 0;
+        }
+    }
+}
+# endif
+
+/* Write c to the buffer instead of stream? Only for tracked descriptors. */
+static int line_buffer_usable(FILE *stream, int c) noinline;
+static int line_buffer_usable(FILE *stream, int c) {
+    /* Not for recursive calls (the caller wrote the pre string) and
+     * __overflow(stream, EOF) which only flushes. */
+    if (handle_recursive > 0 || c == EOF) {
+        return 0;
+    }
+    /* Buffered streams already collect the output, and our buffer would
+     * reorder it with their inlined writes. */
+    if (!(stream->_flags & _IO_UNBUFFERED)) {
+        return 0;
+    }
+# ifdef HAVE_VFORK_TRAMPOLINE
+    /* The child shares our buffer. */
+    if (vfork_child) {
+        return 0;
+    }
+# endif
+    return line_buffer != NULL || line_buffer_get() != NULL;
+}
+inline static int line_buffer_use(FILE *stream, int c) always_inline;
+inline static int line_buffer_use(FILE *stream, int c) {
+    return unlikely(line_buffer_enabled) && line_buffer_usable(stream, c);
+}
+/* Only called if line_buffer_use() returned 1. */
+static int line_buffer_putc(FILE *stream, int c) noinline;
+static int line_buffer_putc(FILE *stream, int c) {
+    struct line_buffer *buffer = line_buffer;
+
+    if (buffer->stream != stream) {
+        line_buffer_write(buffer);
+        buffer->stream = stream;
+    }
+    buffer->data[buffer->count++] = (char)c;
+    if (c == '\n' || buffer->count == sizeof(buffer->data)) {
+        line_buffer_write(buffer);
+    }
+    return (unsigned char)c;
 }
 
+static void line_buffer_init(struct environment const *environment) {
+    char const *env = environment->line_buffer;
+    if (!env || env[0] == '\0') {
+        return;
+    }
 
-/* "Action" handlers called when a file descriptor is matched. */
+# ifdef HAVE_PTHREAD_KEY_CREATE
+    if (pthread_key_create(&line_buffer_key, line_buffer_thread_exit)) {
+        return;
+    }
+# endif
+    line_buffer_enabled = 1;
+}
+
+#else
+inline static void line_buffer_flush(void) {
+}
+# define line_buffer_init(environment)
+# define line_buffer_flush_stream(stream)
+# define line_buffer_flush_all()
+# define line_buffer_use(stream, c) 0
+# define line_buffer_putc(stream, c) (c)
+# define line_buffer_fork_child NULL
+# define line_buffer_enabled 0
+#endif
 
-static char const *pre_string;
-static size_t pre_string_size;
-static char const *post_string;
-static size_t post_string_size;
+static void output_init(struct environment const *environment) {
+    line_buffer_init(environment);
 
-/* Load alternative pre/post strings from the environment if available, fall
- * back to default values. */
-static void init_pre_post_string(void) {
-    pre_string = getenv(ENV_NAME_PRE_STRING);
-    if (!pre_string) {
-        pre_string = DEFAULT_PRE_STRING;
+    char const *env = environment->defer_post;
+    if (env && env[0] != '\0') {
+        color_defer_enabled = 1;
     }
-    pre_string_size = strlen(pre_string);
+#ifdef MERGE_BUFFERED_STREAMS
+    env = environment->merge_buffered;
+    if (env && env[0] != '\0') {
+        merge_buffered_enabled = 1;
+    }
+#endif
 
-    post_string = getenv(ENV_NAME_POST_STRING);
-    if (!post_string) {
-        post_string = DEFAULT_POST_STRING;
+    output_flush_enabled = line_buffer_enabled || color_defer_enabled;
+
+#ifdef HAVE_PTHREAD_ATFORK
+    /* The child must not write our pending output again or continue our
+     * color. */
+    if (output_flush_enabled) {
+        pthread_atfork(output_flush, NULL, line_buffer_fork_child);
     }
-    post_string_size = strlen(post_string);
+#endif
 }
+/* Write all pending output when exiting (also called by _exit()). */
+static void output_exit(void) destructor;
+static void output_exit(void) {
+#ifdef HAVE_VFORK_TRAMPOLINE
+    /* Pending output belongs to the parent. */
+    if (vfork_child) {
+        return;
+    }
+#endif
 
-/* Don't inline any of the pre/post functions. Keep the hook function as small
- * as possible for speed reasons. */
-static void handle_fd_pre(int fd) noinline;
-static void handle_fd_post(int fd) noinline;
-static void handle_file_pre(FILE *stream) noinline;
-static void handle_file_post(FILE *stream) noinline;
+    line_buffer_flush_all();
+    /* Output written after this point (e.g. by destructors of other
+     * libraries) isn't deferred. */
+    color_defer_enabled = 0;
+    color_reset_pending();
+}
 
-static void handle_fd_pre(int fd) {
+static void handle_file_pre(FILE *stream) {
     if (handle_recursive++ > 0) {
         return;
     }
 
     int saved_errno = errno;
 
-    if (unlikely(!pre_string)) {
-        init_pre_post_string();
+    line_buffer_flush();
+
+    /* Only unbuffered streams write the data to the descriptor before the
+     * post string is deferred, see handle_file_post(). */
+    int continued = 0;
+#ifdef STAGE_UNBUFFERED_STREAMS
+    if (stream->_flags & _IO_UNBUFFERED) {
+        continued = color_continue(_HOOK_FILENO(stream));
     }
+#endif
+    if (!continued) {
+        color_reset_pending();
+    }
+#ifdef MERGE_BUFFERED_STREAMS
+    if (merge_buffered_enabled && !(stream->_flags & _IO_UNBUFFERED)) {
+        continued = merge_continue(stream);
+    }
+#endif
 
-    DLSYM_FUNCTION(real_write, "write");
-    real_write(fd, pre_string, pre_string_size);
+#ifdef STAGE_UNBUFFERED_STREAMS
+    staging_start(stream);
+#endif
+
+    if (!continued) {
+        real_fwrite(state.pre_string, state.pre_string_size, 1, stream);
+    }
 
     errno = saved_errno;
 }
-static void handle_fd_post(int fd) {
+/* Returns -1 if the output of the hooked function couldn't be written (only
+ * detected for unbuffered streams), errno is set. */
+static int handle_file_post(FILE *stream) {
     if (--handle_recursive > 0) {
-        return;
+        return 0;
     }
 
     int saved_errno = errno;
+    int result = 0;
+
+    int deferred = 0;
+#ifdef STAGE_UNBUFFERED_STREAMS
+    deferred = staging_stream == stream && color_deferrable();
+#endif
+    if (!deferred) {
+        real_fwrite(state.post_string, state.post_string_size, 1, stream);
+    }
 
-    /* write() already loaded above in handle_fd_pre(). */
-    real_write(fd, post_string, post_string_size);
+#ifdef STAGE_UNBUFFERED_STREAMS
+    if (staging_end(stream) != 0) {
+        saved_errno = errno;
+        result = -1;
+    }
+#endif
+    if (deferred && result == 0) {
+        color_defer(_HOOK_FILENO(stream));
+    }
+#ifdef MERGE_BUFFERED_STREAMS
+    if (merge_buffered_enabled) {
+        merge_record(stream);
+    }
+#endif
 
     errno = saved_errno;
+    return result;
 }
 
-static void handle_file_pre(FILE *stream) {
-    if (handle_recursive++ > 0) {
+
+/* Wide-oriented streams (see fwide(3)) ignore fwrite(), the pre/post strings
+ * are converted to wide characters and written with fputws() instead.
+ *
+ * Unbuffered wide streams (e.g. stderr) convert and write each character
+ * separately. With glibc the output of a call to such a stream is therefore
+ * converted here and written with the pre/post string in a single write(),
+ * see wide_write(). */
+#ifdef HAVE_WCHAR_H
+
+/* Write the narrow pre/post string s to the wide stream. */
+static void wide_fputs(char const *s, FILE *stream) {
+    wchar_t buffer[WIDE_BUFFER_SIZE];
+    mbstate_t ps;
+    memset(&ps, 0, sizeof(ps));
+
+    char const *src = s;
+    size_t count = mbsrtowcs(buffer, &src, WIDE_BUFFER_SIZE, &ps);
+    if (likely(count != (size_t)-1 && src == NULL)) {
+        real_fputws(buffer, stream);
         return;
     }
 
-    int saved_errno = errno;
+    /* Too long or invalid in the current locale, write it byte by byte. */
+    for (; *s != '\0'; s++) {
+        wint_t c = btowc((unsigned char)*s);
+        if (c != WEOF) {
+            real_fputwc((wchar_t)c, stream);
+        }
+    }
+}
 
-    if (unlikely(!pre_string)) {
-        init_pre_post_string();
+static void handle_wfile_pre(FILE *stream) noinline;
+static void handle_wfile_post(FILE *stream) noinline;
+
+static void handle_wfile_pre(FILE *stream) {
+    if (handle_recursive++ > 0) {
+        return;
     }
 
-    DLSYM_FUNCTION(real_fwrite, "fwrite");
-    real_fwrite(pre_string, pre_string_size, 1, stream);
+    int saved_errno = errno;
+
+    line_buffer_flush();
+    color_reset_pending();
+    wide_fputs(state.pre_string, stream);
 
     errno = saved_errno;
 }
-static void handle_file_post(FILE *stream) {
+static void handle_wfile_post(FILE *stream) {
     if (--handle_recursive > 0) {
         return;
     }
 
     int saved_errno = errno;
 
-    /* fwrite() already loaded above in handle_file_pre(). */
-    real_fwrite(post_string, post_string_size, 1, stream);
+    wide_fputs(state.post_string, stream);
 
     errno = saved_errno;
 }
 
+# ifdef STAGE_UNBUFFERED_STREAMS
+#  define WIDE_WRITE 1
+
+/* Check if wide_write() can be used for stream. Orients the stream like the
+ * wide functions do. */
+static int wide_unbuffered(FILE *stream) {
+    return (stream->_flags & _IO_UNBUFFERED) && fwide(stream, 1) > 0;
+}
+/* Convert count wide characters of s (in the current locale) and write them
+ * with the pre/post string to the unbuffered stream with a single write().
+ * Returns 1 on success, -1 on write errors (visible with ferror()) and 0 if
+ * the output is too large or can't be converted; the caller must use the
+ * real function then which also reports conversion errors. */
+static int wide_write(FILE *stream, wchar_t const *s, size_t count) {
+    char buffer[STAGING_BUFFER_SIZE];
+    size_t max = MB_CUR_MAX;
+    size_t length = 0;
+    mbstate_t ps;
+    memset(&ps, 0, sizeof(ps));
+
+    size_t i;
+    for (i = 0; i < count; i++) {
+        if (length + max > sizeof(buffer)) {
+            return 0;
+        }
+        size_t n = wcrtomb(buffer + length, s[i], &ps);
+        if (n == (size_t)-1) {
+            return 0;
+        }
+        length += n;
+    }
+
+    if (write_colored_all(_HOOK_FILENO(stream), buffer, length) != 0) {
+        stream->_flags |= _IO_ERR_SEEN;
+        return -1;
+    }
+    return 1;
+}
+# endif
+
+static wint_t handle_wfile_fputwc(wint_t (*real)(wchar_t, FILE *),
+                                  wchar_t c, FILE *stream) noinline;
+static wint_t handle_wfile_fputwc(wint_t (*real)(wchar_t, FILE *),
+                                  wchar_t c, FILE *stream) {
+    if (handle_recursive > 0) {
+        return real(c, stream);
+    }
+
+# ifdef WIDE_WRITE
+    if (wide_unbuffered(stream)) {
+        int written = wide_write(stream, &c, 1);
+        if (written != 0) {
+            return written > 0 ? (wint_t)c : WEOF;
+        }
+    }
+# endif
+
+    handle_wfile_pre(stream);
+    wint_t result = real(c, stream);
+    handle_wfile_post(stream);
+    return result;
+}
+static int handle_wfile_fputws(int (*real)(wchar_t const *, FILE *),
+                               wchar_t const *s, FILE *stream) noinline;
+static int handle_wfile_fputws(int (*real)(wchar_t const *, FILE *),
+                               wchar_t const *s, FILE *stream) {
+    if (handle_recursive > 0) {
+        return real(s, stream);
+    }
+
+# ifdef WIDE_WRITE
+    if (wide_unbuffered(stream)) {
+        int written = wide_write(stream, s, wcslen(s));
+        if (written != 0) {
+            /* Like glibc. */
+            return written > 0 ? 1 : EOF;
+        }
+    }
+# endif
+
+    handle_wfile_pre(stream);
+    int result = real(s, stream);
+    handle_wfile_post(stream);
+    return result;
+}
+static int handle_wfile_vfwprintf(int (*real)(FILE *, wchar_t const *,
+                                              va_list),
+                                  FILE *stream, wchar_t const *format,
+                                  va_list ap) noinline;
+/* Like handle_fd_vdprintf(). */
+static int handle_wfile_vfwprintf(int (*real)(FILE *, wchar_t const *,
+                                              va_list),
+                                  FILE *stream, wchar_t const *format,
+                                  va_list ap) {
+    if (handle_recursive > 0) {
+        return real(stream, format, ap);
+    }
+
+    va_list copy;
+    va_copy(copy, ap);
+
+    int result;
+# ifdef WIDE_WRITE
+    if (wide_unbuffered(stream)) {
+        wchar_t buffer[WIDE_BUFFER_SIZE];
+        /* Fails if the output is too large. */
+        result = vswprintf(buffer, WIDE_BUFFER_SIZE, format, ap);
+        if (result >= 0) {
+            int written = wide_write(stream, buffer, (size_t)result);
+            if (written != 0) {
+                va_end(copy);
+                return written > 0 ? result : -1;
+            }
+        }
+    }
+# endif
+
+    handle_wfile_pre(stream);
+    result = real(stream, format, copy);
+    handle_wfile_post(stream);
+
+    va_end(copy);
+    return result;
+}
+# if defined(HAVE___VFWPRINTF_CHK) && defined(HAVE___VSWPRINTF_CHK)
+/* Only declared by glibc with -D_FORTIFY_SOURCE. */
+extern int __vswprintf_chk(wchar_t *, size_t, int, size_t, wchar_t const *,
+                           va_list);
+
+static int handle_wfile_vfwprintf_chk(int (*real)(FILE *, int,
+                                                  wchar_t const *, va_list),
+                                      FILE *stream, int flag,
+                                      wchar_t const *format,
+                                      va_list ap) noinline;
+/* Like handle_wfile_vfwprintf(), but keeps the checks of flag. */
+static int handle_wfile_vfwprintf_chk(int (*real)(FILE *, int,
+                                                  wchar_t const *, va_list),
+                                      FILE *stream, int flag,
+                                      wchar_t const *format, va_list ap) {
+    if (handle_recursive > 0) {
+        return real(stream, flag, format, ap);
+    }
+
+    va_list copy;
+    va_copy(copy, ap);
+
+    int result;
+#  ifdef WIDE_WRITE
+    if (wide_unbuffered(stream)) {
+        wchar_t buffer[WIDE_BUFFER_SIZE];
+        result = __vswprintf_chk(buffer, WIDE_BUFFER_SIZE, flag,
+                                 WIDE_BUFFER_SIZE, format, ap);
+        if (result >= 0) {
+            int written = wide_write(stream, buffer, (size_t)result);
+            if (written != 0) {
+                va_end(copy);
+                return written > 0 ? result : -1;
+            }
+        }
+    }
+#  endif
+
+    handle_wfile_pre(stream);
+    result = real(stream, flag, format, copy);
+    handle_wfile_post(stream);
+
+    va_end(copy);
+    return result;
+}
+# endif
+#endif
 
 
 /* Hook all important output functions to manipulate their output. */
 
-HOOK_FD3(ssize_t, write, fd,
-         int, fd, void const *, buf, size_t, count)
+HOOK_FD_FUSED3(ssize_t, write, fd, handle_fd_write,
+               int, fd, void const *, buf, size_t, count)
+HOOK_FD_FUSED3(ssize_t, writev, fd, handle_fd_writev,
+               int, fd, struct iovec const *, iov, int, iovcnt)
+#ifdef HAVE_PWRITEV2
+HOOK_FD_FUSED5(ssize_t, pwritev2, fd, handle_fd_pwritev2,
+               int, fd, struct iovec const *, iov, int, iovcnt,
+               off_t, offset, int, flags)
+#endif
+
+/* Zero-copy transfers, the data stays in the kernel and only the pre/post
+ * strings are written around it if the transfer can proceed, see
+ * transfer_pre(). The result and errno are returned unchanged. Writes to an
+ * explicit offset of the destination are not colored, see
+ * _HOOK_FD_CURRENT(). */
+#ifdef HAVE_SENDFILE
+HOOK_FD_FUSED4(ssize_t, sendfile, out_fd, handle_fd_sendfile,
+               int, out_fd, int, in_fd, off_t *, offset, size_t, count)
+#endif
+#ifdef HAVE_SPLICE
+HOOK_FD_FUSED6(ssize_t, splice, _HOOK_FD_CURRENT(fd_out, off_out),
+               handle_fd_splice,
+               int, fd_in, off64_t *, off_in, int, fd_out, off64_t *, off_out,
+               size_t, len, unsigned int, flags)
+#endif
+#ifdef HAVE_COPY_FILE_RANGE
+HOOK_FD_FUSED6(ssize_t, copy_file_range, _HOOK_FD_CURRENT(fd_out, off_out),
+               handle_fd_copy_file_range,
+               int, fd_in, off64_t *, off_in, int, fd_out, off64_t *, off_out,
+               size_t, len, unsigned int, flags)
+#endif
+
 HOOK_FILE4(size_t, fwrite, stream,
            void const *, ptr, size_t, size, size_t, nmemb, FILE *, stream)
 
 /* puts(3) */
 HOOK_FILE2(int, fputs, stream,
            char const *, s, FILE *, stream)
-HOOK_FILE2(int, fputc, stream,
-           int, c, FILE *, stream)
-HOOK_FILE2(int, putc, stream,
-           int, c, FILE *, stream)
+HOOK_FILE_CHAR2(int, fputc, stream, c,
+                int, c, FILE *, stream)
+HOOK_FILE_CHAR2(int, putc, stream, c,
+                int, c, FILE *, stream)
 /* The glibc uses a macro for putc() which expands to _IO_putc(). However
  * sometimes the raw putc() is used as well, not sure why. Make sure to hook
  * it too. */
 #ifdef putc
 # undef putc
-HOOK_FILE2(int, putc, stream,
-           int, c, FILE *, stream)
+HOOK_FILE_CHAR2(int, putc, stream, c,
+                int, c, FILE *, stream)
 #endif
-HOOK_FILE1(int, putchar, stdout,
-           int, c)
+HOOK_FILE_CHAR1(int, putchar, stdout, c,
+                int, c)
 HOOK_FILE1(int, puts, stdout,
            char const *, s)
 
@@ -295,6 +2303,75 @@ HOOK_FILE3(int, __vprintf_chk, stdout,
            int, flag, char const *, format, va_list, ap)
 HOOK_FILE4(int, __vfprintf_chk, stream,
            FILE *, stream, int, flag, char const *, format, va_list, ap)
+/* dprintf(3) */
+#ifdef HAVE_VDPRINTF
+HOOK_FD_FUSED3(int, vdprintf, fd, handle_fd_vdprintf,
+               int, fd, char const *, format, va_list, ap)
+HOOK_VAR_FILE2(int, dprintf, fd, vdprintf,
+               int, fd, char const *, format)
+#endif
+#if defined(HAVE___VDPRINTF_CHK) && defined(HAVE___VSNPRINTF_CHK)
+HOOK_FD_FUSED4(int, __vdprintf_chk, fd, handle_fd_vdprintf_chk,
+               int, fd, int, flag, char const *, format, va_list, ap)
+HOOK_VAR_FILE3(int, __dprintf_chk, fd, __vdprintf_chk,
+               int, fd, int, flag, char const *, format)
+#endif
+
+/* wprintf(3) and other wide character output, see handle_wfile_pre(). The
+ * functions writing to stdout use the stream functions which are hooked. */
+#ifdef HAVE_WCHAR_H
+HOOK_WFILE2(wint_t, fputwc, stream, handle_wfile_fputwc,
+            wchar_t, c, FILE *, stream)
+HOOK_WFILE2(wint_t, putwc, stream, handle_wfile_fputwc,
+            wchar_t, c, FILE *, stream)
+HOOK_FUNC_SIMPLE1(wint_t, putwchar, wchar_t, c) {
+    return putwc(c, stdout);
+}
+HOOK_WFILE2(int, fputws, stream, handle_wfile_fputws,
+            wchar_t const *, s, FILE *, stream)
+
+HOOK_WFILE3(int, vfwprintf, stream, handle_wfile_vfwprintf,
+            FILE *, stream, wchar_t const *, format, va_list, ap)
+HOOK_VAR_FILE2(int, fwprintf, stream, vfwprintf,
+               FILE *, stream, wchar_t const *, format)
+HOOK_FUNC_SIMPLE2(int, vwprintf, wchar_t const *, format, va_list, ap) {
+    return vfwprintf(stdout, format, ap);
+}
+HOOK_VAR_FILE1(int, wprintf, stdout, vwprintf,
+               wchar_t const *, format)
+/* Hardening functions (-D_FORTIFY_SOURCE=2) */
+# if defined(HAVE___VFWPRINTF_CHK) && defined(HAVE___VSWPRINTF_CHK)
+HOOK_WFILE4(int, __vfwprintf_chk, stream, handle_wfile_vfwprintf_chk,
+            FILE *, stream, int, flag, wchar_t const *, format, va_list, ap)
+HOOK_VAR_FILE3(int, __fwprintf_chk, stream, __vfwprintf_chk,
+               FILE *, stream, int, flag, wchar_t const *, format)
+HOOK_FUNC_SIMPLE3(int, __vwprintf_chk,
+                  int, flag, wchar_t const *, format, va_list, ap) {
+    return __vfwprintf_chk(stdout, flag, format, ap);
+}
+HOOK_VAR_FILE2(int, __wprintf_chk, stdout, __vwprintf_chk,
+               int, flag, wchar_t const *, format)
+# endif
+
+/* unlocked_stdio(3), only functions from above are hooked */
+# ifdef HAVE_FPUTWC_UNLOCKED
+HOOK_WFILE2(wint_t, fputwc_unlocked, stream, handle_wfile_fputwc,
+            wchar_t, c, FILE *, stream)
+# endif
+# ifdef HAVE_PUTWC_UNLOCKED
+HOOK_WFILE2(wint_t, putwc_unlocked, stream, handle_wfile_fputwc,
+            wchar_t, c, FILE *, stream)
+#  ifdef HAVE_PUTWCHAR_UNLOCKED
+HOOK_FUNC_SIMPLE1(wint_t, putwchar_unlocked, wchar_t, c) {
+    return putwc_unlocked(c, stdout);
+}
+#  endif
+# endif
+# ifdef HAVE_FPUTWS_UNLOCKED
+HOOK_WFILE2(int, fputws_unlocked, stream, handle_wfile_fputws,
+            wchar_t const *, s, FILE *, stream)
+# endif
+#endif
 
 /* unlocked_stdio(3), only functions from above are hooked */
 #ifdef HAVE_FWRITE_UNLOCKED
@@ -306,13 +2383,13 @@ HOOK_FILE2(int, fputs_unlocked, stream,
            char const *, s, FILE *, stream)
 #endif
 #ifdef HAVE_FPUTC_UNLOCKED
-HOOK_FILE2(int, fputc_unlocked, stream,
-           int, c, FILE *, stream)
+HOOK_FILE_CHAR2(int, fputc_unlocked, stream, c,
+                int, c, FILE *, stream)
 #endif
-HOOK_FILE2(int, putc_unlocked, stream,
-           int, c, FILE *, stream)
-HOOK_FILE1(int, putchar_unlocked, stdout,
-           int, c)
+HOOK_FILE_CHAR2(int, putc_unlocked, stream, c,
+                int, c, FILE *, stream)
+HOOK_FILE_CHAR1(int, putchar_unlocked, stdout, c,
+                int, c)
 /* glibc defines (_IO_)putc_unlocked() to a macro which either updates the
  * output buffer or calls __overflow(). As this code is inlined we can't
  * handle the first case, but if __overflow() is called we can color that
@@ -320,20 +2397,61 @@ HOOK_FILE1(int, putchar_unlocked, stdout,
  * and everything works fine. This is only a problem if stdout is dupped to
  * stderr (which shouldn't be the case too often). */
 #if defined(HAVE_STRUCT__IO_FILE__FILENO) && defined(HAVE___OVERFLOW)
-/* _IO_FILE is glibc's representation of FILE. */
-HOOK_FILE2(int, __overflow, f, _IO_FILE *, f, int, ch)
+HOOK_FILE_CHAR2(int, __overflow, f, ch, FILE *, f, int, ch)
 #endif
 /* Same for FreeBSD's libc. However it's more aggressive: The inline writing
  * and __swbuf() are also used for normal output (e.g. putc()). Writing to
  * stderr is still fine; it always calls __swbuf() as stderr is always
  * unbuffered. */
 #ifdef HAVE___SWBUF
-HOOK_FILE2(int, __swbuf, f, int, c, FILE *, f)
+HOOK_FILE_CHAR2(int, __swbuf, f, c, int, c, FILE *, f)
+#endif
+
+/* Flush the line buffer when the program flushes the stream (see also
+ * fclose()). */
+#ifdef LINE_BUFFER
+/* int fflush(FILE *) */
+HOOK_FUNC_DEF1(int, fflush, FILE *, stream) {
+    line_buffer_flush_stream(stream);
+    return real_fflush(stream);
+}
+#endif
+
+/* Write pending output before reading input (e.g. after a prompt written
+ * character by character, and so the echoed input isn't colored) and before
+ * _exit(). Normal exits are handled by output_exit(). */
+HOOK_FLUSH3(ssize_t, read, int, fd, void *, buf, size_t, count)
+HOOK_FLUSH4(size_t, fread, void *, ptr, size_t, size, size_t, nmemb,
+            FILE *, stream)
+HOOK_FLUSH3(char *, fgets, char *, s, int, size, FILE *, stream)
+HOOK_FLUSH1(int, fgetc, FILE *, stream)
+#ifdef getc
+# undef getc
 #endif
+HOOK_FLUSH1(int, getc, FILE *, stream)
+HOOK_FLUSH0(int, getchar)
+HOOK_FLUSH3(ssize_t, getline, char **, lineptr, size_t *, n, FILE *, stream)
+HOOK_FLUSH4(ssize_t, getdelim, char **, lineptr, size_t *, n, int, delim,
+            FILE *, stream)
+
+/* void _exit(int) */
+HOOK_FUNC_VOID_DEF1(_exit, int, status) {
+    output_exit();
+    real__exit(status);
+    /* Not reached. */
+    abort();
+}
+/* void _Exit(int) */
+HOOK_FUNC_VOID_DEF1(_Exit, int, status) {
+    output_exit();
+    real__Exit(status);
+    /* Not reached. */
+    abort();
+}
 
 /* perror(3) */
-HOOK_VOID1(void, perror, STDERR_FILENO,
-           char const *, s)
+HOOK_VOID_FUSED1(void, perror, STDERR_FILENO, handle_perror,
+                 char const *, s)
 
 /* err(3), non standard BSD extension */
 #ifdef HAVE_ERR_H
@@ -356,57 +2474,96 @@ HOOK_FUNC_SIMPLE3(void, verrx, int, eval, const char *, fmt, va_list, args) {
     vwarnx(fmt, args);
     exit(eval);
 }
+# ifdef DIAGNOSTIC_WARN
+HOOK_VOID_FUSED2(void, vwarn, STDERR_FILENO, handle_vwarn,
+                 char const *, fmt, va_list, args)
+HOOK_VOID_FUSED2(void, vwarnx, STDERR_FILENO, handle_vwarnx,
+                 char const *, fmt, va_list, args)
+# else
 HOOK_VOID2(void, vwarn, STDERR_FILENO,
            char const *, fmt, va_list, args)
 HOOK_VOID2(void, vwarnx, STDERR_FILENO,
            char const *, fmt, va_list, args)
+# endif
 #endif
 
 /* error(3), non-standard GNU extension */
 #ifdef HAVE_ERROR_H
-static void error_vararg(int status, int errnum,
+/* Format the message of error() or error_at_line() (at_line set) after
+ * error_print_progname(), byte for byte like glibc: error() writes "name: ",
+ * error_at_line() "name:" followed by "file:line: " or " " (also with
+ * error_print_progname()). */
+static void error_message(struct diagnostic *diagnostic, int at_line,
+                          int errnum, char const *filename,
+                          unsigned int linenum,
+                          char const *format, va_list ap) {
+    if (!error_print_progname) {
+        diagnostic_printf(diagnostic, at_line ? "%s:" : "%s: ",
+                          program_invocation_name);
+    }
+    if (at_line) {
+        if (filename != NULL) {
+            diagnostic_printf(diagnostic, "%s:%u: ", filename, linenum);
+        } else {
+            diagnostic_printf(diagnostic, " ");
+        }
+    }
+
+    diagnostic_vprintf(diagnostic, format, ap);
+
+    if (errnum != 0) {
+        diagnostic_printf(diagnostic, ": ");
+        diagnostic_strerror(diagnostic, errnum);
+    }
+
+    diagnostic_printf(diagnostic, "\n");
+}
+static void error_vararg(int status, int errnum, int at_line,
                          char const *filename, unsigned int linenum,
                          char const *format, va_list ap) {
     static char const *last_filename;
     static unsigned int last_linenum;
 
-    /* Skip this error message if requested and if there was already an error
-     * in the same file/line. */
-    if (error_one_per_line
-            && filename != NULL && linenum != 0
-            && filename == last_filename && linenum == last_linenum) {
-        goto out;
+    /* Skip this error message of error_at_line() if requested and if there
+     * was already an error in the same file/line. Unlike glibc exit anyway:
+     * glibc's <error.h> declares calls with a constant status != 0 as
+     * noreturn when optimizing. */
+    if (at_line && error_one_per_line) {
+        if (linenum == last_linenum
+                && (filename == last_filename
+                    || (filename != NULL && last_filename != NULL
+                        && !strcmp(filename, last_filename)))) {
+            goto out;
+        }
+        last_filename = filename;
+        last_linenum  = linenum;
     }
-    last_filename = filename;
-    last_linenum  = linenum;
-
-    error_message_count++;
 
     fflush(stdout);
 
     if (error_print_progname) {
         error_print_progname();
-    } else {
-        fprintf(stderr, "%s:", program_invocation_name);
-    }
-    if (filename != NULL && linenum != 0) {
-        fprintf(stderr, "%s:%u:", filename, linenum);
-        if (error_print_progname) {
-            fprintf(stderr, " ");
-        }
-    }
-    if (!error_print_progname) {
-        fprintf(stderr, " ");
     }
 
-
-    vfprintf(stderr, format, ap);
-
-    if (errnum != 0) {
-        fprintf(stderr, ": %s", strerror(errnum));
+    /* Write the message at once if possible, see struct diagnostic. */
+    int written = 0;
+    if (tracked_fds_find(fileno(stderr)) && diagnostic_possible()) {
+        struct diagnostic diagnostic;
+        diagnostic_init(&diagnostic);
+
+        va_list copy;
+        va_copy(copy, ap);
+        error_message(&diagnostic, at_line, errnum, filename, linenum,
+                      format, copy);
+        va_end(copy);
+        written = diagnostic_write(&diagnostic);
+    }
+    if (!written) {
+        error_message(NULL, at_line, errnum, filename, linenum, format, ap);
     }
 
-    fprintf(stderr, "\n");
+    /* Like glibc, after the message. */
+    error_message_count++;
 
 out:
     if (status != 0) {
@@ -419,14 +2576,14 @@ void error_at_line(int status, int errnum,
     va_list ap;
 
     va_start(ap, format);
-    error_vararg(status, errnum, filename, linenum, format, ap);
+    error_vararg(status, errnum, 1, filename, linenum, format, ap);
     va_end(ap);
 }
 void error(int status, int errnum, char const *format, ...) {
     va_list ap;
 
     va_start(ap, format);
-    error_vararg(status, errnum, NULL, 0, format, ap);
+    error_vararg(status, errnum, 0, NULL, 0, format, ap);
     va_end(ap);
 }
 #endif
@@ -438,33 +2595,29 @@ void error(int status, int errnum, char const *format, ...) {
 HOOK_FUNC_DEF1(int, dup, int, oldfd) {
     int newfd;
 
-    DLSYM_FUNCTION(real_dup, "dup");
-
     newfd = real_dup(oldfd);
     if (newfd > -1) {
-        dup_fd(oldfd, newfd);
+        dup_fd(oldfd, newfd, 0);
     }
 
     return newfd;
 }
 /* int dup2(int, int) */
 HOOK_FUNC_DEF2(int, dup2, int, oldfd, int, newfd) {
-    DLSYM_FUNCTION(real_dup2, "dup2");
-
+    color_reset_fd(newfd);
     newfd = real_dup2(oldfd, newfd);
     if (newfd > -1) {
-        dup_fd(oldfd, newfd);
+        dup_fd(oldfd, newfd, 0);
     }
 
     return newfd;
 }
 /* int dup3(int, int, int) */
 HOOK_FUNC_DEF3(int, dup3, int, oldfd, int, newfd, int, flags) {
-    DLSYM_FUNCTION(real_dup3, "dup3");
-
+    color_reset_fd(newfd);
     newfd = real_dup3(oldfd, newfd, flags);
     if (newfd > -1) {
-        dup_fd(oldfd, newfd);
+        dup_fd(oldfd, newfd, (flags & O_CLOEXEC) != 0);
     }
 
     return newfd;
@@ -491,12 +2644,23 @@ HOOK_FUNC_VAR_DEF2(int, fcntl, int, fd, int, cmd /*, ... */) {
      * work fine.
      */
     va_start(ap, cmd);
-    result = real_fcntl(fd, cmd, va_arg(ap, void *));
+    void *arg = va_arg(ap, void *);
+    result = real_fcntl(fd, cmd, arg);
     va_end(ap);
 
-    /* We only care about duping fds. */
-    if (cmd == F_DUPFD && result > -1) {
-        dup_fd(fd, result);
+    /* We only care about duping fds and their close-on-exec flag which
+     * decides if they are passed to new programs. */
+    if (result > -1 && fd >= 0) {
+        if (cmd == F_DUPFD) {
+            dup_fd(fd, result, 0);
+#ifdef F_DUPFD_CLOEXEC
+        } else if (cmd == F_DUPFD_CLOEXEC) {
+            dup_fd(fd, result, 1);
+#endif
+        } else if (cmd == F_SETFD) {
+            /* The int argument was retrieved as pointer, see above. */
+            cloexec_fd(fd, ((intptr_t)arg & FD_CLOEXEC) != 0);
+        }
     }
 
     return result;
@@ -504,29 +2668,214 @@ HOOK_FUNC_VAR_DEF2(int, fcntl, int, fd, int, cmd /*, ... */) {
 
 /* int close(int) */
 HOOK_FUNC_DEF1(int, close, int, fd) {
-    DLSYM_FUNCTION(real_close, "close");
-
+    color_reset_fd(fd);
     if (fd >= 0) {
         close_fd(fd);
     }
     return real_close(fd);
 }
+#ifdef HAVE_CLOSE_RANGE
+/* int close_range(unsigned int, unsigned int, int) */
+HOOK_FUNC_DEF3(int, close_range, unsigned int, first, unsigned int, last,
+                                 int, flags) {
+    /* Descriptors are never larger than INT_MAX. With CLOSE_RANGE_CLOEXEC
+     * the descriptors stay open until exec*(). */
+    int closing = first <= last && first <= INT_MAX
+                  && !((unsigned int)flags & CLOSE_RANGE_CLOEXEC);
+    int to = last <= INT_MAX ? (int)last : INT_MAX;
+
+    if (closing) {
+        color_reset_range((int)first, to);
+    }
+    int result = real_close_range(first, last, flags);
+    /* Nothing is closed on errors. */
+    if (result == 0 && closing) {
+        close_fd_range((int)first, to);
+    /* But the descriptors are not passed to new programs. */
+    } else if (result == 0 && first <= last && first <= INT_MAX) {
+        cloexec_fd_range((int)first, to);
+    }
+    return result;
+}
+#endif
+#ifdef HAVE_CLOSEFROM
+/* void closefrom(int) */
+HOOK_FUNC_VOID_DEF1(closefrom, int, lowfd) {
+    int first = lowfd > 0 ? lowfd : 0;
+
+    color_reset_range(first, INT_MAX);
+    close_fd_range(first, INT_MAX);
+    real_closefrom(lowfd);
+}
+#endif
 /* int fclose(FILE *) */
 HOOK_FUNC_DEF1(int, fclose, FILE *, fp) {
     int fd;
 
-    DLSYM_FUNCTION(real_fclose, "fclose");
-
+    line_buffer_flush_stream(fp);
     if (fp != NULL && (fd = fileno(fp)) >= 0) {
+        color_reset_fd(fd);
         close_fd(fd);
     }
     return real_fclose(fp);
 }
+/* freopen() replaces the stream's descriptor with a new file but keeps its
+ * number (glibc uses an internal dup3() which is not hooked). The descriptor
+ * stays tracked (as before), but the cached isatty() result is wrong now. */
+static FILE *freopen_common(FILE *(*real)(char const *, char const *, FILE *),
+                            char const *path, char const *mode, FILE *stream) {
+    int fd = -1;
+
+    line_buffer_flush_stream(stream);
+    if (stream != NULL && (fd = fileno(stream)) >= 0) {
+        color_reset_fd(fd);
+    }
+    FILE *result = real(path, mode, stream);
+
+    int saved_errno = errno;
+    if (fd >= 0) {
+        tracked_fds_reset_tty(fd);
+    }
+    int newfd;
+    if (result != NULL && (newfd = fileno(result)) >= 0 && newfd != fd) {
+        tracked_fds_reset_tty(newfd);
+    }
+    errno = saved_errno;
+    return result;
+}
+/* FILE *freopen(char const *, char const *, FILE *) */
+HOOK_FUNC_DEF3(FILE *, freopen, char const *, path, char const *, mode,
+                                FILE *, stream) {
+    return freopen_common(real_freopen, path, mode, stream);
+}
+#ifdef HAVE_FREOPEN64
+/* FILE *freopen64(char const *, char const *, FILE *) */
+HOOK_FUNC_DEF3(FILE *, freopen64, char const *, path, char const *, mode,
+                                  FILE *, stream) {
+    return freopen_common(real_freopen64, path, mode, stream);
+}
+#endif
 
 
 /* Hook functions which are necessary for correct tracking. */
 
-#if defined(HAVE_VFORK) && defined(HAVE_FORK)
+#ifdef HAVE_VFORK_TRAMPOLINE
+/* vfork() is similar to fork() but the address space is shared between
+ * father and child until the child calls exec*() or _exit(). Some programs
+ * (e.g. shells) nevertheless close or dup descriptors in the child. These
+ * changes are kept in an overlay (vfork_changes) in the TLS of this thread
+ * which is used by the child's exec*() and discarded when we resume.
+ *
+ * The child returns from vfork() and reuses our stack. Therefore vfork()
+ * can't be a C function which calls the real vfork(), our stack frame would
+ * be destroyed when we resume. The trampoline stores the return address and
+ * the callee-saved register it uses in the TLS instead.
+ *
+ * With CET (-fcf-protection, default on many distributions) the library is
+ * marked compatible with indirect branch tracking and shadow stacks. vfork()
+ * starts with endbr64 (it's called through the PLT). The parent returns with
+ * ret which pops the caller's entry of the shadow stack. The child shares the
+ * shadow stack and must not pop it, it jumps back like glibc's vfork(). */
+struct vfork_save {
+    void *return_address;
+    void *rbx;
+    pid_t (*real)(void);
+};
+static TLS struct vfork_save vfork_save;
+
+static pid_t (*real_vfork)(void);
+
+/* Mapping used by the child's exec*(), see env_prepare(). It stays in our
+ * memory if exec*() succeeds. */
+static TLS struct {
+    void *addr;
+    size_t size;
+} vfork_mapping;
+
+void *coloredstderr_vfork_pre(void) visibility_hidden;
+void *coloredstderr_vfork_pre(void) {
+    hooks_init();
+    /* The child must not modify our tracked descriptors. */
+    ignored_binaries_resolve();
+    output_flush();
+
+    DLSYM_FUNCTION(real_vfork, "vfork");
+
+    vfork_changes.count = 0;
+    vfork_changes.closefrom = INT_MAX;
+    vfork_overflow = 0;
+    vfork_child = 1;
+
+    vfork_save.real = real_vfork;
+    return &vfork_save;
+}
+/* Only called in the parent. */
+pid_t coloredstderr_vfork_post(pid_t pid) visibility_hidden;
+pid_t coloredstderr_vfork_post(pid_t pid) {
+    vfork_child = 0;
+
+# if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+    if (vfork_mapping.addr) {
+        int saved_errno = errno;
+        munmap(vfork_mapping.addr, vfork_mapping.size);
+        vfork_mapping.addr = NULL;
+        errno = saved_errno;
+    }
+# endif
+    return pid;
+}
+
+__asm__(
+    "    .pushsection .text\n"
+    "    .globl vfork\n"
+    "    .type vfork, @function\n"
+    "vfork:\n"
+# if defined(__CET__) && (__CET__ & 1)
+    "    endbr64\n"
+# endif
+    "    sub $8, %rsp\n"
+    "    call coloredstderr_vfork_pre\n"
+    "    add $8, %rsp\n"
+    /* Save return address and %rbx, use %rbx for struct vfork_save. */
+    "    pop %rcx\n"
+    "    mov %rcx, 0(%rax)\n"
+    "    mov %rbx, 8(%rax)\n"
+    "    mov %rax, %rbx\n"
+    "    call *16(%rbx)\n"
+    /* The child returns immediately without touching the shadow stack. */
+    "    test %eax, %eax\n"
+    "    jz 1f\n"
+    "    mov %eax, %edi\n"
+    "    call coloredstderr_vfork_post\n"
+    "    mov 0(%rbx), %rcx\n"
+    "    mov 8(%rbx), %rbx\n"
+    "    push %rcx\n"
+    "    ret\n"
+    "1:\n"
+    "    mov 0(%rbx), %rcx\n"
+    "    mov 8(%rbx), %rbx\n"
+    "    jmp *%rcx\n"
+    "    .size vfork, .-vfork\n"
+    "    .popsection\n"
+);
+
+/* Changes of the vfork() child to our tracked descriptors. */
+inline static struct tracked_fds_changes *vfork_child_changes(void) {
+    if (!vfork_child || vfork_overflow
+            || (vfork_changes.count == 0
+                && vfork_changes.closefrom == INT_MAX)) {
+        return NULL;
+    }
+    return &vfork_changes;
+}
+inline static void vfork_child_mapping(void *addr, size_t size) {
+    if (vfork_child) {
+        vfork_mapping.addr = addr;
+        vfork_mapping.size = size;
+    }
+}
+
+#elif defined(HAVE_VFORK) && defined(HAVE_FORK)
 pid_t vfork(void) {
     /* vfork() is similar to fork() but the address space is shared between
      * father and child. It's designed for fork()/exec() usage because it's
@@ -538,82 +2887,240 @@ pid_t vfork(void) {
      * "child" closes or dups a descriptor before the exec()) and this
      * modifies the parent as well due to the semantics of vfork() - thus
      * breaking the requirements of vfork(), we just use fork instead(). This
-     * is in compliance with the POSIX standard and as most systems use
-     * copy-on-write anyway not a performance issue. */
+     * is in compliance with the POSIX standard. Used when the real vfork()
+     * is not supported, see HAVE_VFORK_TRAMPOLINE. */
     return fork();
 }
 #endif
 
+#ifndef HAVE_VFORK_TRAMPOLINE
+inline static struct tracked_fds_changes *vfork_child_changes(void) {
+    return NULL;
+}
+inline static void vfork_child_mapping(void *addr unused, size_t size unused) {
+}
+#endif
+
 
 /* Hook execve() and the other exec*() functions. Some shells use exec*() with
  * a custom environment which doesn't necessarily contain our updates to
  * ENV_NAME_PRIVATE_FDS. It's also faster to update the environment only when
  * necessary, right before the exec(), to pass it to the new program. */
 
-/* int execve(char const *, char * const [], char * const []) */
-HOOK_FUNC_DEF3(int, execve, char const *, filename, char * const *, argv, char * const *, env) {
-    DLSYM_FUNCTION(real_execve, "execve");
-
-    char * const fake_env[] = {NULL};
-    if (env == NULL) {
-        env = fake_env;
-    }
-
-    /* Count environment variables. */
-    size_t count = 0;
-    char * const *x = env;
-    while (*x++) {
-        count++;
-    }
-    /* Terminating NULL. */
-    count++;
-
-    char *env_copy[count + 1 /* space for our new entry if necessary */];
+/* The ENV_NAME_PRIVATE_FDS entry for our tracked descriptors (without
+ * changes) is only encoded again when they change. */
+#ifdef HAVE___SYNC_BOOL_COMPARE_AND_SWAP
+static struct {
+    int lock;
+    int valid;
+    unsigned int generation;
+    char entry[ENV_FDS_CACHE_SIZE];
+} env_fds_cache;
+
+static int env_fds_cache_lock(void) {
+    return __sync_bool_compare_and_swap(&env_fds_cache.lock, 0, 1);
+}
+static void env_fds_cache_unlock(void) {
+    __sync_lock_release(&env_fds_cache.lock);
+}
+#endif
 
-    /* Make sure the information from the environment is loaded. We can't just
-     * do nothing (like update_environment()) because the caller might pass a
-     * different environment which doesn't include any of our settings. */
-    if (!initialized) {
-        init_from_environment();
+/* Size of the ENV_NAME_PRIVATE_FDS entry created by env_fds(). */
+static size_t env_fds_size(struct tracked_fds_changes *changes) {
+    return strlen(ENV_NAME_PRIVATE_FDS) + 1
+           + update_environment_buffer_size(changes ? changes->count : 0);
+}
+/* Create the ENV_NAME_PRIVATE_FDS entry (size bytes, see env_fds_size()) for
+ * a child process which applies changes (may be NULL) to our tracked
+ * descriptors. */
+static void env_fds(char *fds_env, size_t size,
+                    struct tracked_fds_changes *changes) {
+#ifdef HAVE___SYNC_BOOL_COMPARE_AND_SWAP
+    /* Before encoding, changes of other threads meanwhile invalidate the
+     * cache. Pairs with the release increment after each change (see
+     * tracked_fds_add()): the encoded bits are at least as new. */
+    unsigned int generation = atomic_load_acquire(&tracked_fds_generation);
+    /* Another thread uses the cache, don't wait. */
+    int locked = !changes && env_fds_cache_lock();
+    if (locked && env_fds_cache.valid
+            && env_fds_cache.generation == generation
+            && strlen(env_fds_cache.entry) < size) {
+        strcpy(fds_env, env_fds_cache.entry);
+        env_fds_cache_unlock();
+        return;
     }
+#endif
 
-    char fds_env[strlen(ENV_NAME_PRIVATE_FDS)
-                 + 1 + update_environment_buffer_size()];
+    size_t prefix = strlen(ENV_NAME_PRIVATE_FDS) + 1;
     strcpy(fds_env, ENV_NAME_PRIVATE_FDS "=");
-    update_environment_buffer(fds_env + strlen(ENV_NAME_PRIVATE_FDS) + 1);
+    update_environment_buffer_changes(fds_env + prefix, size - prefix,
+                                      changes);
+
+#ifdef HAVE___SYNC_BOOL_COMPARE_AND_SWAP
+    if (locked) {
+        size_t length = strlen(fds_env);
+        env_fds_cache.valid = length < sizeof(env_fds_cache.entry);
+        if (env_fds_cache.valid) {
+            memcpy(env_fds_cache.entry, fds_env, length + 1);
+            env_fds_cache.generation = generation;
+        }
+        env_fds_cache_unlock();
+    }
+#endif
+}
 
+/* Environment passed to a new program, see env_prepare(). */
+struct env_copy {
+    char * const *env;
+    /* Large environments are copied to an mmap()ed area instead of the
+     * stack. mmap() (unlike malloc()) is safe in a vfork() child or signal
+     * handler, like exec*() must be. */
+    char **mapping;
+    size_t mapping_size;
+    char *stack[ENV_COPY_STACK_COUNT];
+};
+
+static int env_is(char const *entry, char const *name, size_t length) {
+    return !strncmp(entry, name, length) && entry[length] == '=';
+}
+/* Copy env to env_copy and replace or add ENV_NAME_PRIVATE_FDS with
+ * fds_env. */
+static void env_update_copy(char **env_copy, char * const *env,
+                            char *fds_env) {
     int found = 0;
-    char **x_copy = env_copy;
 
     /* Copy the environment manually; allows skipping elements. */
-    x = env;
-    while ((*x_copy = *x)) {
+    while ((*env_copy = *env)) {
         /* Remove ENV_NAME_FDS if we've already used its value. The new
          * program must use the updated list from ENV_NAME_PRIVATE_FDS. */
         if (used_fds_set_by_user
-                && !strncmp(*x, ENV_NAME_FDS "=", strlen(ENV_NAME_FDS) + 1)) {
-            x++;
+                && env_is(*env, ENV_NAME_FDS, strlen(ENV_NAME_FDS))) {
+            env++;
             continue;
         /* Update ENV_NAME_PRIVATE_FDS. */
-        } else if (!strncmp(*x, ENV_NAME_PRIVATE_FDS "=",
-                            strlen(ENV_NAME_PRIVATE_FDS) + 1)) {
-            *x_copy = fds_env;
+        } else if (env_is(*env, ENV_NAME_PRIVATE_FDS,
+                          strlen(ENV_NAME_PRIVATE_FDS))) {
+            *env_copy = fds_env;
             found = 1;
         }
 
-        x++;
-        x_copy++;
+        env++;
+        env_copy++;
     }
     /* The loop "condition" NULL-terminates env_copy. */
 
     if (!found) {
         /* If the process removed ENV_NAME_PRIVATE_FDS from the environment,
          * re-add it. */
-        *x_copy++ = fds_env;
-        *x_copy++ = NULL;
+        *env_copy++ = fds_env;
+        *env_copy++ = NULL;
+    }
+}
+/* Get the environment for a new program. env is used unchanged if it
+ * already contains fds_env, which is common for exec*() storms of shell
+ * scripts. Must be freed with env_free(). */
+static char * const *env_prepare(struct env_copy *copy, char * const *env,
+                                 char *fds_env) {
+    static char * const fake_env[] = {NULL};
+    if (env == NULL) {
+        env = fake_env;
+    }
+
+    copy->env = env;
+    copy->mapping = NULL;
+
+    size_t count = 0;
+    size_t found = 0;
+    int current = 0;
+    int remove = 0;
+
+    char * const *x;
+    for (x = env; *x; x++) {
+        count++;
+
+        /* Most entries don't match, keep the loop cheap. */
+        if (**x != 'C') {
+            continue;
+        }
+        if (env_is(*x, ENV_NAME_PRIVATE_FDS, strlen(ENV_NAME_PRIVATE_FDS))) {
+            found++;
+            current = !strcmp(*x, fds_env);
+        } else if (used_fds_set_by_user
+                && env_is(*x, ENV_NAME_FDS, strlen(ENV_NAME_FDS))) {
+            remove = 1;
+        }
+    }
+    if (found == 1 && current && !remove) {
+        return env;
+    }
+
+    size_t size = count + 1 /* terminating NULL */
+                        + 1 /* space for our new entry if necessary */;
+    char **env_copy = copy->stack;
+    if (size > ENV_COPY_STACK_COUNT) {
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+        copy->mapping_size = size * sizeof(*env_copy);
+        void *mapping = mmap(NULL, copy->mapping_size,
+                             PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED) {
+            mapping = NULL;
+        }
+        copy->mapping = mapping;
+#endif
+        if (!copy->mapping) {
+#ifdef WARNING
+            warning("env_prepare(): failed to copy %zu entries [%d]\n",
+                    count, getpid());
+#endif
+            return env;
+        }
+        env_copy = copy->mapping;
+        vfork_child_mapping(copy->mapping, copy->mapping_size);
+    }
+
+    env_update_copy(env_copy, env, fds_env);
+    copy->env = env_copy;
+    return env_copy;
+}
+static void env_free(struct env_copy *copy) {
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+    if (copy->mapping) {
+        int saved_errno = errno;
+        munmap(copy->mapping, copy->mapping_size);
+        vfork_child_mapping(NULL, 0);
+        errno = saved_errno;
     }
+#else
+    (void)copy;
+#endif
+}
+
+typedef int (*exec_function)(char const *, char * const *, char * const *);
+/* Call an execve()-like function with our settings in env. */
+static int exec_env(exec_function real, char const *file,
+                    char * const *argv, char * const *env) {
+    /* Make sure the information from the environment is loaded. We can't just
+     * do nothing (like update_environment()) because the caller might pass a
+     * different environment which doesn't include any of our settings. */
+    hooks_init();
+    ignored_binaries_resolve();
+    output_flush();
+
+    struct tracked_fds_changes *changes = vfork_child_changes();
 
-    return real_execve(filename, argv, env_copy);
+    char fds_env[env_fds_size(changes)];
+    env_fds(fds_env, sizeof(fds_env), changes);
+
+    struct env_copy copy;
+    int result = real(file, argv, env_prepare(&copy, env, fds_env));
+    env_free(&copy);
+    return result;
+}
+
+/* int execve(char const *, char * const [], char * const []) */
+HOOK_FUNC_DEF3(int, execve, char const *, filename, char * const *, argv, char * const *, env) {
+    return exec_env(real_execve, filename, argv, env);
 }
 
 #define EXECL_COPY_VARARGS_START(args) \
@@ -668,35 +3175,631 @@ int execle(char const *path, char const *arg, ... /*, char * const envp[] */) {
     return execve(path, args, envp);
 }
 
+/* execv() and execvp() use our environment; don't modify it with setenv()
+ * which leaks memory (and is not allowed in a vfork() child). */
+
 /* int execv(char const *, char * const []) */
 HOOK_FUNC_DEF2(int, execv, char const *, path, char * const *, argv) {
-    DLSYM_FUNCTION(real_execv, "execv");
+    return exec_env(real_execve, path, argv, environ);
+}
 
-    update_environment();
-    return real_execv(path, argv);
+#ifdef HAVE_EXECVPE
+/* int execvpe(char const *, char * const [], char * const []) */
+HOOK_FUNC_DEF3(int, execvpe, char const *, file, char * const *, argv, char * const *, envp) {
+    return exec_env(real_execvpe, file, argv, envp);
 }
+#endif
 
 /* int execvp(char const *, char * const []) */
 HOOK_FUNC_DEF2(int, execvp, char const *, file, char * const *, argv) {
-    DLSYM_FUNCTION(real_execvp, "execvp");
-
+#ifdef HAVE_EXECVPE
+    return exec_env(real_execvpe, file, argv, environ);
+#else
+    ignored_binaries_resolve();
+    output_flush();
     update_environment();
     return real_execvp(file, argv);
+#endif
 }
 
-#ifdef HAVE_EXECVPE
-extern char **environ;
-int execvpe(char const *file, char * const argv[], char * const envp[]) {
-    int result;
-    char **old_environ = environ;
 
-    /* Fake the environment so we can reuse execvp(). */
-    environ = (char **)envp;
+/* posix_spawn() applies its file actions in the child process (which might
+ * share our memory) without calling our close()/dup2() hooks. Record the
+ * actions which change descriptors when they are added to compute the
+ * descriptors tracked in the child. Unknown actions objects (too many at the
+ * same time or too many actions) pass our tracked descriptors unchanged. */
+
+#ifdef HAVE_SPAWN
+enum {
+    SPAWN_ACTION_DUP2,
+    SPAWN_ACTION_CLOSE,
+    SPAWN_ACTION_CLOSEFROM,
+};
+struct spawn_action {
+    int type;
+    int fd;
+    int newfd;
+};
+struct spawn_actions {
+    /* NULL if slot is unused. */
+    posix_spawn_file_actions_t const *actions;
+    int overflow;
+    size_t count;
+    struct spawn_action action[TRACKFDS_CHANGES_MAX];
+};
+static struct spawn_actions spawn_actions[SPAWN_ACTIONS_SLOTS];
+
+static struct spawn_actions *spawn_actions_find(
+        posix_spawn_file_actions_t const *actions) {
+    size_t i;
+    for (i = 0; i < SPAWN_ACTIONS_SLOTS; i++) {
+        if (spawn_actions[i].actions == actions) {
+            return &spawn_actions[i];
+        }
+    }
+    return NULL;
+}
+static void spawn_actions_init(posix_spawn_file_actions_t const *actions) {
+    /* Reinitialized without posix_spawn_file_actions_destroy(). */
+    struct spawn_actions *x = spawn_actions_find(actions);
+
+    size_t i;
+    for (i = 0; !x && i < SPAWN_ACTIONS_SLOTS; i++) {
+#ifdef HAVE___SYNC_BOOL_COMPARE_AND_SWAP
+        if (__sync_bool_compare_and_swap(&spawn_actions[i].actions,
+                                         NULL, actions)) {
+            x = &spawn_actions[i];
+        }
+#else
+        if (!spawn_actions[i].actions) {
+            spawn_actions[i].actions = actions;
+            x = &spawn_actions[i];
+        }
+#endif
+    }
+    if (!x) {
+#ifdef WARNING
+        warning("spawn_actions_init(): no free slot [%d]\n", getpid());
+#endif
+        return;
+    }
 
-    /* execvp() updates the environment. */
-    result = execvp(file, argv);
+    x->overflow = 0;
+    x->count = 0;
+}
+static void spawn_actions_destroy(posix_spawn_file_actions_t const *actions) {
+    struct spawn_actions *x = spawn_actions_find(actions);
+    if (x) {
+        x->actions = NULL;
+    }
+}
+static void spawn_actions_add(posix_spawn_file_actions_t const *actions,
+                              int type, int fd, int newfd) {
+    struct spawn_actions *x = spawn_actions_find(actions);
+    if (!x) {
+        return;
+    }
+    if (x->count == TRACKFDS_CHANGES_MAX) {
+        x->overflow = 1;
+        return;
+    }
+
+    x->action[x->count].type  = type;
+    x->action[x->count].fd    = fd;
+    x->action[x->count].newfd = newfd;
+    x->count++;
+}
+
+/* Apply the recorded actions to a copy of our tracked descriptors. Returns
+ * NULL if the child uses them unchanged. */
+static struct tracked_fds_changes *spawn_changes(
+        struct tracked_fds_changes *changes,
+        posix_spawn_file_actions_t const *actions) {
+    if (!actions) {
+        return NULL;
+    }
+    struct spawn_actions *x = spawn_actions_find(actions);
+    if (!x || x->overflow) {
+        return NULL;
+    }
+
+    changes->count = 0;
+    changes->closefrom = INT_MAX;
+
+    size_t i;
+    for (i = 0; i < x->count; i++) {
+        struct spawn_action *action = &x->action[i];
+
+        switch (action->type) {
+            case SPAWN_ACTION_DUP2:
+                /* Unlike dup2(fd, fd) it clears the close-on-exec flag
+                 * (POSIX 2024, glibc >= 2.29). Before it did nothing. */
+                if (action->fd == action->newfd) {
+#if !defined(__GLIBC__) || __GLIBC__ > 2 \
+        || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29)
+                    tracked_fds_changes_set_cloexec(changes, action->fd, 0);
+#endif
+                    break;
+                }
+                tracked_fds_changes_set(changes, action->newfd,
+                        tracked_fds_changes_tracked(changes, action->fd));
+                break;
+            case SPAWN_ACTION_CLOSE:
+                tracked_fds_changes_set(changes, action->fd, 0);
+                break;
+            case SPAWN_ACTION_CLOSEFROM:
+                tracked_fds_changes_closefrom(changes, action->fd);
+                break;
+            default:
+                assert(0);
+        }
+    }
+    return changes;
+}
 
-    environ = old_environ;
+/* int posix_spawn_file_actions_init(posix_spawn_file_actions_t *) */
+HOOK_FUNC_DEF1(int, posix_spawn_file_actions_init,
+               posix_spawn_file_actions_t *, file_actions) {
+    int result = real_posix_spawn_file_actions_init(file_actions);
+    if (result == 0) {
+        spawn_actions_init(file_actions);
+    }
+    return result;
+}
+/* int posix_spawn_file_actions_destroy(posix_spawn_file_actions_t *) */
+HOOK_FUNC_DEF1(int, posix_spawn_file_actions_destroy,
+               posix_spawn_file_actions_t *, file_actions) {
+    spawn_actions_destroy(file_actions);
+    return real_posix_spawn_file_actions_destroy(file_actions);
+}
+/* int posix_spawn_file_actions_adddup2(posix_spawn_file_actions_t *, int,
+ *                                      int) */
+HOOK_FUNC_DEF3(int, posix_spawn_file_actions_adddup2,
+               posix_spawn_file_actions_t *, file_actions,
+               int, fd, int, newfd) {
+    int result = real_posix_spawn_file_actions_adddup2(file_actions,
+                                                       fd, newfd);
+    if (result == 0) {
+        spawn_actions_add(file_actions, SPAWN_ACTION_DUP2, fd, newfd);
+    }
+    return result;
+}
+/* int posix_spawn_file_actions_addclose(posix_spawn_file_actions_t *, int) */
+HOOK_FUNC_DEF2(int, posix_spawn_file_actions_addclose,
+               posix_spawn_file_actions_t *, file_actions, int, fd) {
+    int result = real_posix_spawn_file_actions_addclose(file_actions, fd);
+    if (result == 0) {
+        spawn_actions_add(file_actions, SPAWN_ACTION_CLOSE, fd, -1);
+    }
+    return result;
+}
+/* int posix_spawn_file_actions_addopen(posix_spawn_file_actions_t *, int,
+ *                                      char const *, int, mode_t) */
+HOOK_FUNC_DEF5(int, posix_spawn_file_actions_addopen,
+               posix_spawn_file_actions_t *, file_actions, int, fd,
+               char const *, path, int, oflag, mode_t, mode) {
+    int result = real_posix_spawn_file_actions_addopen(file_actions, fd,
+                                                       path, oflag, mode);
+    /* The opened file is never a descriptor we track. */
+    if (result == 0) {
+        spawn_actions_add(file_actions, SPAWN_ACTION_CLOSE, fd, -1);
+    }
+    return result;
+}
+# ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+/* int posix_spawn_file_actions_addclosefrom_np(posix_spawn_file_actions_t *,
+ *                                              int) */
+HOOK_FUNC_DEF2(int, posix_spawn_file_actions_addclosefrom_np,
+               posix_spawn_file_actions_t *, file_actions, int, fd) {
+    int result = real_posix_spawn_file_actions_addclosefrom_np(file_actions,
+                                                               fd);
+    if (result == 0) {
+        spawn_actions_add(file_actions, SPAWN_ACTION_CLOSEFROM, fd, -1);
+    }
+    return result;
+}
+# endif
+
+typedef int (*spawn_function)(pid_t *, char const *,
+                              posix_spawn_file_actions_t const *,
+                              posix_spawnattr_t const *,
+                              char * const *, char * const *);
+/* Like exec_env(), but pass the tracked descriptors after changes (may be
+ * NULL). */
+static int spawn_env(spawn_function real, pid_t *pid, char const *path,
+                     posix_spawn_file_actions_t const *file_actions,
+                     posix_spawnattr_t const *attrp,
+                     char * const *argv, char * const *envp,
+                     struct tracked_fds_changes *changes) {
+    /* See exec_env(). */
+    hooks_init();
+    ignored_binaries_resolve();
+    output_flush();
+
+    char fds_env[env_fds_size(changes)];
+    env_fds(fds_env, sizeof(fds_env), changes);
+
+    struct env_copy copy;
+    int result = real(pid, path, file_actions, attrp, argv,
+                      env_prepare(&copy, envp, fds_env));
+    env_free(&copy);
     return result;
 }
+/* Like spawn_env() with the changes of the file actions. */
+static int spawn(spawn_function real, pid_t *pid, char const *path,
+                 posix_spawn_file_actions_t const *file_actions,
+                 posix_spawnattr_t const *attrp,
+                 char * const *argv, char * const *envp) {
+    struct tracked_fds_changes changes;
+    return spawn_env(real, pid, path, file_actions, attrp, argv, envp,
+                     spawn_changes(&changes, file_actions));
+}
+
+/* int posix_spawn(pid_t *, char const *, posix_spawn_file_actions_t const *,
+ *                 posix_spawnattr_t const *, char * const [],
+ *                 char * const []) */
+HOOK_FUNC_DEF6(int, posix_spawn, pid_t *, pid, char const *, path,
+               posix_spawn_file_actions_t const *, file_actions,
+               posix_spawnattr_t const *, attrp,
+               char * const *, argv, char * const *, envp) {
+    return spawn(real_posix_spawn, pid, path, file_actions, attrp, argv, envp);
+}
+/* int posix_spawnp(pid_t *, char const *, posix_spawn_file_actions_t const *,
+ *                  posix_spawnattr_t const *, char * const [],
+ *                  char * const []) */
+HOOK_FUNC_DEF6(int, posix_spawnp, pid_t *, pid, char const *, file,
+               posix_spawn_file_actions_t const *, file_actions,
+               posix_spawnattr_t const *, attrp,
+               char * const *, argv, char * const *, envp) {
+    return spawn(real_posix_spawnp, pid, file, file_actions, attrp, argv, envp);
+}
+#endif
+
+/* system() and popen() start the shell with our environment but not
+ * necessarily with one of the hooked functions above (e.g. glibc calls its
+ * internal posix_spawn()). Start the shell ourselves with posix_spawn() to
+ * pass a copy of the environment (see spawn_env()) instead of modifying
+ * environ with setenv() which leaks memory and is not thread-safe. */
+
+#ifdef HAVE_SPAWN
+# ifdef HAVE_PTHREAD_MUTEX_LOCK
+static pthread_mutex_t shell_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void shell_lock(void) {
+    pthread_mutex_lock(&shell_mutex);
+}
+static void shell_unlock(void) {
+    pthread_mutex_unlock(&shell_mutex);
+}
+# else
+static void shell_lock(void) {
+}
+static void shell_unlock(void) {
+}
+# endif
+
+/* Start "/bin/sh -c command". */
+static int spawn_shell(pid_t *pid, char const *command,
+                       posix_spawn_file_actions_t const *file_actions,
+                       posix_spawnattr_t const *attrp,
+                       struct tracked_fds_changes *changes) {
+    char *argv[] = {
+        (char *)"sh", (char *)"-c", (char *)"--", (char *)command, NULL,
+    };
+    return spawn_env(real_posix_spawn, pid, "/bin/sh", file_actions, attrp,
+                     argv, environ, changes);
+}
+static int wait_child(pid_t pid, int *status) {
+    pid_t result;
+    do {
+        result = waitpid(pid, status, 0);
+    } while (result == -1 && errno == EINTR);
+    return result == -1 ? -1 : 0;
+}
+
+/* SIGINT and SIGQUIT are ignored while any system() runs. */
+static unsigned int system_count;
+static struct sigaction system_sigint, system_sigquit;
+
+/* Ignore SIGINT and SIGQUIT, store the signals which the child must reset to
+ * the default action in reset. */
+static void system_signals_ignore(sigset_t *reset) {
+    shell_lock();
+    if (system_count++ == 0) {
+        struct sigaction ignore;
+        memset(&ignore, 0, sizeof(ignore));
+        ignore.sa_handler = SIG_IGN;
+        sigemptyset(&ignore.sa_mask);
+
+        sigaction(SIGINT, &ignore, &system_sigint);
+        sigaction(SIGQUIT, &ignore, &system_sigquit);
+    }
+    sigemptyset(reset);
+    if (system_sigint.sa_handler != SIG_IGN) {
+        sigaddset(reset, SIGINT);
+    }
+    if (system_sigquit.sa_handler != SIG_IGN) {
+        sigaddset(reset, SIGQUIT);
+    }
+    shell_unlock();
+}
+static void system_signals_restore(void) {
+    shell_lock();
+    if (--system_count == 0) {
+        sigaction(SIGINT, &system_sigint, NULL);
+        sigaction(SIGQUIT, &system_sigquit, NULL);
+    }
+    shell_unlock();
+}
+
+/* The child of a running system(). */
+struct system_child {
+    pid_t pid;
+    sigset_t const *mask;
+};
+# ifdef HAVE_PTHREAD_CLEANUP_PUSH
+/* system() is a cancellation point. Like glibc kill and reap the child of a
+ * cancelled thread and restore the signals, otherwise SIGINT and SIGQUIT
+ * stay ignored for the whole process. */
+static void system_cancel(void *arg) {
+    struct system_child const *child = arg;
+
+    kill(child->pid, SIGKILL);
+    int status;
+    wait_child(child->pid, &status);
+
+    system_signals_restore();
+    sigprocmask(SIG_SETMASK, child->mask, NULL);
+}
+# endif
+#endif
+
+/* int system(char const *) */
+HOOK_FUNC_DEF1(int, system, char const *, command) {
+#ifdef HAVE_SPAWN
+    /* Only checks if a shell is available. */
+    if (!command) {
+        return real_system(command);
+    }
+
+    sigset_t block, mask, reset;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+
+    system_signals_ignore(&reset);
+    sigprocmask(SIG_BLOCK, &block, &mask);
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigdefault(&attr, &reset);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr,
+                             POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+    int status;
+    pid_t pid;
+    int result = spawn_shell(&pid, command, NULL, &attr, NULL);
+    posix_spawnattr_destroy(&attr);
+    if (result != 0) {
+        /* Like a shell which couldn't execute the command. */
+        status = 127 << 8;
+    } else {
+        struct system_child child;
+        child.pid = pid;
+        child.mask = &mask;
+# ifdef HAVE_PTHREAD_CLEANUP_PUSH
+        pthread_cleanup_push(system_cancel, &child);
+# endif
+        if (wait_child(child.pid, &status) == -1) {
+            status = -1;
+        }
+# ifdef HAVE_PTHREAD_CLEANUP_PUSH
+        pthread_cleanup_pop(0);
+# endif
+    }
+
+    int saved_errno = errno;
+    system_signals_restore();
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    errno = saved_errno;
+
+    return status;
+#else
+    ignored_binaries_resolve();
+    output_flush();
+    update_environment();
+    return real_system(command);
+#endif
+}
+
+#ifdef HAVE_SPAWN
+/* Streams returned by our popen() and their child, see pclose(). */
+struct popen_child {
+    FILE *stream;
+    pid_t pid;
+    struct popen_child *next;
+};
+static struct popen_child *popen_children;
+
+static int popen_pipe(int fds[2]) {
+# ifdef HAVE_PIPE2
+    return pipe2(fds, O_CLOEXEC);
+# else
+    if (pipe(fds) == -1) {
+        return -1;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+# endif
+}
+#endif
+
+/* FILE *popen(char const *, char const *) */
+HOOK_FUNC_DEF2(FILE *, popen, char const *, command, char const *, type) {
+#ifdef HAVE_SPAWN
+    int reading = 0, writing = 0, cloexec = 0;
+    char const *x;
+    for (x = type; x && *x; x++) {
+        if (*x == 'r') {
+            reading++;
+        } else if (*x == 'w') {
+            writing++;
+        } else if (*x == 'e') {
+            cloexec = 1;
+        } else {
+            break;
+        }
+    }
+    if (!x || *x || reading + writing != 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* We use the real_* functions directly. */
+    hooks_init();
+
+    struct popen_child *child = malloc(sizeof(*child));
+    if (!child) {
+        return NULL;
+    }
+    int fds[2];
+    if (popen_pipe(fds) == -1) {
+        free(child);
+        return NULL;
+    }
+    /* The child's stdin or stdout is the pipe. */
+    int parent_fd = reading ? fds[0] : fds[1];
+    int child_fd = reading ? fds[1] : fds[0];
+    int target_fd = reading ? STDOUT_FILENO : STDIN_FILENO;
+
+    struct tracked_fds_changes changes;
+    changes.count = 0;
+    changes.closefrom = INT_MAX;
+
+    posix_spawn_file_actions_t actions;
+    int result = real_posix_spawn_file_actions_init(&actions);
+    if (result != 0) {
+        close(fds[0]);
+        close(fds[1]);
+        free(child);
+        errno = result;
+        return NULL;
+    }
+
+    shell_lock();
+
+    /* POSIX requires closing the streams of earlier popen() calls in the
+     * child. */
+    struct popen_child *y;
+    for (y = popen_children; y; y = y->next) {
+        int fd = fileno(y->stream);
+        real_posix_spawn_file_actions_addclose(&actions, fd);
+        tracked_fds_changes_set(&changes, fd, 0);
+    }
+    /* dup2() clears the close-on-exec flag. If the pipe is already the
+     * target (stdin or stdout was closed) clear it directly as
+     * posix_spawn_file_actions_adddup2() with the same descriptor does
+     * nothing with older libcs. */
+    if (child_fd != target_fd) {
+        real_posix_spawn_file_actions_adddup2(&actions, child_fd, target_fd);
+    } else {
+        fcntl(child_fd, F_SETFD, 0);
+    }
+    tracked_fds_changes_set(&changes, target_fd, 0);
+
+    pid_t pid;
+    result = spawn_shell(&pid, command, &actions, NULL, &changes);
+    real_posix_spawn_file_actions_destroy(&actions);
+    close(child_fd);
+
+    FILE *stream = NULL;
+    if (result == 0) {
+        if (!cloexec) {
+            fcntl(parent_fd, F_SETFD, 0);
+        }
+        stream = fdopen(parent_fd, reading ? "r" : "w");
+    }
+    if (stream) {
+        child->stream = stream;
+        child->pid = pid;
+        child->next = popen_children;
+        popen_children = child;
+    }
+
+    shell_unlock();
+
+    if (!stream) {
+        int saved_errno = result != 0 ? result : errno;
+        close(parent_fd);
+        if (result == 0) {
+            /* The shell sees EOF or SIGPIPE. */
+            int status;
+            wait_child(pid, &status);
+        }
+        free(child);
+        errno = saved_errno;
+    }
+    return stream;
+#else
+    /* The child's stdin or stdout is the pipe. */
+    struct tracked_fds_changes changes;
+    changes.count = 0;
+    changes.closefrom = INT_MAX;
+    if (type && (type[0] == 'r' || type[0] == 'w')) {
+        changes.change[0].fd = type[0] == 'r' ? STDOUT_FILENO : STDIN_FILENO;
+        changes.change[0].tracked = 0;
+        changes.change[0].cloexec = 0;
+        changes.count++;
+    }
+
+    ignored_binaries_resolve();
+    output_flush();
+    update_environment_changes(&changes);
+    return real_popen(command, type);
+#endif
+}
+
+#ifdef HAVE_SPAWN
+/* int pclose(FILE *) */
+HOOK_FUNC_DEF1(int, pclose, FILE *, stream) {
+    shell_lock();
+    struct popen_child **x = &popen_children;
+    while (*x && (*x)->stream != stream) {
+        x = &(*x)->next;
+    }
+    struct popen_child *child = *x;
+    if (child) {
+        *x = child->next;
+    }
+    shell_unlock();
+
+    /* Not returned by our popen(). */
+    if (!child) {
+        return real_pclose(stream);
+    }
+
+    pid_t pid = child->pid;
+    free(child);
+
+    fclose(stream);
+
+    /* Like glibc the wait is no cancellation point, a cancelled thread would
+     * never reap the child. */
+# ifdef HAVE_PTHREAD_SETCANCELSTATE
+    int state;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+# endif
+    int status;
+    int result = wait_child(pid, &status);
+# ifdef HAVE_PTHREAD_SETCANCELSTATE
+    int saved_errno = errno;
+    pthread_setcancelstate(state, NULL);
+    errno = saved_errno;
+# endif
+    if (result == -1) {
+        return -1;
+    }
+    return status;
+}
 #endif
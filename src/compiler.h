@@ -34,11 +34,24 @@
  * hook those functions and nobody else should modify them. Not strictly
  * necessary, but nice to have. */
 # define visibility_protected __attribute__((visibility("protected")))
+/* Not exported, but callable from assembler code in this module. */
+# define visibility_hidden __attribute__((visibility("hidden")))
+/* Align to the (most common) cache line size. Used to keep data which is
+ * accessed together in a single cache line. */
+# define cacheline_aligned __attribute__((aligned(64)))
+/* Run the function when the library is loaded, before main(). */
+# define constructor __attribute__((constructor))
+/* Run the function when the process exits (or the library is unloaded). */
+# define destructor  __attribute__((destructor))
 #else
 # define noinline
 # define always_inline
 # define unused
 # define visibility_protected
+# define visibility_hidden
+# define cacheline_aligned
+# define constructor
+# define destructor
 #endif
 
 /* Branch prediction information for the compiler. */
@@ -50,4 +63,74 @@
 # define unlikely(x) x
 #endif
 
+/* Atomic accesses to data shared between threads without a lock (e.g. the
+ * tracked descriptors). Relaxed loads and stores compile to plain moves but
+ * can't be torn or cached by the compiler. Read-modify-write operations
+ * (except atomic_add*()) return the old value. Fall back to the __sync
+ * builtins (full barrier) and finally to plain (not thread-safe) accesses. */
+#if defined(HAVE___ATOMIC_LOAD_N)
+# define atomic_load_relaxed(x)      __atomic_load_n((x), __ATOMIC_RELAXED)
+# define atomic_load_acquire(x)      __atomic_load_n((x), __ATOMIC_ACQUIRE)
+# define atomic_store_relaxed(x, v)  \
+    __atomic_store_n((x), (v), __ATOMIC_RELAXED)
+# define atomic_store_release(x, v)  \
+    __atomic_store_n((x), (v), __ATOMIC_RELEASE)
+# define atomic_fetch_or(x, v)       \
+    __atomic_fetch_or((x), (v), __ATOMIC_RELEASE)
+# define atomic_fetch_and(x, v)      \
+    __atomic_fetch_and((x), (v), __ATOMIC_RELEASE)
+# define atomic_add(x, v)            \
+    ((void)__atomic_fetch_add((x), (v), __ATOMIC_RELAXED))
+# define atomic_add_release(x, v)    \
+    ((void)__atomic_fetch_add((x), (v), __ATOMIC_RELEASE))
+#elif defined(HAVE___SYNC_BOOL_COMPARE_AND_SWAP)
+# define atomic_load_relaxed(x)      (*(volatile __typeof__(*(x)) *)(x))
+# define atomic_load_acquire(x)      __sync_fetch_and_add((x), 0)
+# define atomic_store_relaxed(x, v)  \
+    ((void)(*(volatile __typeof__(*(x)) *)(x) = (v)))
+# define atomic_store_release(x, v)  \
+    ((void)(__sync_synchronize(), atomic_store_relaxed((x), (v))))
+# define atomic_fetch_or(x, v)       __sync_fetch_and_or((x), (v))
+# define atomic_fetch_and(x, v)      __sync_fetch_and_and((x), (v))
+# define atomic_add(x, v)            ((void)__sync_fetch_and_add((x), (v)))
+# define atomic_add_release(x, v)    atomic_add((x), (v))
+#else
+# define atomic_load_relaxed(x)      (*(x))
+# define atomic_load_acquire(x)      (*(x))
+# define atomic_store_relaxed(x, v)  ((void)(*(x) = (v)))
+# define atomic_store_release(x, v)  ((void)(*(x) = (v)))
+# define atomic_fetch_or(x, v)       atomic_fetch_or_plain((x), (v))
+# define atomic_fetch_and(x, v)      atomic_fetch_and_plain((x), (v))
+# define atomic_add(x, v)            ((void)(*(x) += (v)))
+# define atomic_add_release(x, v)    atomic_add((x), (v))
+static inline unsigned long atomic_fetch_or_plain(unsigned long *x,
+                                                  unsigned long v) {
+    unsigned long old = *x;
+    *x |= v;
+    return old;
+}
+static inline unsigned long atomic_fetch_and_plain(unsigned long *x,
+                                                   unsigned long v) {
+    unsigned long old = *x;
+    *x &= v;
+    return old;
+}
+#endif
+/* Compare-and-swap (full barrier): set *x to new if it's old. Returns 1 on
+ * success. */
+#if defined(HAVE___SYNC_BOOL_COMPARE_AND_SWAP)
+# define atomic_cas(x, old, new)     \
+    __sync_bool_compare_and_swap((x), (old), (new))
+#else
+# define atomic_cas(x, old, new)     atomic_cas_plain((x), (old), (new))
+static inline int atomic_cas_plain(unsigned long *x, unsigned long old,
+                                   unsigned long new) {
+    if (*x != old) {
+        return 0;
+    }
+    *x = new;
+    return 1;
+}
+#endif
+
 #endif
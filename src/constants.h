@@ -21,12 +21,16 @@
 #define CONSTANTS_H 1
 
 /* Names of used environment variables. */
+#define ENV_NAME_PREFIX           "COLORED_STDERR_"
 #define ENV_NAME_FDS              "COLORED_STDERR_FDS"
 #define ENV_NAME_PRE_STRING       "COLORED_STDERR_PRE"
 #define ENV_NAME_POST_STRING      "COLORED_STDERR_POST"
 #define ENV_NAME_FORCE_WRITE      "COLORED_STDERR_FORCE_WRITE"
 #define ENV_NAME_IGNORED_BINARIES "COLORED_STDERR_IGNORED_BINARIES"
 #define ENV_NAME_PRIVATE_FDS      "COLORED_STDERR_PRIVATE_FDS"
+#define ENV_NAME_LINE_BUFFER      "COLORED_STDERR_LINE_BUFFER"
+#define ENV_NAME_DEFER_POST       "COLORED_STDERR_DEFER_POST"
+#define ENV_NAME_MERGE_BUFFERED   "COLORED_STDERR_MERGE_BUFFERED"
 
 /* Strings written before/after each matched function. */
 #define DEFAULT_PRE_STRING  "\033[31m" /* red */
@@ -36,8 +40,68 @@
  * normal use was 255 (by bash), which yielded this limit to prevent
  * unnecessary calls to malloc() whenever possible. */
 #define TRACKFDS_STATIC_COUNT 256
-/* Number of new elements to allocate per realloc(). */
-#define TRACKFDS_REALLOC_STEP 10
+/* They are stored in a bitmap of unsigned longs. */
+#define TRACKFDS_WORD_BITS    (8 * sizeof(unsigned long))
+#define TRACKFDS_STATIC_WORDS (TRACKFDS_STATIC_COUNT / TRACKFDS_WORD_BITS)
+/* Larger descriptors are stored in leaves of a two-level bitmap (see
+ * trackfds.h), each leaf stores TRACKFDS_LEAF_COUNT descriptors. */
+#define TRACKFDS_LEAF_COUNT 4096
+#define TRACKFDS_LEAF_WORDS (TRACKFDS_LEAF_COUNT / TRACKFDS_WORD_BITS)
+/* Descriptors >= TRACKFDS_MAX are not tracked. Much higher than the default
+ * maximum on Linux (1048576, see /proc/sys/fs/nr_open). */
+#define TRACKFDS_MAX (1 << 24)
+#define TRACKFDS_LEAVES (TRACKFDS_MAX / TRACKFDS_LEAF_COUNT)
+/* Number of preallocated leaves, further ones are mmap()ed. Each leaf needs
+ * 2 KiB, but only if used. */
+#define TRACKFDS_ARENA_LEAVES 64
+
+/* Maximum number of recorded file actions per posix_spawn_file_actions_t
+ * and number of posix_spawn_file_actions_t which can be recorded at the same
+ * time. If exceeded the child uses our tracked descriptors unchanged. */
+#define TRACKFDS_CHANGES_MAX 32
+#define SPAWN_ACTIONS_SLOTS  16
+
+/* Environments with more entries are copied to an mmap()ed area instead of
+ * the stack when passing them to a new program. */
+#define ENV_COPY_STACK_COUNT 256
+/* Maximum size of the cached ENV_NAME_PRIVATE_FDS entry. */
+#define ENV_FDS_CACHE_SIZE   128
+
+/* Maximum number of patterns in ENV_NAME_IGNORED_BINARIES and their total
+ * size. Further patterns are ignored. */
+#define IGNORED_BINARIES_MAX  32
+#define IGNORED_BINARIES_SIZE 1024
+
+/* Number of iovec entries (including the pre/post string) of a colored
+ * writev() kept in a fixed array on the stack. Calls with more entries use a
+ * larger array bounded by IOV_MAX. */
+#define WRITEV_STACK_COUNT 16
+
+/* Size of the buffer on the stack used to format the output of dprintf().
+ * Larger outputs are written with multiple write()s. */
+#define DPRINTF_BUFFER_SIZE 1024
+
+/* Size of the buffer on the stack used to format the messages of error(),
+ * warn(), perror() and similar functions. Longer messages are written by the
+ * libc in multiple parts. */
+#define DIAGNOSTIC_BUFFER_SIZE 1024
+
+/* Number of wide characters formatted on the stack by the hooked wprintf()
+ * functions (and the maximum length of the converted pre/post strings).
+ * Larger outputs are written by the real function. */
+#define WIDE_BUFFER_SIZE 256
+
+/* Size of the per-thread buffer used to write the pre/post strings and the
+ * data of stdio functions on unbuffered streams with a single write(). */
+#define STAGING_BUFFER_SIZE 1024
+
+/* Size of the per-thread buffer used to collect single characters (see
+ * ENV_NAME_LINE_BUFFER). Together with the pre/post strings it must fit in
+ * STAGING_BUFFER_SIZE and should stay below PIPE_BUF (4096 on Linux) so
+ * lines are written atomically. Number of threads which can use a buffer at
+ * the same time, other threads write unbuffered. */
+#define LINE_BUFFER_SIZE  512
+#define LINE_BUFFER_SLOTS 32
 
 #ifdef DEBUG
 # define DEBUG_FILE "colored_stderr_debug_log.txt"
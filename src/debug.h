@@ -31,10 +31,6 @@ static void debug_write(int fd, int first_call, char const *format, va_list ap)
         written = sizeof(buffer) - 1;
     }
 
-    /* Make sure these functions are loaded. */
-    DLSYM_FUNCTION(real_write, "write");
-    DLSYM_FUNCTION(real_close, "close");
-
     if (first_call) {
         char const nl = '\n';
         real_write(fd, &nl, 1);
@@ -0,0 +1,416 @@
+/*
+ * Look up symbols in the symbol tables of loaded objects without dlsym().
+ *
+ * Copyright (C) 2013-2018  Simon Ruderich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DYNLINK_H
+#define DYNLINK_H 1
+
+/*
+ * Each dlsym(RTLD_NEXT, name) walks the hash tables of all objects loaded
+ * after us. To resolve all hooked functions at once, the objects are walked
+ * only once (via the link_map list) and each name is looked up in the
+ * object's GNU hash table (DT_GNU_HASH) directly.
+ *
+ * This mimics the lookup of dlsym(): the first object (in load order) which
+ * defines the symbol wins, hidden versions are ignored. Anything unusual
+ * (e.g. an object without DT_GNU_HASH or an IFUNC symbol) is left to dlsym().
+ */
+
+#include <elf.h>
+#include <link.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+/* ELF64_ST_BIND() and ELF64_ST_TYPE() work for 32-bit objects too (same as
+ * the ELF32_* macros). */
+
+/* Dynamic section of this object, provided by the linker. */
+extern ElfW(Dyn) _DYNAMIC[];
+
+/* Data of a loaded object required for symbol lookups. */
+struct dynlink_object {
+    ElfW(Addr) base;
+    ElfW(Sym) const *symtab;
+    char const *strtab;
+    ElfW(Half) const *versym;
+    uint32_t const *gnu_hash;
+};
+
+static uint32_t dynlink_gnu_hash(char const *name) {
+    uint32_t hash = 5381;
+    for (; *name; name++) {
+        hash = hash * 33 + (unsigned char)*name;
+    }
+    return hash;
+}
+
+/* The dynamic section of most objects is relocated by the dynamic linker,
+ * but not for all (e.g. the vDSO or on some architectures). */
+static ElfW(Addr) dynlink_pointer(ElfW(Addr) base, ElfW(Addr) ptr) {
+    if (ptr < base) {
+        ptr += base;
+    }
+    return ptr;
+}
+
+/* Returns 0 if the object can't be used for lookups (no DT_GNU_HASH). */
+static int dynlink_object_init(struct dynlink_object *object,
+                               struct link_map const *map) {
+    ElfW(Dyn) const *dyn;
+
+    object->base     = map->l_addr;
+    object->symtab   = NULL;
+    object->strtab   = NULL;
+    object->versym   = NULL;
+    object->gnu_hash = NULL;
+
+    for (dyn = map->l_ld; dyn && dyn->d_tag != DT_NULL; dyn++) {
+        switch (dyn->d_tag) {
+            case DT_SYMTAB:
+                object->symtab = (ElfW(Sym) const *)
+                    dynlink_pointer(map->l_addr, dyn->d_un.d_ptr);
+                break;
+            case DT_STRTAB:
+                object->strtab = (char const *)
+                    dynlink_pointer(map->l_addr, dyn->d_un.d_ptr);
+                break;
+            case DT_VERSYM:
+                object->versym = (ElfW(Half) const *)
+                    dynlink_pointer(map->l_addr, dyn->d_un.d_ptr);
+                break;
+            case DT_GNU_HASH:
+                object->gnu_hash = (uint32_t const *)
+                    dynlink_pointer(map->l_addr, dyn->d_un.d_ptr);
+                break;
+        }
+    }
+
+    return object->symtab && object->strtab && object->gnu_hash;
+}
+
+/* Look up name (hash is dynlink_gnu_hash(name)) in object. Returns 1 and
+ * stores the address in result if found, 0 if not found and -1 if the symbol
+ * exists but must be resolved by dlsym(). */
+static int dynlink_lookup(struct dynlink_object const *object,
+                          char const *name, uint32_t hash, void **result) {
+    uint32_t const *table = object->gnu_hash;
+    uint32_t nbuckets   = table[0];
+    uint32_t symoffset  = table[1];
+    uint32_t bloom_size = table[2];
+    uint32_t bloom_shift = table[3];
+    ElfW(Addr) const *bloom = (ElfW(Addr) const *)&table[4];
+    uint32_t const *buckets = (uint32_t const *)&bloom[bloom_size];
+    uint32_t const *chain   = &buckets[nbuckets];
+
+    size_t const bits = 8 * sizeof(ElfW(Addr));
+
+    if (nbuckets == 0 || bloom_size == 0) {
+        return 0;
+    }
+
+    /* Quick check with the Bloom filter. */
+    ElfW(Addr) word = bloom[(hash / bits) % bloom_size];
+    ElfW(Addr) mask = (ElfW(Addr))1 << (hash % bits)
+                    | (ElfW(Addr))1 << ((hash >> bloom_shift) % bits);
+    if ((word & mask) != mask) {
+        return 0;
+    }
+
+    uint32_t index = buckets[hash % nbuckets];
+    if (index < symoffset) {
+        return 0;
+    }
+
+    ElfW(Sym) const *found = NULL;
+    size_t versions = 0;
+    for (;; index++) {
+        uint32_t chain_hash = chain[index - symoffset];
+
+        ElfW(Sym) const *sym = &object->symtab[index];
+        if ((chain_hash | 1) == (hash | 1)
+                && sym->st_shndx != SHN_UNDEF
+                && sym->st_value != 0
+                && ELF64_ST_BIND(sym->st_info) != STB_LOCAL
+                && !strcmp(object->strtab + sym->st_name, name)) {
+            /* Same as dlsym(): Use unversioned symbols (or the base
+             * version) directly. Otherwise use the only not hidden (= the
+             * default) version. */
+            if (!object->versym || (object->versym[index] & 0x7fff) < 2) {
+                found = sym;
+                versions = 1;
+                break;
+            }
+            if (!(object->versym[index] & 0x8000)) {
+                found = sym;
+                versions++;
+            }
+        }
+
+        if (chain_hash & 1) {
+            break;
+        }
+    }
+    if (versions != 1) {
+        return 0;
+    }
+
+    if (ELF64_ST_TYPE(found->st_info) != STT_FUNC) {
+        return -1;
+    }
+    *result = (void *)(object->base + found->st_value);
+    return 1;
+}
+
+/*
+ * Rebinding: Change the GOT entries of loaded objects which point to one of
+ * our functions to another function (e.g. the real function in the libc).
+ * Only the common relocations used for function calls are handled (PLT and
+ * GOT entries).
+ */
+#if defined(__x86_64__)
+# define DYNLINK_R_JUMP_SLOT R_X86_64_JUMP_SLOT
+# define DYNLINK_R_GLOB_DAT  R_X86_64_GLOB_DAT
+#elif defined(__i386__)
+# define DYNLINK_R_JUMP_SLOT R_386_JMP_SLOT
+# define DYNLINK_R_GLOB_DAT  R_386_GLOB_DAT
+#elif defined(__aarch64__)
+# define DYNLINK_R_JUMP_SLOT R_AARCH64_JUMP_SLOT
+# define DYNLINK_R_GLOB_DAT  R_AARCH64_GLOB_DAT
+#elif defined(__arm__)
+# define DYNLINK_R_JUMP_SLOT R_ARM_JUMP_SLOT
+# define DYNLINK_R_GLOB_DAT  R_ARM_GLOB_DAT
+#endif
+
+#if defined(DYNLINK_R_JUMP_SLOT) && defined(HAVE_DL_ITERATE_PHDR) \
+        && defined(HAVE_MPROTECT)
+# define HAVE_DYNLINK_REBIND 1
+
+# if UINTPTR_MAX > 0xffffffff
+#  define DYNLINK_R_SYM(info)  ELF64_R_SYM(info)
+#  define DYNLINK_R_TYPE(info) ELF64_R_TYPE(info)
+# else
+#  define DYNLINK_R_SYM(info)  ELF32_R_SYM(info)
+#  define DYNLINK_R_TYPE(info) ELF32_R_TYPE(info)
+# endif
+
+struct dynlink_rebind {
+    char const *name;
+    /* Rebind GOT entries pointing to from ... */
+    ElfW(Addr) from;
+    /* ... to to. */
+    ElfW(Addr) to;
+};
+struct dynlink_rebind_data {
+    struct dynlink_rebind const *rebind;
+    size_t count;
+    /* Number of changed GOT entries. */
+    size_t changed;
+};
+
+/* Change the protection of the RELRO segment. Like ld.so's
+ * _dl_protect_relro() the end is rounded down: the page containing the end
+ * of the segment also contains writable data (.data, .bss) and was never made
+ * read-only. */
+static int dynlink_relro_protect(struct dl_phdr_info const *info,
+                                 ElfW(Phdr) const *relro, int prot) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    ElfW(Addr) start = info->dlpi_addr + relro->p_vaddr;
+    ElfW(Addr) end   = start + relro->p_memsz;
+    start &= ~(ElfW(Addr))(page - 1);
+    end   &= ~(ElfW(Addr))(page - 1);
+
+    if (start == end) {
+        return 0;
+    }
+    return mprotect((void *)start, end - start, prot);
+}
+
+/* Rebind the relocations in table (Elf_Rel or Elf_Rela entries with entry
+ * size entsize). */
+static void dynlink_rebind_table(struct dynlink_rebind_data *data,
+                                 struct dl_phdr_info const *info,
+                                 ElfW(Sym) const *symtab, char const *strtab,
+                                 ElfW(Addr) end,
+                                 ElfW(Phdr) const *relro,
+                                 int *relro_writable,
+                                 char const *table, size_t size,
+                                 size_t entsize) {
+    char const *x;
+
+    if (!table || entsize == 0) {
+        return;
+    }
+
+    for (x = table; x + entsize <= table + size; x += entsize) {
+        /* r_offset and r_info are at the same position in Elf_Rel and
+         * Elf_Rela. */
+        ElfW(Rel) const *rel = (ElfW(Rel) const *)x;
+
+        size_t type = DYNLINK_R_TYPE(rel->r_info);
+        if (type != DYNLINK_R_JUMP_SLOT && type != DYNLINK_R_GLOB_DAT) {
+            continue;
+        }
+        char const *name = strtab + symtab[DYNLINK_R_SYM(rel->r_info)].st_name;
+
+        size_t i;
+        for (i = 0; i < data->count; i++) {
+            if (name[0] == data->rebind[i].name[0]
+                    && !strcmp(name, data->rebind[i].name)) {
+                break;
+            }
+        }
+        if (i == data->count) {
+            continue;
+        }
+
+        ElfW(Addr) *got = (ElfW(Addr) *)(info->dlpi_addr + rel->r_offset);
+        /* Only change entries bound to us or not yet bound (lazy binding,
+         * points into the object's PLT). Don't touch entries bound to other
+         * libraries. */
+        if (*got != data->rebind[i].from
+                && (*got < info->dlpi_addr || *got >= end)) {
+            continue;
+        }
+
+        /* The GOT is read-only after relocation with RELRO. */
+        if (relro && !*relro_writable
+                && (ElfW(Addr))got >= info->dlpi_addr + relro->p_vaddr
+                && (ElfW(Addr))got < info->dlpi_addr + relro->p_vaddr
+                                                    + relro->p_memsz) {
+            if (dynlink_relro_protect(info, relro, PROT_READ | PROT_WRITE)) {
+                continue;
+            }
+            *relro_writable = 1;
+        }
+
+        *got = data->rebind[i].to;
+        data->changed++;
+    }
+}
+
+static int dynlink_rebind_callback(struct dl_phdr_info *info,
+                                   size_t size unused, void *arg) {
+    struct dynlink_rebind_data *data = arg;
+
+    ElfW(Phdr) const *relro = NULL;
+    ElfW(Dyn) const *dynamic = NULL;
+    ElfW(Addr) end = info->dlpi_addr;
+
+    ElfW(Half) i;
+    for (i = 0; i < info->dlpi_phnum; i++) {
+        ElfW(Phdr) const *phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type == PT_DYNAMIC) {
+            dynamic = (ElfW(Dyn) const *)(info->dlpi_addr + phdr->p_vaddr);
+        } else if (phdr->p_type == PT_GNU_RELRO) {
+            relro = phdr;
+        } else if (phdr->p_type == PT_LOAD
+                && info->dlpi_addr + phdr->p_vaddr + phdr->p_memsz > end) {
+            end = info->dlpi_addr + phdr->p_vaddr + phdr->p_memsz;
+        }
+    }
+    /* Skip objects without relocations and ourselves. */
+    if (!dynamic || dynamic == _DYNAMIC) {
+        return 0;
+    }
+
+    ElfW(Addr) base = info->dlpi_addr;
+    ElfW(Sym) const *symtab = NULL;
+    char const *strtab = NULL;
+    char const *jmprel = NULL, *rel = NULL, *rela = NULL;
+    size_t jmprel_size = 0, rel_size = 0, rela_size = 0;
+    size_t jmprel_entsize = sizeof(ElfW(Rela));
+    size_t rel_entsize = sizeof(ElfW(Rel)), rela_entsize = sizeof(ElfW(Rela));
+
+    ElfW(Dyn) const *dyn;
+    for (dyn = dynamic; dyn->d_tag != DT_NULL; dyn++) {
+        switch (dyn->d_tag) {
+            case DT_SYMTAB:
+                symtab = (ElfW(Sym) const *)dynlink_pointer(base,
+                                                            dyn->d_un.d_ptr);
+                break;
+            case DT_STRTAB:
+                strtab = (char const *)dynlink_pointer(base, dyn->d_un.d_ptr);
+                break;
+            case DT_JMPREL:
+                jmprel = (char const *)dynlink_pointer(base, dyn->d_un.d_ptr);
+                break;
+            case DT_PLTRELSZ:
+                jmprel_size = dyn->d_un.d_val;
+                break;
+            case DT_PLTREL:
+                jmprel_entsize = dyn->d_un.d_val == DT_REL
+                               ? sizeof(ElfW(Rel)) : sizeof(ElfW(Rela));
+                break;
+            case DT_REL:
+                rel = (char const *)dynlink_pointer(base, dyn->d_un.d_ptr);
+                break;
+            case DT_RELSZ:
+                rel_size = dyn->d_un.d_val;
+                break;
+            case DT_RELENT:
+                rel_entsize = dyn->d_un.d_val;
+                break;
+            case DT_RELA:
+                rela = (char const *)dynlink_pointer(base, dyn->d_un.d_ptr);
+                break;
+            case DT_RELASZ:
+                rela_size = dyn->d_un.d_val;
+                break;
+            case DT_RELAENT:
+                rela_entsize = dyn->d_un.d_val;
+                break;
+        }
+    }
+    if (!symtab || !strtab) {
+        return 0;
+    }
+
+    int relro_writable = 0;
+    dynlink_rebind_table(data, info, symtab, strtab, end,
+                         relro, &relro_writable,
+                         jmprel, jmprel_size, jmprel_entsize);
+    dynlink_rebind_table(data, info, symtab, strtab, end,
+                         relro, &relro_writable,
+                         rel, rel_size, rel_entsize);
+    dynlink_rebind_table(data, info, symtab, strtab, end,
+                         relro, &relro_writable,
+                         rela, rela_size, rela_entsize);
+    if (relro_writable) {
+        dynlink_relro_protect(info, relro, PROT_READ);
+    }
+
+    return 0;
+}
+
+/* Rebind the GOT entries of all loaded objects (except ourselves). Returns
+ * the number of changed entries. */
+static size_t dynlink_rebind(struct dynlink_rebind const *rebind,
+                             size_t count) {
+    struct dynlink_rebind_data data;
+
+    data.rebind  = rebind;
+    data.count   = count;
+    data.changed = 0;
+
+    dl_iterate_phdr(dynlink_rebind_callback, &data);
+    return data.changed;
+}
+#endif
+
+#endif
@@ -25,135 +25,286 @@
  * in a static variable (real_*). Any function called in these macros must
  * make sure to restore the errno if it changes it.
  *
+ * All real_* variables are resolved and the environment is loaded by
+ * hooks_init() which runs as constructor when the library is loaded. Until
+ * then real_<name> points to <name>_lazy() which runs hooks_init() itself
+ * (e.g. when called from another library's constructor) and then calls the
+ * hook again. Therefore the hooks don't have to check if everything is
+ * initialized.
+ *
  * "Pseudo code" for the following macros. <name> is the name of the hooked
  * function, <fd> is either a file descriptor or a FILE pointer.
  *
- *     if (!real_<name>) {
- *         real_<name> = dlsym_function(<name>);
- *         if (!initialized) {
- *             init_from_environment();
+ *     <type> <name>(<args>) {
+ *         if (tracked_fds_untracked(<fd>)) {
+ *             return real_<name>(<args>);
  *         }
+ *         return <name>_slow(<args>);
  *     }
- *     if (tracked_fds_find(<fd>)) {
- *         if (force_write_to_non_tty) {
- *             handle = 1;
- *         } else {
- *             handle = isatty_noinline(<fd>);
+ *
+ *     <type> <name>_slow(<args>) {
+ *         if (!tracked_fds_find(<fd>) || !check_handle(<fd>)) {
+ *             return real_<name>(<args>);
  *         }
- *     } else {
- *         handle = 0;
- *     }
  *
- *     if (handle) {
  *         handle_<fd>_pre(<fd>);
- *     }
- *     <type> result = real_<name>(<args>);
- *     if (handle) {
+ *         <type> result = real_<name>(<args>);
  *         handle_<fd>_post(<fd>);
+ *         return result;
  *     }
- *     return result;
+ *
+ * The common case (an untracked descriptor) is only a bit test and a tail
+ * call. Everything else happens in the not inlined <name>_slow() so the
+ * compiler doesn't have to save any registers in <name>(). check_handle()
+ * checks if the descriptor is a tty (see isatty_cached()).
  */
 
-#define _HOOK_PRE(type, name, fd) \
-        int handle; \
-        if (unlikely(!(real_ ## name ))) { \
-            *(void **) (&(real_ ## name)) = dlsym_function(#name); \
-            /* Initialize our data while we're at it. */ \
-            if (unlikely(!initialized)) { \
-                init_from_environment(); \
-            } \
-        } \
-        /* Check if this fd should be handled. */ \
-        if (unlikely(tracked_fds_find(fd))) { \
-            if (unlikely(force_write_to_non_tty)) { \
-                handle = 1; \
-            } else { \
-                handle = isatty_noinline(fd); \
-            } \
+/* Hooks with a real_* variable register it in this section so hooks_init()
+ * can resolve all of them at once. Only pointers are stored in the section
+ * as the compiler may add padding between larger objects. */
+struct hook {
+    char const *name;
+    void **real;
+    /* Initial value of *real, NULL if there is none. */
+    void (*lazy)(void);
+    /* Our function, see hooks_dormant(). */
+    void (*hook)(void);
+};
+#ifdef HAVE___ATTRIBUTE__
+/* The linker provides __start_coloredstderr_hooks and
+ * __stop_coloredstderr_hooks, see hooks_resolve(). */
+# define _HOOK_SECTION __attribute__((section("coloredstderr_hooks"), used))
+#else
+# define _HOOK_SECTION
+#endif
+
+#define _HOOK_REGISTER(name, lazy) \
+    static struct hook hook_ ## name = { \
+        #name, (void **)&real_ ## name, lazy, (void (*)(void))name, \
+    }; \
+    static struct hook *hook_ ## name ## _ptr _HOOK_SECTION = &hook_ ## name;
+/* Define real_<name>, initialized with the stub <name>_lazy(). */
+#define _HOOK_REAL(type, name, params, args) \
+    static type name ## _lazy params; \
+    static type (*real_ ## name) params = name ## _lazy; \
+    _HOOK_REGISTER(name, (void (*)(void))name ## _lazy) \
+    static type name ## _lazy params { \
+        if (likely(hook_lazy(&hook_ ## name))) { \
+            return name args; \
+        } \
+        return real_ ## name args; \
+    }
+#define _HOOK_REAL_VOID(name, params, args) \
+    static void name ## _lazy params; \
+    static void (*real_ ## name) params = name ## _lazy; \
+    _HOOK_REGISTER(name, (void (*)(void))name ## _lazy) \
+    static void name ## _lazy params { \
+        if (likely(hook_lazy(&hook_ ## name))) { \
+            name args; \
         } else { \
-            handle = 0; \
-        }
-#define _HOOK_PRE_FD(type, name, fd) \
-        type result; \
-        _HOOK_PRE_FD_(type, name, fd)
-#define _HOOK_PRE_FD_(type, name, fd) \
-        _HOOK_PRE(type, name, fd) \
-        if (unlikely(handle)) { \
-            handle_fd_pre(fd); \
-        }
-#define _HOOK_PRE_FILE(type, name, file) \
-        type result; \
-        _HOOK_PRE(type, name, fileno(file)) \
-        if (unlikely(handle)) { \
-            handle_file_pre(file); \
-        }
-#define _HOOK_POST_FD_(fd) \
-        if (unlikely(handle)) { \
-            handle_fd_post(fd); \
-        }
-#define _HOOK_POST_FD(fd) \
-        _HOOK_POST_FD_(fd) \
-        return result;
-#define _HOOK_POST_FILE(file) \
-        if (unlikely(handle)) { \
-            handle_file_post(file); \
+            real_ ## name args; \
         } \
-        return result;
+    }
+
+/* Check if this fd should be handled, see hook_handle(). */
+#define _HOOK_HANDLE(fd) hook_handle(fd)
+/* Destination of a write to offset (a pointer, NULL for the current
+ * position). Writes to an explicit offset fail on terminals and pipes and the
+ * pre/post strings would move the data in regular files, so they use -1
+ * which is never tracked. */
+#define _HOOK_FD_CURRENT(fd, offset) ((offset) ? -1 : (fd))
+
+/* Result of a stdio function whose output couldn't be written, see
+ * handle_file_post(): EOF (or -1) for functions returning int, 0 items for
+ * fwrite() which returns an unsigned size_t. */
+#define _HOOK_FILE_ERROR(type) ((type)-1 > 0 ? (type)0 : (type)-1)
+
+#ifdef HAVE_STRUCT__IO_FILE__FILENO
+/* Faster than fileno() which is a function call. */
+# define _HOOK_FILENO(file) ((file)->_fileno)
+#else
+# define _HOOK_FILENO(file) fileno(file)
+#endif
 
 
+#define HOOK_FUNC_DEF0(type, name) \
+    type name(void) visibility_protected; \
+    _HOOK_REAL(type, name, (void), ()) \
+    type name(void)
 #define HOOK_FUNC_DEF1(type, name, type1, arg1) \
-    static type (*real_ ## name)(type1); \
     type name(type1) visibility_protected; \
+    _HOOK_REAL(type, name, (type1 arg1), (arg1)) \
     type name(type1 arg1)
 #define HOOK_FUNC_DEF2(type, name, type1, arg1, type2, arg2) \
-    static type (*real_ ## name)(type1, type2); \
     type name(type1, type2) visibility_protected; \
+    _HOOK_REAL(type, name, (type1 arg1, type2 arg2), (arg1, arg2)) \
     type name(type1 arg1, type2 arg2)
 #define HOOK_FUNC_DEF3(type, name, type1, arg1, type2, arg2, type3, arg3) \
-    static type (*real_ ## name)(type1, type2, type3); \
     type name(type1, type2, type3) visibility_protected; \
+    _HOOK_REAL(type, name, (type1 arg1, type2 arg2, type3 arg3), \
+                           (arg1, arg2, arg3)) \
     type name(type1 arg1, type2 arg2, type3 arg3)
 #define HOOK_FUNC_DEF4(type, name, type1, arg1, type2, arg2, type3, arg3, type4, arg4) \
-    static type (*real_ ## name)(type1, type2, type3, type4); \
     type name(type1, type2, type3, type4) visibility_protected; \
+    _HOOK_REAL(type, name, (type1 arg1, type2 arg2, type3 arg3, type4 arg4), \
+                           (arg1, arg2, arg3, arg4)) \
     type name(type1 arg1, type2 arg2, type3 arg3, type4 arg4)
+#define HOOK_FUNC_DEF5(type, name, type1, arg1, type2, arg2, type3, arg3, type4, arg4, type5, arg5) \
+    type name(type1, type2, type3, type4, type5) visibility_protected; \
+    _HOOK_REAL(type, name, (type1 arg1, type2 arg2, type3 arg3, type4 arg4, \
+                            type5 arg5), \
+                           (arg1, arg2, arg3, arg4, arg5)) \
+    type name(type1 arg1, type2 arg2, type3 arg3, type4 arg4, type5 arg5)
+#define HOOK_FUNC_DEF6(type, name, type1, arg1, type2, arg2, type3, arg3, type4, arg4, type5, arg5, type6, arg6) \
+    type name(type1, type2, type3, type4, type5, type6) visibility_protected; \
+    _HOOK_REAL(type, name, (type1 arg1, type2 arg2, type3 arg3, type4 arg4, \
+                            type5 arg5, type6 arg6), \
+                           (arg1, arg2, arg3, arg4, arg5, arg6)) \
+    type name(type1 arg1, type2 arg2, type3 arg3, type4 arg4, type5 arg5, \
+              type6 arg6)
 
+#define HOOK_FUNC_VOID_DEF1(name, type1, arg1) \
+    void name(type1) visibility_protected; \
+    _HOOK_REAL_VOID(name, (type1 arg1), (arg1)) \
+    void name(type1 arg1)
+#define HOOK_FUNC_VOID_DEF2(name, type1, arg1, type2, arg2) \
+    void name(type1, type2) visibility_protected; \
+    _HOOK_REAL_VOID(name, (type1 arg1, type2 arg2), (arg1, arg2)) \
+    void name(type1 arg1, type2 arg2)
+#define HOOK_FUNC_VOID_DEF3(name, type1, arg1, type2, arg2, type3, arg3) \
+    void name(type1, type2, type3) visibility_protected; \
+    _HOOK_REAL_VOID(name, (type1 arg1, type2 arg2, type3 arg3), \
+                          (arg1, arg2, arg3)) \
+    void name(type1 arg1, type2 arg2, type3 arg3)
+
+/* Varargs can't be passed to a stub, real_<name> must be loaded with
+ * DLSYM_FUNCTION() before use. */
 #define HOOK_FUNC_VAR_DEF2(type, name, type1, arg1, type2, arg2) \
-    static type (*real_ ## name)(type1, type2, ...); \
     type name(type1, type2, ...) visibility_protected; \
+    static type (*real_ ## name)(type1, type2, ...); \
+    _HOOK_REGISTER(name, NULL) \
     type name(type1 arg1, type2 arg2, ...)
 
+/* The following hooks call other (hooked) functions and don't use
+ * real_<name>. It's only resolved to remove the hook, see hooks_dormant(). */
+#define _HOOK_REGISTER_SIMPLE(name) \
+    static void (*real_ ## name)(void); \
+    _HOOK_REGISTER(name, NULL)
+
+#define HOOK_FUNC_SIMPLE1(type, name, type1, arg1) \
+    type name(type1) visibility_protected; \
+    _HOOK_REGISTER_SIMPLE(name) \
+    type name(type1 arg1)
+#define HOOK_FUNC_SIMPLE2(type, name, type1, arg1, type2, arg2) \
+    type name(type1, type2) visibility_protected; \
+    _HOOK_REGISTER_SIMPLE(name) \
+    type name(type1 arg1, type2 arg2)
 #define HOOK_FUNC_SIMPLE3(type, name, type1, arg1, type2, arg2, type3, arg3) \
     type name(type1, type2, type3) visibility_protected; \
+    _HOOK_REGISTER_SIMPLE(name) \
     type name(type1 arg1, type2 arg2, type3 arg3)
 
 #define HOOK_FUNC_VAR_SIMPLE1(type, name, type1, arg1) \
     type name(type1, ...) visibility_protected; \
+    _HOOK_REGISTER_SIMPLE(name) \
     type name(type1 arg1, ...)
 #define HOOK_FUNC_VAR_SIMPLE2(type, name, type1, arg1, type2, arg2) \
     type name(type1, type2, ...) visibility_protected; \
+    _HOOK_REGISTER_SIMPLE(name) \
     type name(type1 arg1, type2 arg2, ...)
 #define HOOK_FUNC_VAR_SIMPLE3(type, name, type1, arg1, type2, arg2, type3, arg3) \
     type name(type1, type2, type3, ...) visibility_protected; \
+    _HOOK_REGISTER_SIMPLE(name) \
     type name(type1 arg1, type2 arg2, type3 arg3, ...)
 
 #define HOOK_VOID1(type, name, fd, type1, arg1) \
-    HOOK_FUNC_DEF1(type, name, type1, arg1) { \
-        _HOOK_PRE_FD_(type, name, fd) \
-        real_ ## name(arg1); \
-        _HOOK_POST_FD_(fd) \
+    static void name ## _slow(type1) noinline; \
+    HOOK_FUNC_VOID_DEF1(name, type1, arg1) { \
+        if (likely(tracked_fds_untracked(fd))) { \
+            real_ ## name(arg1); \
+        } else { \
+            name ## _slow(arg1); \
+        } \
+    } \
+    static void name ## _slow(type1 arg1) { \
+        if (_HOOK_HANDLE(fd)) { \
+            handle_fd_pre(fd); \
+            real_ ## name(arg1); \
+            handle_fd_post(fd); \
+        } else { \
+            real_ ## name(arg1); \
+        } \
     }
 #define HOOK_VOID2(type, name, fd, type1, arg1, type2, arg2) \
-    HOOK_FUNC_DEF2(type, name, type1, arg1, type2, arg2) { \
-        _HOOK_PRE_FD_(type, name, fd) \
-        real_ ## name(arg1, arg2); \
-        _HOOK_POST_FD_(fd) \
+    static void name ## _slow(type1, type2) noinline; \
+    HOOK_FUNC_VOID_DEF2(name, type1, arg1, type2, arg2) { \
+        if (likely(tracked_fds_untracked(fd))) { \
+            real_ ## name(arg1, arg2); \
+        } else { \
+            name ## _slow(arg1, arg2); \
+        } \
+    } \
+    static void name ## _slow(type1 arg1, type2 arg2) { \
+        if (_HOOK_HANDLE(fd)) { \
+            handle_fd_pre(fd); \
+            real_ ## name(arg1, arg2); \
+            handle_fd_post(fd); \
+        } else { \
+            real_ ## name(arg1, arg2); \
+        } \
     }
 #define HOOK_VOID3(type, name, fd, type1, arg1, type2, arg2, type3, arg3) \
-    HOOK_FUNC_DEF3(type, name, type1, arg1, type2, arg2, type3, arg3) { \
-        _HOOK_PRE_FD_(type, name, fd) \
-        real_ ## name(arg1, arg2, arg3); \
-        _HOOK_POST_FD_(fd) \
+    static void name ## _slow(type1, type2, type3) noinline; \
+    HOOK_FUNC_VOID_DEF3(name, type1, arg1, type2, arg2, type3, arg3) { \
+        if (likely(tracked_fds_untracked(fd))) { \
+            real_ ## name(arg1, arg2, arg3); \
+        } else { \
+            name ## _slow(arg1, arg2, arg3); \
+        } \
+    } \
+    static void name ## _slow(type1 arg1, type2 arg2, type3 arg3) { \
+        if (_HOOK_HANDLE(fd)) { \
+            handle_fd_pre(fd); \
+            real_ ## name(arg1, arg2, arg3); \
+            handle_fd_post(fd); \
+        } else { \
+            real_ ## name(arg1, arg2, arg3); \
+        } \
+    }
+
+/* Like HOOK_VOID1() and HOOK_VOID2(), but pass the complete call and
+ * real_<name> to func() if the descriptor is handled. */
+#define HOOK_VOID_FUSED1(type, name, fd, func, type1, arg1) \
+    static void name ## _slow(type1) noinline; \
+    HOOK_FUNC_VOID_DEF1(name, type1, arg1) { \
+        if (likely(tracked_fds_untracked(fd))) { \
+            real_ ## name(arg1); \
+        } else { \
+            name ## _slow(arg1); \
+        } \
+    } \
+    static void name ## _slow(type1 arg1) { \
+        if (_HOOK_HANDLE(fd)) { \
+            func(real_ ## name, arg1); \
+        } else { \
+            real_ ## name(arg1); \
+        } \
+    }
+#define HOOK_VOID_FUSED2(type, name, fd, func, type1, arg1, type2, arg2) \
+    static void name ## _slow(type1, type2) noinline; \
+    HOOK_FUNC_VOID_DEF2(name, type1, arg1, type2, arg2) { \
+        if (likely(tracked_fds_untracked(fd))) { \
+            real_ ## name(arg1, arg2); \
+        } else { \
+            name ## _slow(arg1, arg2); \
+        } \
+    } \
+    static void name ## _slow(type1 arg1, type2 arg2) { \
+        if (_HOOK_HANDLE(fd)) { \
+            func(real_ ## name, arg1, arg2); \
+        } else { \
+            real_ ## name(arg1, arg2); \
+        } \
     }
 
 #define HOOK_VAR_VOID1(type, name, fd, func, type1, arg1) \
@@ -172,35 +323,301 @@
     }
 
 #define HOOK_FD3(type, name, fd, type1, arg1, type2, arg2, type3, arg3) \
+    static type name ## _slow(type1, type2, type3) noinline; \
     HOOK_FUNC_DEF3(type, name, type1, arg1, type2, arg2, type3, arg3) { \
-        _HOOK_PRE_FD(type, name, fd) \
+        if (likely(tracked_fds_untracked(fd))) { \
+            return real_ ## name(arg1, arg2, arg3); \
+        } \
+        return name ## _slow(arg1, arg2, arg3); \
+    } \
+    static type name ## _slow(type1 arg1, type2 arg2, type3 arg3) { \
+        type result; \
+        if (!_HOOK_HANDLE(fd)) { \
+            return real_ ## name(arg1, arg2, arg3); \
+        } \
+        handle_fd_pre(fd); \
         result = real_ ## name(arg1, arg2, arg3); \
-        _HOOK_POST_FD(fd) \
+        handle_fd_post(fd); \
+        return result; \
+    }
+
+/* Like HOOK_FD3() but pass the complete call to func() if the descriptor is
+ * handled. Used for functions which can write the pre/post strings together
+ * with the data in a single system call. */
+#define HOOK_FD_FUSED3(type, name, fd, func, type1, arg1, type2, arg2, type3, arg3) \
+    static type name ## _slow(type1, type2, type3) noinline; \
+    HOOK_FUNC_DEF3(type, name, type1, arg1, type2, arg2, type3, arg3) { \
+        if (likely(tracked_fds_untracked(fd))) { \
+            return real_ ## name(arg1, arg2, arg3); \
+        } \
+        return name ## _slow(arg1, arg2, arg3); \
+    } \
+    static type name ## _slow(type1 arg1, type2 arg2, type3 arg3) { \
+        if (!_HOOK_HANDLE(fd)) { \
+            return real_ ## name(arg1, arg2, arg3); \
+        } \
+        return func(arg1, arg2, arg3); \
+    }
+
+#define HOOK_FD_FUSED4(type, name, fd, func, type1, arg1, type2, arg2, type3, arg3, type4, arg4) \
+    static type name ## _slow(type1, type2, type3, type4) noinline; \
+    HOOK_FUNC_DEF4(type, name, type1, arg1, type2, arg2, type3, arg3, \
+                   type4, arg4) { \
+        if (likely(tracked_fds_untracked(fd))) { \
+            return real_ ## name(arg1, arg2, arg3, arg4); \
+        } \
+        return name ## _slow(arg1, arg2, arg3, arg4); \
+    } \
+    static type name ## _slow(type1 arg1, type2 arg2, type3 arg3, \
+                              type4 arg4) { \
+        if (!_HOOK_HANDLE(fd)) { \
+            return real_ ## name(arg1, arg2, arg3, arg4); \
+        } \
+        return func(arg1, arg2, arg3, arg4); \
+    }
+#define HOOK_FD_FUSED5(type, name, fd, func, type1, arg1, type2, arg2, type3, arg3, type4, arg4, type5, arg5) \
+    static type name ## _slow(type1, type2, type3, type4, type5) noinline; \
+    HOOK_FUNC_DEF5(type, name, type1, arg1, type2, arg2, type3, arg3, \
+                   type4, arg4, type5, arg5) { \
+        if (likely(tracked_fds_untracked(fd))) { \
+            return real_ ## name(arg1, arg2, arg3, arg4, arg5); \
+        } \
+        return name ## _slow(arg1, arg2, arg3, arg4, arg5); \
+    } \
+    static type name ## _slow(type1 arg1, type2 arg2, type3 arg3, \
+                              type4 arg4, type5 arg5) { \
+        if (!_HOOK_HANDLE(fd)) { \
+            return real_ ## name(arg1, arg2, arg3, arg4, arg5); \
+        } \
+        return func(arg1, arg2, arg3, arg4, arg5); \
+    }
+
+#define HOOK_FD_FUSED6(type, name, fd, func, type1, arg1, type2, arg2, type3, arg3, type4, arg4, type5, arg5, type6, arg6) \
+    static type name ## _slow(type1, type2, type3, type4, type5, type6) \
+        noinline; \
+    HOOK_FUNC_DEF6(type, name, type1, arg1, type2, arg2, type3, arg3, \
+                   type4, arg4, type5, arg5, type6, arg6) { \
+        if (likely(tracked_fds_untracked(fd))) { \
+            return real_ ## name(arg1, arg2, arg3, arg4, arg5, arg6); \
+        } \
+        return name ## _slow(arg1, arg2, arg3, arg4, arg5, arg6); \
+    } \
+    static type name ## _slow(type1 arg1, type2 arg2, type3 arg3, \
+                              type4 arg4, type5 arg5, type6 arg6) { \
+        if (!_HOOK_HANDLE(fd)) { \
+            return real_ ## name(arg1, arg2, arg3, arg4, arg5, arg6); \
+        } \
+        return func(arg1, arg2, arg3, arg4, arg5, arg6); \
     }
 
 #define HOOK_FILE1(type, name, file, type1, arg1) \
+    static type name ## _slow(type1) noinline; \
     HOOK_FUNC_DEF1(type, name, type1, arg1) { \
-        _HOOK_PRE_FILE(type, name, file) \
+        if (likely(tracked_fds_untracked(_HOOK_FILENO(file)))) { \
+            return real_ ## name(arg1); \
+        } \
+        return name ## _slow(arg1); \
+    } \
+    static type name ## _slow(type1 arg1) { \
+        type result; \
+        if (!_HOOK_HANDLE(_HOOK_FILENO(file))) { \
+            return real_ ## name(arg1); \
+        } \
+        handle_file_pre(file); \
         result = real_ ## name(arg1); \
-        _HOOK_POST_FILE(file) \
+        if (handle_file_post(file) != 0) { \
+            result = _HOOK_FILE_ERROR(type); \
+        } \
+        return result; \
     }
 #define HOOK_FILE2(type, name, file, type1, arg1, type2, arg2) \
+    static type name ## _slow(type1, type2) noinline; \
     HOOK_FUNC_DEF2(type, name, type1, arg1, type2, arg2) { \
-        _HOOK_PRE_FILE(type, name, file) \
+        if (likely(tracked_fds_untracked(_HOOK_FILENO(file)))) { \
+            return real_ ## name(arg1, arg2); \
+        } \
+        return name ## _slow(arg1, arg2); \
+    } \
+    static type name ## _slow(type1 arg1, type2 arg2) { \
+        type result; \
+        if (!_HOOK_HANDLE(_HOOK_FILENO(file))) { \
+            return real_ ## name(arg1, arg2); \
+        } \
+        handle_file_pre(file); \
         result = real_ ## name(arg1, arg2); \
-        _HOOK_POST_FILE(file) \
+        if (handle_file_post(file) != 0) { \
+            result = _HOOK_FILE_ERROR(type); \
+        } \
+        return result; \
     }
 #define HOOK_FILE3(type, name, file, type1, arg1, type2, arg2, type3, arg3) \
+    static type name ## _slow(type1, type2, type3) noinline; \
     HOOK_FUNC_DEF3(type, name, type1, arg1, type2, arg2, type3, arg3) { \
-        _HOOK_PRE_FILE(type, name, file) \
+        if (likely(tracked_fds_untracked(_HOOK_FILENO(file)))) { \
+            return real_ ## name(arg1, arg2, arg3); \
+        } \
+        return name ## _slow(arg1, arg2, arg3); \
+    } \
+    static type name ## _slow(type1 arg1, type2 arg2, type3 arg3) { \
+        type result; \
+        if (!_HOOK_HANDLE(_HOOK_FILENO(file))) { \
+            return real_ ## name(arg1, arg2, arg3); \
+        } \
+        handle_file_pre(file); \
         result = real_ ## name(arg1, arg2, arg3); \
-        _HOOK_POST_FILE(file) \
+        if (handle_file_post(file) != 0) { \
+            result = _HOOK_FILE_ERROR(type); \
+        } \
+        return result; \
     }
 #define HOOK_FILE4(type, name, file, type1, arg1, type2, arg2, type3, arg3, type4, arg4) \
+    static type name ## _slow(type1, type2, type3, type4) noinline; \
     HOOK_FUNC_DEF4(type, name, type1, arg1, type2, arg2, type3, arg3, type4, arg4) { \
-        _HOOK_PRE_FILE(type, name, file) \
+        if (likely(tracked_fds_untracked(_HOOK_FILENO(file)))) { \
+            return real_ ## name(arg1, arg2, arg3, arg4); \
+        } \
+        return name ## _slow(arg1, arg2, arg3, arg4); \
+    } \
+    static type name ## _slow(type1 arg1, type2 arg2, type3 arg3, type4 arg4) { \
+        type result; \
+        if (!_HOOK_HANDLE(_HOOK_FILENO(file))) { \
+            return real_ ## name(arg1, arg2, arg3, arg4); \
+        } \
+        handle_file_pre(file); \
         result = real_ ## name(arg1, arg2, arg3, arg4); \
-        _HOOK_POST_FILE(file) \
+        if (handle_file_post(file) != 0) { \
+            result = _HOOK_FILE_ERROR(type); \
+        } \
+        return result; \
+    }
+
+/* Like HOOK_FILE1()/HOOK_FILE2() for functions writing the single character
+ * c, which may be collected in the line buffer (see line_buffer_use()). */
+#define HOOK_FILE_CHAR1(type, name, file, c, type1, arg1) \
+    static type name ## _slow(type1) noinline; \
+    HOOK_FUNC_DEF1(type, name, type1, arg1) { \
+        if (likely(tracked_fds_untracked(_HOOK_FILENO(file)))) { \
+            return real_ ## name(arg1); \
+        } \
+        return name ## _slow(arg1); \
+    } \
+    static type name ## _slow(type1 arg1) { \
+        type result; \
+        if (!_HOOK_HANDLE(_HOOK_FILENO(file))) { \
+            return real_ ## name(arg1); \
+        } \
+        if (line_buffer_use(file, c)) { \
+            return line_buffer_putc(file, c); \
+        } \
+        handle_file_pre(file); \
+        result = real_ ## name(arg1); \
+        if (handle_file_post(file) != 0) { \
+            result = _HOOK_FILE_ERROR(type); \
+        } \
+        return result; \
+    }
+#define HOOK_FILE_CHAR2(type, name, file, c, type1, arg1, type2, arg2) \
+    static type name ## _slow(type1, type2) noinline; \
+    HOOK_FUNC_DEF2(type, name, type1, arg1, type2, arg2) { \
+        if (likely(tracked_fds_untracked(_HOOK_FILENO(file)))) { \
+            return real_ ## name(arg1, arg2); \
+        } \
+        return name ## _slow(arg1, arg2); \
+    } \
+    static type name ## _slow(type1 arg1, type2 arg2) { \
+        type result; \
+        if (!_HOOK_HANDLE(_HOOK_FILENO(file))) { \
+            return real_ ## name(arg1, arg2); \
+        } \
+        if (line_buffer_use(file, c)) { \
+            return line_buffer_putc(file, c); \
+        } \
+        handle_file_pre(file); \
+        result = real_ ## name(arg1, arg2); \
+        if (handle_file_post(file) != 0) { \
+            result = _HOOK_FILE_ERROR(type); \
+        } \
+        return result; \
+    }
+
+/* Like HOOK_FILE2() to HOOK_FILE4() for the wide character functions, pass
+ * the complete call and real_<name> to func() if the stream is handled. The
+ * pre/post strings must be written with the wide functions, see
+ * handle_wfile_pre(). */
+#define HOOK_WFILE2(type, name, file, func, type1, arg1, type2, arg2) \
+    static type name ## _slow(type1, type2) noinline; \
+    HOOK_FUNC_DEF2(type, name, type1, arg1, type2, arg2) { \
+        if (likely(tracked_fds_untracked(_HOOK_FILENO(file)))) { \
+            return real_ ## name(arg1, arg2); \
+        } \
+        return name ## _slow(arg1, arg2); \
+    } \
+    static type name ## _slow(type1 arg1, type2 arg2) { \
+        if (!_HOOK_HANDLE(_HOOK_FILENO(file))) { \
+            return real_ ## name(arg1, arg2); \
+        } \
+        return func(real_ ## name, arg1, arg2); \
+    }
+#define HOOK_WFILE3(type, name, file, func, type1, arg1, type2, arg2, type3, arg3) \
+    static type name ## _slow(type1, type2, type3) noinline; \
+    HOOK_FUNC_DEF3(type, name, type1, arg1, type2, arg2, type3, arg3) { \
+        if (likely(tracked_fds_untracked(_HOOK_FILENO(file)))) { \
+            return real_ ## name(arg1, arg2, arg3); \
+        } \
+        return name ## _slow(arg1, arg2, arg3); \
+    } \
+    static type name ## _slow(type1 arg1, type2 arg2, type3 arg3) { \
+        if (!_HOOK_HANDLE(_HOOK_FILENO(file))) { \
+            return real_ ## name(arg1, arg2, arg3); \
+        } \
+        return func(real_ ## name, arg1, arg2, arg3); \
+    }
+#define HOOK_WFILE4(type, name, file, func, type1, arg1, type2, arg2, type3, arg3, type4, arg4) \
+    static type name ## _slow(type1, type2, type3, type4) noinline; \
+    HOOK_FUNC_DEF4(type, name, type1, arg1, type2, arg2, type3, arg3, \
+                   type4, arg4) { \
+        if (likely(tracked_fds_untracked(_HOOK_FILENO(file)))) { \
+            return real_ ## name(arg1, arg2, arg3, arg4); \
+        } \
+        return name ## _slow(arg1, arg2, arg3, arg4); \
+    } \
+    static type name ## _slow(type1 arg1, type2 arg2, type3 arg3, \
+                              type4 arg4) { \
+        if (!_HOOK_HANDLE(_HOOK_FILENO(file))) { \
+            return real_ ## name(arg1, arg2, arg3, arg4); \
+        } \
+        return func(real_ ## name, arg1, arg2, arg3, arg4); \
+    }
+
+/* Write pending output (see output_flush()) before calling the function. Used
+ * for functions reading input. */
+#define HOOK_FLUSH0(type, name) \
+    HOOK_FUNC_DEF0(type, name) { \
+        if (unlikely(output_flush_enabled)) { \
+            output_flush(); \
+        } \
+        return real_ ## name(); \
+    }
+#define HOOK_FLUSH1(type, name, type1, arg1) \
+    HOOK_FUNC_DEF1(type, name, type1, arg1) { \
+        if (unlikely(output_flush_enabled)) { \
+            output_flush(); \
+        } \
+        return real_ ## name(arg1); \
+    }
+#define HOOK_FLUSH3(type, name, type1, arg1, type2, arg2, type3, arg3) \
+    HOOK_FUNC_DEF3(type, name, type1, arg1, type2, arg2, type3, arg3) { \
+        if (unlikely(output_flush_enabled)) { \
+            output_flush(); \
+        } \
+        return real_ ## name(arg1, arg2, arg3); \
+    }
+#define HOOK_FLUSH4(type, name, type1, arg1, type2, arg2, type3, arg3, type4, arg4) \
+    HOOK_FUNC_DEF4(type, name, type1, arg1, type2, arg2, type3, arg3, type4, arg4) { \
+        if (unlikely(output_flush_enabled)) { \
+            output_flush(); \
+        } \
+        return real_ ## name(arg1, arg2, arg3, arg4); \
     }
 
 #define HOOK_VAR_FILE1(type, name, file, func, type1, arg1) \
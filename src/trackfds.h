@@ -20,16 +20,152 @@
 #ifndef TRACKFDS_H
 #define TRACKFDS_H 1
 
-/* Array of tracked file descriptors. Used for fast lookups for the normally
- * used file descriptors (0 <= fd < TRACKFDS_STATIC_COUNT). */
-static int tracked_fds[TRACKFDS_STATIC_COUNT];
+/* Bitmap of tracked file descriptors (0 <= fd < TRACKFDS_STATIC_COUNT) is
+ * stored in state.tracked_fds. Used for fast lookups for the normally used
+ * file descriptors. */
+#define TRACKFDS_WORD(fd) ((size_t)(fd) / TRACKFDS_WORD_BITS)
+#define TRACKFDS_BIT(fd)  (1UL << ((size_t)(fd) % TRACKFDS_WORD_BITS))
+
+/* Cached results of isatty() for the tracked descriptors in
+ * state.tracked_fds, so it's not necessary to call it for each write. The
+ * cache is cleared when the descriptor is dupped over or closed (see
+ * tracked_fds_add()/tracked_fds_remove()) because the number then references
+ * a different file. */
+static unsigned long tracked_fds_tty_known[TRACKFDS_STATIC_WORDS];
+static unsigned long tracked_fds_tty[TRACKFDS_STATIC_WORDS];
+/* Tracked descriptors with the close-on-exec flag (FD_CLOEXEC). They are
+ * closed by exec*() and therefore not passed to the new program. */
+static unsigned long tracked_fds_cloexec[TRACKFDS_STATIC_WORDS];
 
-/* List of tracked file descriptors >= TRACKFDS_STATIC_COUNT. */
-static int *tracked_fds_list;
-/* Current number of items in the list. */
-static size_t tracked_fds_list_count;
-/* Allocated items, used to reduce realloc()s. */
-static size_t tracked_fds_list_space;
+/*
+ * Tracked file descriptors >= TRACKFDS_STATIC_COUNT are stored in a two-level
+ * bitmap: tracked_fds_leaves[] references leaves which each store
+ * TRACKFDS_LEAF_COUNT descriptors (including the cached isatty() results
+ * and the close-on-exec flags).
+ * This keeps lookup, adding and removing descriptors O(1) even with many
+ * (e.g. 50k+ sockets) open descriptors.
+ *
+ * Leaves are taken from a preallocated arena (in .bss, so only leaves which
+ * are actually used need memory), further ones are mmap()ed. Thus close() or
+ * dup2() never call malloc(). A leaf is freed when its last descriptor is
+ * removed and reused for other descriptors later, so a long-running process
+ * only needs as many leaves as it uses at the same time.
+ *
+ * Threads may change the tracked descriptors (dup2(), close(), ...) while
+ * others write. All bitmap words are accessed atomically (see compiler.h):
+ * writers update single bits with atomic or/and, readers use plain (relaxed)
+ * loads and never wait. Leaves are freed without lock:
+ *
+ * - Each slot of tracked_fds_leaves[] stores a handle: the index of the leaf
+ *   in tracked_fds_pool[] and its incarnation, which changes each time the
+ *   leaf is reused. 0 is no leaf.
+ * - leaf->state counts the tracked descriptors of the leaf plus the writers
+ *   currently modifying it (pins), see tracked_fds_pin_leaf(). A writer only
+ *   pins the leaf if its incarnation matches the handle. The writer which
+ *   drops the count to 0 marks the leaf dead and frees it (or another writer
+ *   which finds it dead).
+ * - Readers don't pin, they check that the slot still contains the same
+ *   handle after reading and try again otherwise.
+ *
+ * Stale isatty() results and close-on-exec flags of untracked descriptors
+ * are harmless, tracked_fds_add() clears them. Therefore freed leaves are not
+ * cleared.
+ */
+struct tracked_fds_leaf {
+    unsigned long tracked[TRACKFDS_LEAF_WORDS];
+    unsigned long tty_known[TRACKFDS_LEAF_WORDS];
+    unsigned long tty[TRACKFDS_LEAF_WORDS];
+    unsigned long cloexec[TRACKFDS_LEAF_WORDS];
+    unsigned long state;
+    /* Index in tracked_fds_pool[]. */
+    unsigned long index;
+};
+/* Layout of leaf->state and the handles. The incarnation uses the same
+ * number of bits in both (32-bit unsigned long). */
+#define TRACKFDS_STATE_COUNT_MASK        0x1ffffUL
+#define TRACKFDS_STATE_DEAD              (1UL << 17)
+#define TRACKFDS_STATE_INCARNATION_SHIFT 18
+#define TRACKFDS_HANDLE_INDEX_MASK       0x1fffUL /* >= TRACKFDS_LEAVES */
+#define TRACKFDS_HANDLE_INCARNATION_SHIFT 13
+#define TRACKFDS_INCARNATION_MASK        0x3fffUL
+
+static unsigned long tracked_fds_leaves[TRACKFDS_LEAVES];
+static struct tracked_fds_leaf tracked_fds_arena[TRACKFDS_ARENA_LEAVES];
+/* All leaves: first tracked_fds_arena[], then mmap()ed ones. Entries are set
+ * once and never change. */
+static struct tracked_fds_leaf *tracked_fds_pool[TRACKFDS_LEAVES];
+/* Number of used entries in tracked_fds_pool[]. */
+static unsigned long tracked_fds_pool_used;
+/* Bitmap of freed entries in tracked_fds_pool[]. */
+static unsigned long tracked_fds_pool_free[TRACKFDS_LEAVES
+                                           / TRACKFDS_WORD_BITS];
+/* Number of tracked descriptors >= TRACKFDS_STATIC_COUNT. */
+static size_t tracked_fds_leaves_count;
+/* Changed when the set of tracked descriptors changes. Used to cache the
+ * encoded set for child processes. Incremented (release) only after the
+ * bitmaps were updated: a reader which loads (acquire) the new value also
+ * sees the new bits. */
+static unsigned int tracked_fds_generation;
+
+#define TRACKFDS_LEAF(fd)       ((size_t)(fd) / TRACKFDS_LEAF_COUNT)
+#define TRACKFDS_LEAF_INDEX(fd) ((size_t)(fd) % TRACKFDS_LEAF_COUNT)
+
+static void tracked_fds_add(int fd);
+inline static int tracked_fds_find(int fd) always_inline;
+static int tracked_fds_find_slow(int fd) noinline;
+static int tracked_fds_get_cloexec(int fd);
+static struct tracked_fds_leaf *tracked_fds_pin_leaf(size_t leaf,
+                                                     int allocate);
+static void tracked_fds_unpin_leaf(size_t leaf, struct tracked_fds_leaf *entry,
+                                   long added);
+
+/* Changes to the tracked descriptors in a child process, e.g. the file
+ * actions of posix_spawn(). Applied when creating the environment for the
+ * child, see update_environment_buffer_changes(). */
+struct tracked_fds_change {
+    int fd;
+    int tracked;
+    /* Closed by exec*(), not passed to the new program. */
+    int cloexec;
+};
+struct tracked_fds_changes {
+    struct tracked_fds_change change[TRACKFDS_CHANGES_MAX];
+    size_t count;
+    /* All descriptors >= closefrom without change are closed. */
+    int closefrom;
+};
+
+
+#ifndef HAVE___BUILTIN_CTZL
+/* Count trailing zero bits, x must not be 0. */
+static int ctzl(unsigned long x) {
+    int count = 0;
+
+    assert(x != 0);
+
+    while (!(x & 1)) {
+        x >>= 1;
+        count++;
+    }
+    return count;
+}
+#else
+# define ctzl(x) __builtin_ctzl(x)
+#endif
+#ifndef HAVE___BUILTIN_POPCOUNTL
+/* Count set bits. */
+static int popcountl(unsigned long x) {
+    int count = 0;
+
+    while (x) {
+        x &= x - 1;
+        count++;
+    }
+    return count;
+}
+#else
+# define popcountl(x) __builtin_popcountl(x)
+#endif
 
 
 #ifdef DEBUG
@@ -37,77 +173,364 @@ static void tracked_fds_debug(void) {
     size_t i;
 
     for (i = 0; i < TRACKFDS_STATIC_COUNT; i++) {
-        if (tracked_fds[i]) {
-            debug("    tracked_fds[%d]: %d\n", i, tracked_fds[i]);
+        if (state.tracked_fds[TRACKFDS_WORD(i)] & TRACKFDS_BIT(i)) {
+            debug("    tracked_fds[%d]: 1%s\n", i,
+                  tracked_fds_cloexec[TRACKFDS_WORD(i)] & TRACKFDS_BIT(i)
+                      ? " (cloexec)" : "");
         }
     }
-    debug("    tracked_fds_list: %d/%d\t[%d]\n", tracked_fds_list_count,
-                                                 tracked_fds_list_space,
-                                                 getpid());
-    for (i = 0; i < tracked_fds_list_count; i++) {
-        debug("    tracked_fds_list[%d]: %d\n", i, tracked_fds_list[i]);
+    debug("    tracked_fds_leaves: %lu leaves (%zu fds)\t[%d]\n",
+          tracked_fds_pool_used, tracked_fds_leaves_count, getpid());
+    for (i = 0; i < TRACKFDS_LEAVES; i++) {
+        unsigned long handle = tracked_fds_leaves[i];
+        if (!handle) {
+            continue;
+        }
+        struct tracked_fds_leaf *leaf =
+            tracked_fds_pool[(handle & TRACKFDS_HANDLE_INDEX_MASK) - 1];
+
+        size_t j;
+        for (j = 0; j < TRACKFDS_LEAF_COUNT; j++) {
+            if (leaf->tracked[TRACKFDS_WORD(j)] & TRACKFDS_BIT(j)) {
+                debug("    tracked_fds_leaves[%zu]: %zu%s\n",
+                      i, i * TRACKFDS_LEAF_COUNT + j,
+                      leaf->cloexec[TRACKFDS_WORD(j)] & TRACKFDS_BIT(j)
+                          ? " (cloexec)" : "");
+            }
+        }
     }
 }
 #endif
 
-/* Check if filename occurs in the comma-separated list ignore. */
-static int is_program_ignored(char const *filename, char const *ignore) {
+/* Our settings from the environment, see environment_load(). */
+struct environment {
+    char const *fds;
+    char const *private_fds;
+    char const *pre_string;
+    char const *post_string;
+    char const *force_write;
+    char const *ignored_binaries;
+    char const *line_buffer;
+    char const *defer_post;
+    char const *merge_buffered;
+};
+
+static void environment_set(char const **value, char const *entry,
+                            char const *name) {
+    size_t length = strlen(name);
+    /* Like getenv(), use the first entry. */
+    if (!*value && !strncmp(entry, name, length) && entry[length] == '=') {
+        *value = entry + length + 1;
+    }
+}
+/* Load all settings with a single pass over the environment instead of a
+ * getenv() (which walks the environment) for each. */
+static void environment_load(struct environment *environment) {
+    memset(environment, 0, sizeof(*environment));
+
+    char **x;
+    for (x = environ; x && *x; x++) {
+        char const *entry = *x;
+        if (entry[0] != ENV_NAME_PREFIX[0]
+                || strncmp(entry, ENV_NAME_PREFIX, strlen(ENV_NAME_PREFIX))) {
+            continue;
+        }
+
+        environment_set(&environment->fds, entry, ENV_NAME_FDS);
+        environment_set(&environment->private_fds, entry,
+                        ENV_NAME_PRIVATE_FDS);
+        environment_set(&environment->pre_string, entry, ENV_NAME_PRE_STRING);
+        environment_set(&environment->post_string, entry,
+                        ENV_NAME_POST_STRING);
+        environment_set(&environment->force_write, entry,
+                        ENV_NAME_FORCE_WRITE);
+        environment_set(&environment->ignored_binaries, entry,
+                        ENV_NAME_IGNORED_BINARIES);
+        environment_set(&environment->line_buffer, entry,
+                        ENV_NAME_LINE_BUFFER);
+        environment_set(&environment->defer_post, entry,
+                        ENV_NAME_DEFER_POST);
+        environment_set(&environment->merge_buffered, entry,
+                        ENV_NAME_MERGE_BUFFERED);
+    }
+}
+
+/* Patterns of ENV_NAME_IGNORED_BINARIES, compiled once by
+ * ignored_binaries_compile(). Patterns without '/' match the basename of the
+ * binary, others the full path. Wildcards are matched with fnmatch(). */
+struct ignored_binary {
+    char const *pattern;
+    int path;
+    int glob;
+};
+static struct {
+    struct ignored_binary binary[IGNORED_BINARIES_MAX];
+    size_t count;
+    /* Number of patterns matching the full path. */
+    size_t paths;
+    /* The check is deferred until it's necessary, see
+     * ignored_binaries_check(). */
+    int pending;
+    char buffer[IGNORED_BINARIES_SIZE];
+} ignored_binaries;
+
+/* Compile the comma-separated list of patterns env. */
+static void ignored_binaries_compile(char const *env) {
     size_t length;
-    size_t filename_length = strlen(filename);
+    size_t used = 0;
 
 #ifdef DEBUG
-    debug("  is_program_ignored(\"%s\", \"%s\")\n", filename, ignore);
+    debug("  ignored_binaries_compile(\"%s\")\n", env);
 #endif
 
-    for (; *ignore; ignore += length) {
-        while (*ignore == ',') {
-            ignore++;
+    for (; *env; env += length) {
+        while (*env == ',') {
+            env++;
         }
 
-        length = strcspn(ignore, ",");
+        length = strcspn(env, ",");
         if (length == 0) {
             break;
         }
 
-        if (length != filename_length) {
+        if (ignored_binaries.count == IGNORED_BINARIES_MAX
+                || used + length + 1 > sizeof(ignored_binaries.buffer)) {
+#ifdef WARNING
+            warning("ignored_binaries_compile(): too many patterns: \"%s\""
+                    " [%d]\n", env, getpid());
+#endif
+            break;
+        }
+
+        char *pattern = ignored_binaries.buffer + used;
+        memcpy(pattern, env, length);
+        pattern[length] = 0;
+        used += length + 1;
+
+        struct ignored_binary *x =
+            &ignored_binaries.binary[ignored_binaries.count++];
+        x->pattern = pattern;
+        x->path = strchr(pattern, '/') != NULL;
+        x->glob = strpbrk(pattern, "*?[\\") != NULL;
+        ignored_binaries.paths += (size_t)x->path;
+    }
+
+    ignored_binaries.pending = ignored_binaries.count != 0;
+}
+
+/* Check name against all patterns matching the full path (path = 1) or the
+ * basename (path = 0). */
+static int ignored_binaries_match(char const *name, int path) {
+    size_t i;
+
+#ifdef DEBUG
+    debug("  ignored_binaries_match(\"%s\", %d)\n", name, path);
+#endif
+
+    for (i = 0; i < ignored_binaries.count; i++) {
+        struct ignored_binary const *x = &ignored_binaries.binary[i];
+        if (x->path != path) {
+            continue;
+        }
+#if defined(HAVE_FNMATCH_H) && defined(HAVE_FNMATCH)
+        if (x->glob) {
+            if (!fnmatch(x->pattern, name, path ? FNM_PATHNAME : 0)) {
+                return 1;
+            }
             continue;
         }
-        if (!strncmp(filename, ignore, length)) {
+#endif
+        if (!strcmp(x->pattern, name)) {
             return 1;
         }
     }
-
     return 0;
 }
+static char const *path_basename(char const *path) {
+    char const *x = strrchr(path, '/');
+    return x ? x + 1 : path;
+}
 
-static int init_tracked_fds_list(size_t count) {
-    assert(count > 0);
-
-    /* Reduce reallocs. */
-    count += TRACKFDS_REALLOC_STEP;
+/* The path passed to execve(), available without /proc/. NULL if
+ * unknown. */
+static char const *program_execfn(void) {
+#if defined(HAVE_SYS_AUXV_H) && defined(HAVE_GETAUXVAL) && defined(AT_EXECFN)
+    return (char const *)getauxval(AT_EXECFN);
+#else
+    return NULL;
+#endif
+}
 
-    tracked_fds_list = malloc(count * sizeof(*tracked_fds_list));
-    if (!tracked_fds_list) {
-#ifdef WARNING
-        warning("malloc(tracked_fds_list, %d) failed [%d]\n",
-                count * sizeof(*tracked_fds_list), getpid());
+/* Check if the name this binary was executed with matches a pattern of
+ * ENV_NAME_IGNORED_BINARIES without '/'. No system call is necessary, can be
+ * used in the constructor. Returns -1 if the name is unknown. */
+static int is_program_name_ignored(void) {
+    char const *name = program_execfn();
+#if defined(HAVE_DECL_PROGRAM_INVOCATION_NAME) \
+        && HAVE_DECL_PROGRAM_INVOCATION_NAME
+    if (!name) {
+        name = program_invocation_name;
+    }
 #endif
+    if (!name) {
+        return -1;
+    }
+    return ignored_binaries_match(path_basename(name), 0);
+}
+
+/* Check if this binary matches a pattern of ENV_NAME_IGNORED_BINARIES. */
+static int is_program_ignored(void) {
+    char const *execfn = program_execfn();
+
+    if (execfn) {
+        if (ignored_binaries_match(path_basename(execfn), 0)) {
+            return 1;
+        }
+        if (execfn[0] == '/' && ignored_binaries_match(execfn, 1)) {
+            return 1;
+        }
+        if (ignored_binaries.paths == 0) {
+            return 0;
+        }
+    }
+
+    /* The path of execfn might be relative or a symbolic link, full paths
+     * must also match the resolved path (as before). */
+    char path[PATH_MAX];
+    ssize_t written = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (written <= 0) {
         return 0;
     }
+    path[written] = 0; /* readlink() does not null-terminate! */
 
-    tracked_fds_list_space = count;
-    return 1;
+    if (!execfn && ignored_binaries_match(path_basename(path), 0)) {
+        return 1;
+    }
+    return ignored_binaries_match(path, 1);
 }
 
 /*
- * Load tracked file descriptors from the environment. The environment is used
- * to pass the information to child processes.
+ * ENV_NAME_FDS has the following format: Each descriptor as string followed by
+ * a comma; there's a trailing comma. Example: "2,4,".
  *
- * ENV_NAME_FDS and ENV_NAME_PRIVATE_FDS have the following format: Each
- * descriptor as string followed by a comma; there's a trailing comma.
- * Example: "2,4,".
+ * ENV_NAME_PRIVATE_FDS is passed to and parsed by each child process and uses
+ * a more compact format: TRACKFDS_ENV_VERSION, the bitmap of descriptors <
+ * TRACKFDS_STATIC_COUNT with TRACKFDS_ENV_BITS bits per character of
+ * tracked_fds_base64[] (trailing empty characters are omitted). If necessary
+ * followed by '.' and the descriptors >= TRACKFDS_STATIC_COUNT in ascending
+ * order, each as difference to the previous one (minus one) encoded as
+ * varint: each character stores the lower bits and TRACKFDS_ENV_VARINT_MORE
+ * if more characters follow. Example: "@1E" (2), "@1c.AB" (2,3,4,256,258).
+ * The format of ENV_NAME_FDS is still accepted (e.g. from older versions).
  */
-static void init_from_environment(void) {
+#define TRACKFDS_ENV_VERSION     "@1"
+#define TRACKFDS_ENV_BITS        6
+#define TRACKFDS_ENV_VARINT_BITS 5
+#define TRACKFDS_ENV_VARINT_MORE (1 << TRACKFDS_ENV_VARINT_BITS)
+/* Maximum number of characters of a varint (for 32-bit integers). */
+#define TRACKFDS_ENV_VARINT_MAX  7
+
+static char const tracked_fds_base64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+static int tracked_fds_base64_value(char c) {
+    if (c >= 'A' && c <= 'Z') {
+        return c - 'A';
+    } else if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 26;
+    } else if (c >= '0' && c <= '9') {
+        return c - '0' + 52;
+    } else if (c == '-') {
+        return 62;
+    } else if (c == '_') {
+        return 63;
+    }
+    return -1;
+}
+
+static void init_from_environment_list(char const *env) {
+    char const *x, *last;
+
+    /* Parse file descriptor numbers from environment string and store them
+     * in the bitmaps. atoi() stops at the comma, no copy necessary. */
+    for (x = env, last = env; *x; x++) {
+        if (*x != ',') {
+            continue;
+        }
+        /* ',' at the beginning or double ',' - ignore. */
+        if (x != last) {
+            int fd = atoi(last);
+            if (fd >= 0) {
+                tracked_fds_add(fd);
+            }
+        }
+        last = x + 1;
+    }
+}
+static void init_from_environment_private(char const *env) {
+    if (strncmp(env, TRACKFDS_ENV_VERSION, strlen(TRACKFDS_ENV_VERSION))) {
+#ifdef WARNING
+        warning("init_from_environment(): unknown format: \"%s\" [%d]\n",
+                env, getpid());
+#endif
+        return;
+    }
+    env += strlen(TRACKFDS_ENV_VERSION);
+
+    size_t fd;
+    for (fd = 0; *env && *env != '.'; env++, fd += TRACKFDS_ENV_BITS) {
+        int value = tracked_fds_base64_value(*env);
+        if (value < 0) {
+            return;
+        }
+        /* Only visit set bits. */
+        while (value) {
+            size_t i = fd + (size_t)ctzl((unsigned long)value);
+            value &= value - 1;
+
+            if (i >= TRACKFDS_STATIC_COUNT) {
+                return;
+            }
+            atomic_fetch_or(&state.tracked_fds[TRACKFDS_WORD(i)],
+                            TRACKFDS_BIT(i));
+        }
+    }
+    atomic_add_release(&tracked_fds_generation, 1U);
+
+    if (*env != '.') {
+        return;
+    }
+    env++;
+
+    unsigned long previous = TRACKFDS_STATIC_COUNT - 1;
+    unsigned long value = 0;
+    unsigned int shift = 0;
+    for (; *env; env++) {
+        int x = tracked_fds_base64_value(*env);
+        /* Invalid or too big. */
+        if (x < 0 || (1UL << shift) >= TRACKFDS_MAX) {
+            return;
+        }
+        value |= (unsigned long)(x % TRACKFDS_ENV_VARINT_MORE) << shift;
+        if (x >= TRACKFDS_ENV_VARINT_MORE) {
+            shift += TRACKFDS_ENV_VARINT_BITS;
+            continue;
+        }
+
+        previous += value + 1;
+        if (previous >= TRACKFDS_MAX) {
+            return;
+        }
+        tracked_fds_add((int)previous);
+
+        value = 0;
+        shift = 0;
+    }
+}
+
+/* Load tracked file descriptors from the environment. The environment is used
+ * to pass the information to child processes. */
+static void init_from_environment(struct environment const *environment) {
 #ifdef DEBUG
     debug("init_from_environment()\t\t[%d]\n", getpid());
 #endif
@@ -118,105 +541,42 @@ static void init_from_environment(void) {
     assert(!initialized);
 
     initialized = 1;
-    tracked_fds_list_count = 0;
 
-    /* Don't color writes to stderr for this binary (and its children) if it's
-     * contained in the comma-separated list in ENV_NAME_IGNORED_BINARIES. */
-    env = getenv(ENV_NAME_IGNORED_BINARIES);
+    /* Don't color writes to stderr for this binary (and its children) if it
+     * matches a pattern in ENV_NAME_IGNORED_BINARIES. Checked only when
+     * necessary, most programs never write to a tracked descriptor. */
+    env = environment->ignored_binaries;
     if (env) {
-        char path[512];
-
-        /* TODO: Don't require /proc/. */
-        ssize_t written = readlink("/proc/self/exe", path, sizeof(path) - 1);
-        if (written > 0) {
-            path[written] = 0; /* readlink() does not null-terminate! */
-            if (is_program_ignored(path, env)) {
-                return;
-            }
-        }
+        ignored_binaries_compile(env);
     }
 
     /* If ENV_NAME_FORCE_WRITE is set and not empty, allow writes to a non-tty
      * device. Use with care! Mainly used for the test suite. */
-    env = getenv(ENV_NAME_FORCE_WRITE);
+    env = environment->force_write;
     if (env && env[0] != '\0') {
-        force_write_to_non_tty = 1;
+        state.force_write_to_non_tty = 1;
     }
 
     /* Prefer user defined list of file descriptors, fall back to file
      * descriptors passed through the environment from the parent process. */
-    env = getenv(ENV_NAME_FDS);
-    if (env) {
-        used_fds_set_by_user = 1;
-    } else {
-        env = getenv(ENV_NAME_PRIVATE_FDS);
-    }
-    if (!env) {
-        errno = saved_errno;
-        return;
-    }
+    if (environment->fds) {
 #ifdef DEBUG
-    debug("  getenv(\"%s\"): \"%s\"\n", ENV_NAME_FDS, env);
-    debug("  getenv(\"%s\"): \"%s\"\n", ENV_NAME_PRIVATE_FDS, env);
+        debug("  getenv(\"%s\"): \"%s\"\n", ENV_NAME_FDS, environment->fds);
 #endif
-
-    /* Environment must be treated read-only. */
-    char env_copy[strlen(env) + 1];
-    strcpy(env_copy, env);
-
-    char *x;
-
-    size_t count = 0;
-    for (x = env_copy; *x; x++) {
-        if (*x == ',') {
-            count++;
-        }
-    }
-
-    size_t i = 0;
-
-    /* Parse file descriptor numbers from environment string and store them as
-     * integers in tracked_fds and tracked_fds_list. */
-    char *last;
-    for (x = env_copy, last = env_copy; *x; x++) {
-        if (*x != ',') {
-            continue;
-        }
-        /* ',' at the beginning or double ',' - ignore. */
-        if (x == last) {
-            goto next;
-        }
-
-        /* Replace ',' to null-terminate number for atoi(). */
-        *x = 0;
-
-        int fd = atoi(last);
-        if (fd < 0) {
-            goto next;
-
-        } else if (fd < TRACKFDS_STATIC_COUNT) {
-            tracked_fds[fd] = 1;
-        } else {
-            if (!tracked_fds_list) {
-                /* Pessimistic count estimate, but allocating a few more
-                 * elements doesn't hurt. */
-                if (!init_tracked_fds_list(count)) {
-                    /* Couldn't allocate memory, skip this entry. */
-                    goto next;
-                }
-            }
-            tracked_fds_list[i++] = fd;
+        used_fds_set_by_user = 1;
+        init_from_environment_list(environment->fds);
+    } else if (environment->private_fds) {
+        env = environment->private_fds;
 #ifdef DEBUG
-            debug("  large fd: %d\n", fd);
+        debug("  getenv(\"%s\"): \"%s\"\n", ENV_NAME_PRIVATE_FDS, env);
 #endif
+        if (env[0] == TRACKFDS_ENV_VERSION[0]) {
+            init_from_environment_private(env);
+        } else {
+            init_from_environment_list(env);
         }
-
-next:
-        last = x + 1;
     }
 
-    tracked_fds_list_count = i;
-
 #ifdef DEBUG
     tracked_fds_debug();
 #endif
@@ -224,53 +584,294 @@ next:
     errno = saved_errno;
 }
 
-static char *update_environment_buffer_entry(char *x, int fd) {
-    assert(fd >= 0);
+/* Find the change for fd, NULL if there is none. */
+static struct tracked_fds_change *tracked_fds_changes_find(
+        struct tracked_fds_changes *changes, int fd) {
+    size_t i;
+    for (i = 0; i < changes->count; i++) {
+        if (changes->change[i].fd == fd) {
+            return &changes->change[i];
+        }
+    }
+    return NULL;
+}
+/* Is fd tracked in the child after changes? */
+inline static int tracked_fds_changes_tracked(
+        struct tracked_fds_changes *changes, int fd) {
+    struct tracked_fds_change *x = tracked_fds_changes_find(changes, fd);
+    if (x) {
+        return x->tracked;
+    }
+    if (fd >= changes->closefrom) {
+        return 0;
+    }
+    return tracked_fds_find(fd);
+}
+/* Change the state of fd in the child. Returns 0 if changes is full. */
+inline static int tracked_fds_changes_set(
+        struct tracked_fds_changes *changes, int fd, int tracked) {
+    struct tracked_fds_change *x = tracked_fds_changes_find(changes, fd);
+    if (!x) {
+        /* Nothing changes, don't waste space. A new descriptor (e.g. from
+         * dup2()) has no close-on-exec flag. */
+        if (tracked_fds_changes_tracked(changes, fd) == tracked
+                && (!tracked || !tracked_fds_get_cloexec(fd))) {
+            return 1;
+        }
+        if (changes->count == TRACKFDS_CHANGES_MAX) {
+            return 0;
+        }
+        x = &changes->change[changes->count++];
+        x->fd = fd;
+    }
+    x->tracked = tracked;
+    x->cloexec = 0;
+    return 1;
+}
+/* Change the close-on-exec flag of fd in the child. Returns 0 if changes is
+ * full. */
+inline static int tracked_fds_changes_set_cloexec(
+        struct tracked_fds_changes *changes, int fd, int cloexec) {
+    struct tracked_fds_change *x = tracked_fds_changes_find(changes, fd);
+    if (!x) {
+        /* Untracked descriptors are never passed on, nothing changes. */
+        if (!tracked_fds_changes_tracked(changes, fd)
+                || tracked_fds_get_cloexec(fd) == (cloexec != 0)) {
+            return 1;
+        }
+        if (changes->count == TRACKFDS_CHANGES_MAX) {
+            return 0;
+        }
+        x = &changes->change[changes->count++];
+        x->fd = fd;
+        x->tracked = 1;
+    }
+    x->cloexec = cloexec != 0;
+    return 1;
+}
+/* Close all descriptors >= fd in the child. */
+inline static void tracked_fds_changes_closefrom(
+        struct tracked_fds_changes *changes, int fd) {
+    if (fd < changes->closefrom) {
+        changes->closefrom = fd;
+    }
+    size_t i;
+    for (i = 0; i < changes->count; i++) {
+        if (changes->change[i].fd >= fd) {
+            changes->change[i].tracked = 0;
+        }
+    }
+}
+#ifdef HAVE_CLOSE_FD_RANGE
+static int tracked_fds_next(int fd);
+/* Close the descriptors first to last (inclusive) in the child. Returns 0 if
+ * changes is full. */
+static int tracked_fds_changes_close_range(
+        struct tracked_fds_changes *changes, int first, int last) {
+    /* Descriptors >= TRACKFDS_MAX are never tracked. */
+    if (last >= TRACKFDS_MAX - 1) {
+        tracked_fds_changes_closefrom(changes, first);
+        return 1;
+    }
 
-    int length = snprintf(x, 10 + 1, "%d", fd);
-    if (length >= 10 + 1 || length <= 0 /* shouldn't happen */) {
-        /* Integer too big to fit the buffer, skip it. */
-#ifdef WARNING
-        warning("update_environment_buffer_entry(): truncated fd: %d [%d]\n",
-                fd, getpid());
+    size_t i;
+    for (i = 0; i < changes->count; i++) {
+        if (changes->change[i].fd >= first && changes->change[i].fd <= last) {
+            changes->change[i].tracked = 0;
+        }
+    }
+    /* Only visit our tracked descriptors. */
+    int fd;
+    for (fd = tracked_fds_next(first); fd != -1 && fd <= last;
+            fd = tracked_fds_next(fd + 1)) {
+        if (!tracked_fds_changes_set(changes, fd, 0)) {
+            return 0;
+        }
+    }
+    return 1;
+}
 #endif
-        return x;
+#ifdef HAVE_CLOSE_RANGE
+/* Set the close-on-exec flag of the descriptors first to last (inclusive) in
+ * the child. Returns 0 if changes is full. */
+static int tracked_fds_changes_cloexec_range(
+        struct tracked_fds_changes *changes, int first, int last) {
+    size_t i;
+    for (i = 0; i < changes->count; i++) {
+        if (changes->change[i].fd >= first && changes->change[i].fd <= last) {
+            changes->change[i].cloexec = 1;
+        }
+    }
+    int fd;
+    for (fd = tracked_fds_next(first); fd != -1 && fd <= last;
+            fd = tracked_fds_next(fd + 1)) {
+        if (!tracked_fds_changes_set_cloexec(changes, fd, 1)) {
+            return 0;
+        }
     }
+    return 1;
+}
+#endif
 
-    /* Write comma after number. */
-    x += length;
-    *x++ = ',';
-    /* Make sure the string is always null-terminated. */
-    *x = 0;
+/* Append fd (>= TRACKFDS_STATIC_COUNT) to the list after the bitmap;
+ * previous is the last appended descriptor. */
+static char *update_environment_buffer_tail(char *x, int *previous, int fd) {
+    assert(fd > *previous);
+
+    if (*previous < TRACKFDS_STATIC_COUNT) {
+        *x++ = '.';
+    }
+    unsigned int value = (unsigned int)(fd - *previous - 1);
+    *previous = fd;
 
+    while (value >= TRACKFDS_ENV_VARINT_MORE) {
+        *x++ = tracked_fds_base64[TRACKFDS_ENV_VARINT_MORE
+                                  | (value % TRACKFDS_ENV_VARINT_MORE)];
+        value /= TRACKFDS_ENV_VARINT_MORE;
+    }
+    *x++ = tracked_fds_base64[value];
     return x;
 }
-static void update_environment_buffer(char *x) {
+inline static size_t update_environment_buffer_size(size_t changes) {
     assert(initialized);
 
-    size_t i;
-    for (i = 0; i < TRACKFDS_STATIC_COUNT; i++) {
-        if (tracked_fds[i]) {
-            x = update_environment_buffer_entry(x, (int)i);
+    return strlen(TRACKFDS_ENV_VERSION)
+           + (TRACKFDS_STATIC_COUNT + TRACKFDS_ENV_BITS - 1) / TRACKFDS_ENV_BITS
+           + 1 /* '.' */
+           + (atomic_load_relaxed(&tracked_fds_leaves_count) + changes)
+             * TRACKFDS_ENV_VARINT_MAX
+           + 1 /* to fit '\0' */;
+}
+/* Write our tracked descriptors to x (size bytes) for a child process which
+ * applies changes (if not NULL) to them. The buffer should have space for
+ * update_environment_buffer_size(changes->count) bytes. Descriptors tracked
+ * by other threads after the size was determined are skipped if they don't
+ * fit. */
+static void update_environment_buffer_changes(char *x, size_t size,
+        struct tracked_fds_changes *changes) {
+    assert(initialized);
+    assert(size >= strlen(TRACKFDS_ENV_VERSION) + 1 /* '.' */
+                   + TRACKFDS_STATIC_COUNT / TRACKFDS_ENV_BITS);
+
+    size_t i, j;
+
+    /* Last position where another descriptor (and '.') still fits. */
+    char const *tail_end = x + size - 1 /* '\0' */ - 1 /* '.' */
+                           - TRACKFDS_ENV_VARINT_MAX;
+
+    /* Descriptors < TRACKFDS_STATIC_COUNT in the child. Descriptors with
+     * close-on-exec flag don't survive exec*(). */
+    unsigned long bitmap[TRACKFDS_STATIC_WORDS];
+    for (i = 0; i < TRACKFDS_STATIC_WORDS; i++) {
+        bitmap[i] = atomic_load_relaxed(&state.tracked_fds[i])
+                  & ~atomic_load_relaxed(&tracked_fds_cloexec[i]);
+    }
+    /* Descriptors >= TRACKFDS_STATIC_COUNT tracked by changes, sorted. */
+    int added[TRACKFDS_CHANGES_MAX];
+    size_t added_count = 0;
+
+    if (changes) {
+        if (changes->closefrom < TRACKFDS_STATIC_COUNT) {
+            for (i = (size_t)changes->closefrom; i < TRACKFDS_STATIC_COUNT;
+                    i++) {
+                bitmap[TRACKFDS_WORD(i)] &= ~TRACKFDS_BIT(i);
+            }
+        }
+        for (i = 0; i < changes->count; i++) {
+            int fd = changes->change[i].fd;
+            int tracked = changes->change[i].tracked
+                          && !changes->change[i].cloexec;
+            if (fd < TRACKFDS_STATIC_COUNT) {
+                if (tracked) {
+                    bitmap[TRACKFDS_WORD(fd)] |= TRACKFDS_BIT(fd);
+                } else {
+                    bitmap[TRACKFDS_WORD(fd)] &= ~TRACKFDS_BIT(fd);
+                }
+            } else if (tracked && fd < TRACKFDS_MAX) {
+                /* Insertion sort, there are only a few changes. */
+                for (j = added_count; j > 0 && added[j - 1] > fd; j--) {
+                    added[j] = added[j - 1];
+                }
+                added[j] = fd;
+                added_count++;
+            }
         }
     }
-    for (i = 0; i < tracked_fds_list_count; i++) {
-        x = update_environment_buffer_entry(x, tracked_fds_list[i]);
+
+    memcpy(x, TRACKFDS_ENV_VERSION, strlen(TRACKFDS_ENV_VERSION));
+    x += strlen(TRACKFDS_ENV_VERSION);
+
+    /* The bitmap, without trailing empty characters. */
+    char *end = x;
+    for (i = 0; i < TRACKFDS_STATIC_COUNT; i += TRACKFDS_ENV_BITS) {
+        unsigned int value = 0;
+        for (j = 0; j < TRACKFDS_ENV_BITS && i + j < TRACKFDS_STATIC_COUNT;
+                j++) {
+            if (bitmap[TRACKFDS_WORD(i + j)] & TRACKFDS_BIT(i + j)) {
+                value |= 1U << j;
+            }
+        }
+        *x++ = tracked_fds_base64[value];
+        if (value) {
+            end = x;
+        }
+    }
+    x = end;
+
+    /* The remaining descriptors in ascending order. */
+    int previous = TRACKFDS_STATIC_COUNT - 1;
+    size_t added_next = 0;
+    size_t leaf;
+    for (leaf = 0; atomic_load_relaxed(&tracked_fds_leaves_count) != 0
+                   && leaf < TRACKFDS_LEAVES; leaf++) {
+        if (!atomic_load_relaxed(&tracked_fds_leaves[leaf])) {
+            continue;
+        }
+        struct tracked_fds_leaf *entry = tracked_fds_pin_leaf(leaf, 0);
+        if (!entry) {
+            continue;
+        }
+        for (i = 0; i < TRACKFDS_LEAF_WORDS; i++) {
+            /* Only visit set bits. */
+            unsigned long word = atomic_load_relaxed(&entry->tracked[i])
+                               & ~atomic_load_relaxed(&entry->cloexec[i]);
+            while (word && x <= tail_end) {
+                size_t bit = (size_t)ctzl(word);
+                word &= word - 1;
+
+                int fd = (int)(leaf * TRACKFDS_LEAF_COUNT
+                               + i * TRACKFDS_WORD_BITS + bit);
+                /* Closed in the child or handled with the changes. */
+                if (changes && (fd >= changes->closefrom
+                                || tracked_fds_changes_find(changes, fd))) {
+                    continue;
+                }
+                for (; added_next < added_count && added[added_next] < fd
+                        && x <= tail_end; added_next++) {
+                    x = update_environment_buffer_tail(x, &previous,
+                                                       added[added_next]);
+                }
+                if (x > tail_end) {
+                    break;
+                }
+                x = update_environment_buffer_tail(x, &previous, fd);
+            }
+        }
+        tracked_fds_unpin_leaf(leaf, entry, 0);
+    }
+    for (; added_next < added_count && x <= tail_end; added_next++) {
+        x = update_environment_buffer_tail(x, &previous, added[added_next]);
     }
-}
-inline static size_t update_environment_buffer_size(void) {
-    assert(initialized);
 
-    /* Use the maximum count (TRACKFDS_STATIC_COUNT) of used descriptors
-     * because it's simple and small enough not to be a problem.
-     *
-     * An integer (32-bit) has at most 10 digits, + 1 for the comma after each
-     * number. Bigger file descriptors (which shouldn't occur in reality) are
-     * skipped. */
-    return (TRACKFDS_STATIC_COUNT + tracked_fds_list_count)
-               * (10 + 1) + 1 /* to fit '\0' */;
+    *x = 0;
 }
-static void update_environment(void) {
+/* Only necessary without posix_spawn() or execvpe(), otherwise the hooks pass
+ * a copy of the environment to the child, see exec_env(). setenv() leaks
+ * memory and is not thread-safe. */
+#if !defined(HAVE_SPAWN) || !defined(HAVE_EXECVPE)
+/* Update ENV_NAME_PRIVATE_FDS for a child process which applies changes (if
+ * not NULL) to our tracked descriptors, e.g. popen(). */
+static void update_environment_changes(struct tracked_fds_changes *changes) {
 #ifdef DEBUG
     debug("update_environment()\t\t[%d]\n", getpid());
 #endif
@@ -283,15 +884,18 @@ static void update_environment(void) {
 
     int saved_errno = errno;
 
-    char env[update_environment_buffer_size()];
-    env[0] = 0;
+    char env[update_environment_buffer_size(changes ? changes->count : 0)];
 
-    update_environment_buffer(env);
+    update_environment_buffer_changes(env, sizeof(env), changes);
 
+    /* setenv() leaks the old value, only call it if necessary. */
+    char const *old_env = getenv(ENV_NAME_PRIVATE_FDS);
+    if (!old_env || strcmp(old_env, env)) {
 #if 0
-    debug("    setenv(\"%s\", \"%s\", 1)\n", ENV_NAME_PRIVATE_FDS, env);
+        debug("    setenv(\"%s\", \"%s\", 1)\n", ENV_NAME_PRIVATE_FDS, env);
 #endif
-    setenv(ENV_NAME_PRIVATE_FDS, env, 1 /* overwrite */);
+        setenv(ENV_NAME_PRIVATE_FDS, env, 1 /* overwrite */);
+    }
 
     /* Child processes must use ENV_NAME_PRIVATE_FDS to get the updated list
      * of tracked file descriptors, not the static list provided by the user
@@ -305,14 +909,209 @@ static void update_environment(void) {
 
     errno = saved_errno;
 }
+static void update_environment(void) {
+    update_environment_changes(NULL);
+}
+#endif
 
 
 
+/* The leaf referenced by a (non-zero) handle. */
+static struct tracked_fds_leaf *tracked_fds_handle_leaf(unsigned long handle) {
+    assert(handle != 0);
+    return atomic_load_relaxed(
+            &tracked_fds_pool[(handle & TRACKFDS_HANDLE_INDEX_MASK) - 1]);
+}
+/* The handle of the leaf containing fd (>= TRACKFDS_STATIC_COUNT), 0 if
+ * there is none. */
+static unsigned long tracked_fds_handle(int fd) {
+    assert(fd >= TRACKFDS_STATIC_COUNT);
+
+    if (unlikely(fd >= TRACKFDS_MAX)) {
+        return 0;
+    }
+    return atomic_load_acquire(&tracked_fds_leaves[TRACKFDS_LEAF(fd)]);
+}
+
+/* Add a new leaf to tracked_fds_pool[], taken from the arena or mmap()ed.
+ * Returns its index, -1 on failure. */
+static long tracked_fds_pool_grow(void) {
+    unsigned long used;
+    do {
+        used = atomic_load_relaxed(&tracked_fds_pool_used);
+        if (used >= TRACKFDS_LEAVES) {
+            return -1;
+        }
+    } while (!atomic_cas(&tracked_fds_pool_used, used, used + 1));
+
+    struct tracked_fds_leaf *leaf = NULL;
+    if (used < TRACKFDS_ARENA_LEAVES) {
+        leaf = &tracked_fds_arena[used];
+    } else {
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+        /* mmap() (unlike malloc()) is safe in a signal handler. The mapping
+         * is zero. */
+        int saved_errno = errno;
+        void *mapping = mmap(NULL, sizeof(*leaf), PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping != MAP_FAILED) {
+            leaf = mapping;
+        }
+        errno = saved_errno;
+#endif
+    }
+    if (!leaf) {
+        /* Give the index back (unless another one was taken in the meantime,
+         * then it's wasted). */
+        atomic_cas(&tracked_fds_pool_used, used + 1, used);
+        return -1;
+    }
+
+    leaf->index = used;
+    atomic_store_release(&tracked_fds_pool[used], leaf);
+    return (long)used;
+}
+/* Take a freed leaf from tracked_fds_pool[]. Returns its index, -1 if there
+ * is none. */
+static long tracked_fds_pool_take(void) {
+    size_t i;
+
+    for (i = 0; i < TRACKFDS_LEAVES / TRACKFDS_WORD_BITS; i++) {
+        unsigned long word;
+        while ((word = atomic_load_relaxed(&tracked_fds_pool_free[i])) != 0) {
+            unsigned long bit = word & (~word + 1); /* lowest set bit */
+            if (atomic_cas(&tracked_fds_pool_free[i], word, word & ~bit)) {
+                return (long)(i * TRACKFDS_WORD_BITS + (size_t)ctzl(word));
+            }
+        }
+    }
+    return -1;
+}
+static void tracked_fds_pool_put(unsigned long index) {
+    atomic_fetch_or(&tracked_fds_pool_free[TRACKFDS_WORD(index)],
+                    TRACKFDS_BIT(index));
+}
+
+/* Take a free leaf and pin it (see tracked_fds_pin_leaf()), its handle is
+ * stored in handle. Returns NULL if no leaf is available. */
+static struct tracked_fds_leaf *tracked_fds_alloc_leaf(unsigned long *handle) {
+    long index = tracked_fds_pool_take();
+    if (index < 0) {
+        index = tracked_fds_pool_grow();
+        if (index < 0) {
+            return NULL;
+        }
+    }
+
+    /* Nobody else uses the leaf: pinning fails for all handles of previous
+     * incarnations. */
+    struct tracked_fds_leaf *leaf = atomic_load_relaxed(
+            &tracked_fds_pool[index]);
+    unsigned long incarnation = ((atomic_load_relaxed(&leaf->state)
+                                  >> TRACKFDS_STATE_INCARNATION_SHIFT) + 1)
+                              & TRACKFDS_INCARNATION_MASK;
+    atomic_store_relaxed(&leaf->state,
+            (incarnation << TRACKFDS_STATE_INCARNATION_SHIFT) | 1 /* pin */);
+
+    *handle = (incarnation << TRACKFDS_HANDLE_INCARNATION_SHIFT)
+            | (unsigned long)(index + 1);
+    return leaf;
+}
+/* Unpublish the dead leaf of handle from slot and free it. Only one caller
+ * succeeds, the handle (incarnation) prevents unpublishing a reused leaf. */
+static void tracked_fds_free_leaf(unsigned long *slot, unsigned long handle) {
+    if (atomic_cas(slot, handle, 0UL)) {
+        tracked_fds_pool_put((handle & TRACKFDS_HANDLE_INDEX_MASK) - 1);
+    }
+}
+
+/* Pin the leaf with number leaf (see TRACKFDS_LEAF()) before modifying it:
+ * a pinned leaf is not freed. Allocate the leaf if necessary and allocate is
+ * set. Returns NULL if there is no leaf. Must be released with
+ * tracked_fds_unpin_leaf(). */
+static struct tracked_fds_leaf *tracked_fds_pin_leaf(size_t leaf,
+                                                     int allocate) {
+    unsigned long *slot = &tracked_fds_leaves[leaf];
+
+    for (;;) {
+        unsigned long handle = atomic_load_acquire(slot);
+        if (!handle) {
+            if (!allocate) {
+                return NULL;
+            }
+            struct tracked_fds_leaf *entry = tracked_fds_alloc_leaf(&handle);
+            if (!entry || atomic_cas(slot, 0UL, handle)) {
+                return entry;
+            }
+            /* Another thread published a leaf first. Ours was never
+             * visible, give it back. */
+            atomic_store_relaxed(&entry->state,
+                                 atomic_load_relaxed(&entry->state)
+                                 - 1 /* pin */ + TRACKFDS_STATE_DEAD);
+            tracked_fds_pool_put(entry->index);
+            continue;
+        }
+
+        struct tracked_fds_leaf *entry = tracked_fds_handle_leaf(handle);
+        unsigned long state = atomic_load_relaxed(&entry->state);
+        if (((state >> TRACKFDS_STATE_INCARNATION_SHIFT)
+                    & TRACKFDS_INCARNATION_MASK)
+                != handle >> TRACKFDS_HANDLE_INCARNATION_SHIFT) {
+            /* Freed and reused, the slot has changed. */
+            continue;
+        }
+        if (state & TRACKFDS_STATE_DEAD) {
+            /* Help the thread which is freeing it. */
+            tracked_fds_free_leaf(slot, handle);
+            continue;
+        }
+        if (atomic_cas(&entry->state, state, state + 1)) {
+            return entry;
+        }
+    }
+}
+/* Release a pin of tracked_fds_pin_leaf(). added is the number of
+ * descriptors added to (or removed from if negative) the leaf meanwhile. */
+static void tracked_fds_unpin_leaf(size_t leaf, struct tracked_fds_leaf *entry,
+                                   long added) {
+    unsigned long state, new_state;
+    do {
+        state = atomic_load_relaxed(&entry->state);
+        new_state = state + (unsigned long)added - 1;
+        /* Empty and unused, free it. */
+        if ((new_state & TRACKFDS_STATE_COUNT_MASK) == 0) {
+            new_state |= TRACKFDS_STATE_DEAD;
+        }
+    } while (!atomic_cas(&entry->state, state, new_state));
+
+    if (new_state & TRACKFDS_STATE_DEAD) {
+        unsigned long incarnation = (new_state
+                                     >> TRACKFDS_STATE_INCARNATION_SHIFT)
+                                  & TRACKFDS_INCARNATION_MASK;
+        tracked_fds_free_leaf(&tracked_fds_leaves[leaf],
+                (incarnation << TRACKFDS_HANDLE_INCARNATION_SHIFT)
+                | (entry->index + 1));
+    }
+}
+
+/* Clear bit i in bitmap. Most bits are not set, skip the (expensive) atomic
+ * operation then. */
+inline static void tracked_fds_bitmap_clear(unsigned long *bitmap, size_t i) {
+    if (atomic_load_relaxed(&bitmap[TRACKFDS_WORD(i)]) & TRACKFDS_BIT(i)) {
+        atomic_fetch_and(&bitmap[TRACKFDS_WORD(i)], ~TRACKFDS_BIT(i));
+    }
+}
+
 static void tracked_fds_add(int fd) {
     assert(fd >= 0);
 
     if (fd < TRACKFDS_STATIC_COUNT) {
-        tracked_fds[fd] = 1;
+        atomic_fetch_or(&state.tracked_fds[TRACKFDS_WORD(fd)],
+                        TRACKFDS_BIT(fd));
+        atomic_fetch_and(&tracked_fds_tty_known[TRACKFDS_WORD(fd)],
+                         ~TRACKFDS_BIT(fd));
+        tracked_fds_bitmap_clear(tracked_fds_cloexec, (size_t)fd);
+        atomic_add_release(&tracked_fds_generation, 1U);
 #if 0
         debug("tracked_fds_add(): %-3d\t\t[%d]\n", fd, getpid());
         tracked_fds_debug();
@@ -320,30 +1119,31 @@ static void tracked_fds_add(int fd) {
         return;
     }
 
-    if (tracked_fds_list_count >= tracked_fds_list_space) {
-        int saved_errno = errno;
-
-        size_t new_space = tracked_fds_list_space + TRACKFDS_REALLOC_STEP;
-        int *tmp = realloc(tracked_fds_list,
-                           sizeof(*tracked_fds_list) * new_space);
-        if (!tmp) {
-            /* We can do nothing, just ignore the error. We made sure not to
-             * destroy our state, so the new descriptor is ignored without any
-             * other consequences. */
+    struct tracked_fds_leaf *leaf = NULL;
+    if (fd < TRACKFDS_MAX) {
+        leaf = tracked_fds_pin_leaf(TRACKFDS_LEAF(fd), 1);
+    }
+    if (!leaf) {
+        /* We can do nothing, just ignore the error. The new descriptor is
+         * ignored without any other consequences. */
 #ifdef WARNING
-            warning("realloc(tracked_fds_list, %zu) failed! [%d]\n",
-                    sizeof(*tracked_fds_list) * new_space, getpid());
+        warning("tracked_fds_add(): no space for fd %d! [%d]\n",
+                fd, getpid());
 #endif
-            errno = saved_errno;
-            return;
-        }
-        errno = saved_errno;
-
-        tracked_fds_list = tmp;
-        tracked_fds_list_space = new_space;
+        return;
     }
 
-    tracked_fds_list[tracked_fds_list_count++] = fd;
+    size_t i = TRACKFDS_LEAF_INDEX(fd);
+    long added = 0;
+    if (!(atomic_fetch_or(&leaf->tracked[TRACKFDS_WORD(i)], TRACKFDS_BIT(i))
+                & TRACKFDS_BIT(i))) {
+        atomic_add(&tracked_fds_leaves_count, 1);
+        added = 1;
+    }
+    atomic_fetch_and(&leaf->tty_known[TRACKFDS_WORD(i)], ~TRACKFDS_BIT(i));
+    tracked_fds_bitmap_clear(leaf->cloexec, i);
+    atomic_add_release(&tracked_fds_generation, 1U);
+    tracked_fds_unpin_leaf(TRACKFDS_LEAF(fd), leaf, added);
 
 #ifdef DEBUG
     debug("tracked_fds_add(): %-3d\t\t[%d]\n", fd, getpid());
@@ -354,8 +1154,21 @@ static int tracked_fds_remove(int fd) {
     assert(fd >= 0);
 
     if (fd < TRACKFDS_STATIC_COUNT) {
-        int old_value = tracked_fds[fd];
-        tracked_fds[fd] = 0;
+        /* Most closed descriptors are not tracked, skip the (expensive)
+         * atomic operations. */
+        if (!(atomic_load_relaxed(&state.tracked_fds[TRACKFDS_WORD(fd)])
+                & TRACKFDS_BIT(fd))) {
+            return 0;
+        }
+        unsigned long old = atomic_fetch_and(
+                &state.tracked_fds[TRACKFDS_WORD(fd)], ~TRACKFDS_BIT(fd));
+        int old_value = (old & TRACKFDS_BIT(fd)) != 0;
+        atomic_fetch_and(&tracked_fds_tty_known[TRACKFDS_WORD(fd)],
+                         ~TRACKFDS_BIT(fd));
+        tracked_fds_bitmap_clear(tracked_fds_cloexec, (size_t)fd);
+        if (old_value) {
+            atomic_add_release(&tracked_fds_generation, 1U);
+        }
 
 #if 0
         debug("tracked_fds_remove(): %-3d\t[%d]\n", fd, getpid());
@@ -364,30 +1177,327 @@ static int tracked_fds_remove(int fd) {
         return old_value; /* Found vs. not found. */
     }
 
-    size_t i;
-    for (i = 0; i < tracked_fds_list_count; i++) {
-        if (fd != tracked_fds_list[i]) {
+    /* Skip the (expensive) pinning for untracked descriptors. */
+    if (!tracked_fds_find_slow(fd)) {
+        return 0;
+    }
+    struct tracked_fds_leaf *leaf = tracked_fds_pin_leaf(TRACKFDS_LEAF(fd), 0);
+    if (!leaf) {
+        /* Not found. */
+        return 0;
+    }
+
+    size_t i = TRACKFDS_LEAF_INDEX(fd);
+    if (!(atomic_fetch_and(&leaf->tracked[TRACKFDS_WORD(i)], ~TRACKFDS_BIT(i))
+                & TRACKFDS_BIT(i))) {
+        tracked_fds_unpin_leaf(TRACKFDS_LEAF(fd), leaf, 0);
+        /* Not found. */
+        return 0;
+    }
+    atomic_fetch_and(&leaf->tty_known[TRACKFDS_WORD(i)], ~TRACKFDS_BIT(i));
+    tracked_fds_bitmap_clear(leaf->cloexec, i);
+    atomic_add(&tracked_fds_leaves_count, (size_t)-1);
+    atomic_add_release(&tracked_fds_generation, 1U);
+    tracked_fds_unpin_leaf(TRACKFDS_LEAF(fd), leaf, -1);
+
+#ifdef DEBUG
+    debug("tracked_fds_remove(): %-3d\t[%d]\n", fd, getpid());
+    tracked_fds_debug();
+#endif
+
+    /* Found. */
+    return 1;
+}
+
+#ifdef HAVE_CLOSE_FD_RANGE
+/* Update the descriptors first to last (inclusive) of a bitmap: with
+ * set_cloexec set the close-on-exec flag of all tracked descriptors,
+ * otherwise stop tracking them (and clear their cached isatty() results and
+ * close-on-exec flags). Words without tracked descriptors are skipped, others
+ * are updated with a single atomic operation. Returns the number of changed
+ * descriptors. */
+static size_t tracked_fds_update_bits(unsigned long *tracked,
+                                      unsigned long *tty_known,
+                                      unsigned long *cloexec,
+                                      size_t first, size_t last,
+                                      int set_cloexec) {
+    size_t changed = 0;
+    size_t word;
+
+    assert(first <= last);
+
+    for (word = TRACKFDS_WORD(first); word <= TRACKFDS_WORD(last); word++) {
+        unsigned long mask = ~0UL;
+        if (word == TRACKFDS_WORD(first)) {
+            mask &= ~0UL << (first % TRACKFDS_WORD_BITS);
+        }
+        if (word == TRACKFDS_WORD(last)
+                && last % TRACKFDS_WORD_BITS != TRACKFDS_WORD_BITS - 1) {
+            mask &= ~(~0UL << (last % TRACKFDS_WORD_BITS + 1));
+        }
+
+        unsigned long bits = atomic_load_relaxed(&tracked[word]) & mask;
+        if (!bits) {
             continue;
         }
+        if (set_cloexec) {
+            bits &= ~atomic_load_relaxed(&cloexec[word]);
+            if (bits) {
+                atomic_fetch_or(&cloexec[word], bits);
+                changed += (size_t)popcountl(bits);
+            }
+            continue;
+        }
+        unsigned long old = atomic_fetch_and(&tracked[word], ~mask);
+        atomic_fetch_and(&tty_known[word], ~mask);
+        if (atomic_load_relaxed(&cloexec[word]) & mask) {
+            atomic_fetch_and(&cloexec[word], ~mask);
+        }
+        changed += (size_t)popcountl(old & mask);
+    }
+    return changed;
+}
+/* Stop tracking the descriptors first to last (inclusive), e.g. closed by
+ * close_range(), or only set their close-on-exec flag. Only the words and
+ * leaves of the range are visited. */
+static void tracked_fds_update_range(int first, int last, int set_cloexec) {
+    assert(first >= 0 && first <= last);
+
+    size_t changed = 0;
+
+    if (first < TRACKFDS_STATIC_COUNT) {
+        size_t to = last < TRACKFDS_STATIC_COUNT
+                  ? (size_t)last : TRACKFDS_STATIC_COUNT - 1;
+        changed += tracked_fds_update_bits(state.tracked_fds,
+                                           tracked_fds_tty_known,
+                                           tracked_fds_cloexec,
+                                           (size_t)first, to, set_cloexec);
+    }
+
+    if (last >= TRACKFDS_STATIC_COUNT
+            && atomic_load_relaxed(&tracked_fds_leaves_count) != 0) {
+        size_t from = first > TRACKFDS_STATIC_COUNT
+                    ? (size_t)first : TRACKFDS_STATIC_COUNT;
+        size_t to = last < TRACKFDS_MAX ? (size_t)last : TRACKFDS_MAX - 1;
+
+        size_t leaf;
+        for (leaf = TRACKFDS_LEAF(from); from <= to && leaf <= TRACKFDS_LEAF(to);
+                leaf++) {
+            if (!atomic_load_relaxed(&tracked_fds_leaves[leaf])) {
+                continue;
+            }
+            struct tracked_fds_leaf *entry = tracked_fds_pin_leaf(leaf, 0);
+            if (!entry) {
+                continue;
+            }
 
-        memmove(tracked_fds_list + i, tracked_fds_list + i + 1,
-                sizeof(*tracked_fds_list) * (tracked_fds_list_count - i - 1));
-        tracked_fds_list_count--;
+            size_t leaf_first = leaf == TRACKFDS_LEAF(from)
+                              ? TRACKFDS_LEAF_INDEX(from) : 0;
+            size_t leaf_last = leaf == TRACKFDS_LEAF(to)
+                             ? TRACKFDS_LEAF_INDEX(to)
+                             : TRACKFDS_LEAF_COUNT - 1;
+            size_t count = tracked_fds_update_bits(entry->tracked,
+                                                   entry->tty_known,
+                                                   entry->cloexec,
+                                                   leaf_first, leaf_last,
+                                                   set_cloexec);
+            long added = 0;
+            if (count != 0 && !set_cloexec) {
+                atomic_add(&tracked_fds_leaves_count, (size_t)0 - count);
+                added = -(long)count;
+            }
+            tracked_fds_unpin_leaf(leaf, entry, added);
+            changed += count;
+        }
+    }
+
+    if (changed != 0) {
+        atomic_add_release(&tracked_fds_generation, 1U);
+    }
 
 #ifdef DEBUG
-        debug("tracked_fds_remove(): %-3d\t[%d]\n", fd, getpid());
-        tracked_fds_debug();
+    debug("tracked_fds_update_range(): %d-%d %s (%zu)\t[%d]\n",
+          first, last, set_cloexec ? "cloexec" : "removed", changed, getpid());
+    tracked_fds_debug();
+#endif
+}
+static void tracked_fds_remove_range(int first, int last) {
+    tracked_fds_update_range(first, last, 0);
+}
+# ifdef HAVE_CLOSE_RANGE
+static void tracked_fds_set_cloexec_range(int first, int last) {
+    tracked_fds_update_range(first, last, 1);
+}
+# endif
 #endif
 
-        /* Found. */
-        return 1;
+/* Cache the result of isatty() for a tracked descriptor. */
+static void tracked_fds_set_tty(int fd, int tty) {
+    assert(fd >= 0);
+
+    struct tracked_fds_leaf *leaf = NULL;
+    unsigned long *known, *result;
+    size_t i;
+
+    if (fd < TRACKFDS_STATIC_COUNT) {
+        known  = tracked_fds_tty_known;
+        result = tracked_fds_tty;
+        i = (size_t)fd;
+    } else {
+        if (!tracked_fds_handle(fd)) {
+            return;
+        }
+        leaf = tracked_fds_pin_leaf(TRACKFDS_LEAF(fd), 0);
+        if (!leaf) {
+            return;
+        }
+        known  = leaf->tty_known;
+        result = leaf->tty;
+        i = TRACKFDS_LEAF_INDEX(fd);
     }
 
-    /* Not found. */
-    return 0;
+    if (tty) {
+        atomic_fetch_or(&result[TRACKFDS_WORD(i)], TRACKFDS_BIT(i));
+    } else {
+        atomic_fetch_and(&result[TRACKFDS_WORD(i)], ~TRACKFDS_BIT(i));
+    }
+    /* Release, the result must be visible before it's known. */
+    atomic_fetch_or(&known[TRACKFDS_WORD(i)], TRACKFDS_BIT(i));
+
+    if (leaf) {
+        tracked_fds_unpin_leaf(TRACKFDS_LEAF(fd), leaf, 0);
+    }
+}
+static void tracked_fds_reset_tty(int fd) {
+    assert(fd >= 0);
+
+    if (fd < TRACKFDS_STATIC_COUNT) {
+        atomic_fetch_and(&tracked_fds_tty_known[TRACKFDS_WORD(fd)],
+                         ~TRACKFDS_BIT(fd));
+        return;
+    }
+
+    if (!tracked_fds_handle(fd)) {
+        return;
+    }
+    struct tracked_fds_leaf *leaf = tracked_fds_pin_leaf(TRACKFDS_LEAF(fd), 0);
+    if (leaf) {
+        size_t i = TRACKFDS_LEAF_INDEX(fd);
+        atomic_fetch_and(&leaf->tty_known[TRACKFDS_WORD(i)], ~TRACKFDS_BIT(i));
+        tracked_fds_unpin_leaf(TRACKFDS_LEAF(fd), leaf, 0);
+    }
+}
+/* Remember the close-on-exec flag of a tracked descriptor, e.g. set with
+ * fcntl(F_SETFD). */
+static void tracked_fds_set_cloexec(int fd, int cloexec) {
+    assert(fd >= 0);
+
+    struct tracked_fds_leaf *leaf = NULL;
+    unsigned long *tracked, *bitmap;
+    size_t i;
+
+    if (fd < TRACKFDS_STATIC_COUNT) {
+        tracked = state.tracked_fds;
+        bitmap  = tracked_fds_cloexec;
+        i = (size_t)fd;
+    } else {
+        if (!tracked_fds_handle(fd)) {
+            return;
+        }
+        leaf = tracked_fds_pin_leaf(TRACKFDS_LEAF(fd), 0);
+        if (!leaf) {
+            return;
+        }
+        tracked = leaf->tracked;
+        bitmap  = leaf->cloexec;
+        i = TRACKFDS_LEAF_INDEX(fd);
+    }
+
+    unsigned long *word = &bitmap[TRACKFDS_WORD(i)];
+    /* Untracked descriptors are never passed to child processes. Most calls
+     * don't change the flag, skip the atomic operation. */
+    if ((atomic_load_relaxed(&tracked[TRACKFDS_WORD(i)]) & TRACKFDS_BIT(i))
+            && ((atomic_load_relaxed(word) & TRACKFDS_BIT(i)) != 0)
+               != (cloexec != 0)) {
+        if (cloexec) {
+            atomic_fetch_or(word, TRACKFDS_BIT(i));
+        } else {
+            atomic_fetch_and(word, ~TRACKFDS_BIT(i));
+        }
+        atomic_add_release(&tracked_fds_generation, 1U);
+
+#ifdef DEBUG
+        debug("tracked_fds_set_cloexec(): %-3d %d\t[%d]\n",
+              fd, cloexec, getpid());
+#endif
+    }
+
+    if (leaf) {
+        tracked_fds_unpin_leaf(TRACKFDS_LEAF(fd), leaf, 0);
+    }
+}
+/* Return 1 if the close-on-exec flag of a tracked descriptor is set. */
+static int tracked_fds_get_cloexec(int fd) {
+    assert(fd >= 0);
+
+    if (fd < TRACKFDS_STATIC_COUNT) {
+        return (atomic_load_relaxed(&tracked_fds_cloexec[TRACKFDS_WORD(fd)])
+                & TRACKFDS_BIT(fd)) != 0;
+    }
+
+    size_t i = TRACKFDS_LEAF_INDEX(fd);
+    unsigned long handle, word;
+    do {
+        handle = tracked_fds_handle(fd);
+        if (!handle) {
+            return 0;
+        }
+        word = atomic_load_acquire(
+                &tracked_fds_handle_leaf(handle)->cloexec[TRACKFDS_WORD(i)]);
+        /* The leaf was freed in the meantime, try again. */
+    } while (tracked_fds_handle(fd) != handle);
+
+    return (word & TRACKFDS_BIT(i)) != 0;
+}
+
+static int tracked_fds_get_tty_slow(int fd) noinline;
+/* Return the cached result of isatty() for a tracked descriptor, -1 if
+ * unknown. */
+inline static int tracked_fds_get_tty(int fd) always_inline;
+inline static int tracked_fds_get_tty(int fd) {
+    assert(fd >= 0);
+
+    if (likely(fd < TRACKFDS_STATIC_COUNT)) {
+        if (!(atomic_load_acquire(&tracked_fds_tty_known[TRACKFDS_WORD(fd)])
+                & TRACKFDS_BIT(fd))) {
+            return -1;
+        }
+        return (atomic_load_relaxed(&tracked_fds_tty[TRACKFDS_WORD(fd)])
+                & TRACKFDS_BIT(fd)) != 0;
+    }
+
+    return tracked_fds_get_tty_slow(fd);
+}
+static int tracked_fds_get_tty_slow(int fd) {
+    size_t i = TRACKFDS_LEAF_INDEX(fd);
+    unsigned long handle, known, tty;
+    do {
+        handle = tracked_fds_handle(fd);
+        if (!handle) {
+            return -1;
+        }
+        struct tracked_fds_leaf *leaf = tracked_fds_handle_leaf(handle);
+        known = atomic_load_acquire(&leaf->tty_known[TRACKFDS_WORD(i)]);
+        tty   = atomic_load_acquire(&leaf->tty[TRACKFDS_WORD(i)]);
+        /* The leaf was freed in the meantime, try again. */
+    } while (tracked_fds_handle(fd) != handle);
+
+    if (!(known & TRACKFDS_BIT(i))) {
+        return -1;
+    }
+    return (tty & TRACKFDS_BIT(i)) != 0;
 }
 
-static int tracked_fds_find_slow(int fd) noinline;
 /*
  * tracked_fds_find() is called for each hook call and should be as fast as
  * possible. As most file descriptors are < TRACKFDS_STATIC_COUNT, force the
@@ -398,33 +1508,154 @@ static int tracked_fds_find_slow(int fd) noinline;
  */
 inline static int tracked_fds_find(int fd) always_inline;
 inline static int tracked_fds_find(int fd) {
+    /* The unsigned comparison also skips negative descriptors. */
+    if (likely((unsigned int)fd < TRACKFDS_STATIC_COUNT)) {
+        return (atomic_load_relaxed(&state.tracked_fds[TRACKFDS_WORD(fd)])
+                & TRACKFDS_BIT(fd)) != 0;
+    }
     /* Invalid file descriptor. No assert() as we're called from the hooked
      * macro. */
     if (unlikely(fd < 0)) {
         return 0;
     }
 
-    if (likely(fd < TRACKFDS_STATIC_COUNT)) {
-        return tracked_fds[fd];
+    return tracked_fds_find_slow(fd);
+}
+/* Stop tracking all descriptors. */
+static void tracked_fds_clear(void) {
+    size_t i, j;
+
+    for (i = 0; i < TRACKFDS_STATIC_WORDS; i++) {
+        atomic_store_relaxed(&state.tracked_fds[i], 0);
+        atomic_store_relaxed(&tracked_fds_tty_known[i], 0);
+        atomic_store_relaxed(&tracked_fds_cloexec[i], 0);
+    }
+    for (i = 0; i < TRACKFDS_LEAVES; i++) {
+        if (!atomic_load_relaxed(&tracked_fds_leaves[i])) {
+            continue;
+        }
+        struct tracked_fds_leaf *leaf = tracked_fds_pin_leaf(i, 0);
+        if (!leaf) {
+            continue;
+        }
+        size_t removed = 0;
+        for (j = 0; j < TRACKFDS_LEAF_WORDS; j++) {
+            removed += (size_t)popcountl(
+                    atomic_fetch_and(&leaf->tracked[j], 0UL));
+            atomic_store_relaxed(&leaf->tty_known[j], 0);
+            atomic_store_relaxed(&leaf->cloexec[j], 0);
+        }
+        atomic_add(&tracked_fds_leaves_count, (size_t)0 - removed);
+        tracked_fds_unpin_leaf(i, leaf, -(long)removed);
     }
+    atomic_add_release(&tracked_fds_generation, 1U);
 
-    return tracked_fds_find_slow(fd);
+#ifdef DEBUG
+    debug("tracked_fds_clear()\t\t[%d]\n", getpid());
+#endif
 }
-static int tracked_fds_find_slow(int fd) {
-    assert(initialized);
-    assert(fd >= 0);
+/* Return 1 if no descriptor is tracked. */
+inline static int tracked_fds_empty(void) {
+    size_t i;
 
-    if (tracked_fds_list_count == 0) {
+    if (atomic_load_relaxed(&tracked_fds_leaves_count) != 0) {
         return 0;
     }
+    for (i = 0; i < TRACKFDS_STATIC_WORDS; i++) {
+        if (atomic_load_relaxed(&state.tracked_fds[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
 
-    size_t i;
-    for (i = 0; i < tracked_fds_list_count; i++) {
-        if (fd == tracked_fds_list[i]) {
-            return 1;
+/* Return 1 if fd is untracked and < TRACKFDS_STATIC_COUNT. Used by the hooks
+ * as fast path, all other descriptors are checked with tracked_fds_find().
+ * While a post string is pending all hooks take the slow path, which writes
+ * it before any untracked output (see color_reset_pending()). */
+inline static int tracked_fds_untracked(int fd) always_inline;
+inline static int tracked_fds_untracked(int fd) {
+    return (unsigned int)fd < TRACKFDS_STATIC_COUNT
+        && !(atomic_load_relaxed(&state.tracked_fds[TRACKFDS_WORD(fd)])
+             & TRACKFDS_BIT(fd))
+        && !state.color_pending;
+}
+#ifdef HAVE_CLOSE_FD_RANGE
+/* Index of the first set bit >= start in bitmap (words long), -1 if none. */
+static long tracked_fds_bitmap_next(unsigned long *bitmap, size_t words,
+                                    size_t start) {
+    size_t word = TRACKFDS_WORD(start);
+    if (word >= words) {
+        return -1;
+    }
+
+    unsigned long value = atomic_load_relaxed(&bitmap[word])
+                        & (~0UL << (start % TRACKFDS_WORD_BITS));
+    for (;;) {
+        if (value) {
+            return (long)(word * TRACKFDS_WORD_BITS + (size_t)ctzl(value));
         }
+        if (++word >= words) {
+            return -1;
+        }
+        value = atomic_load_relaxed(&bitmap[word]);
     }
-    return 0;
+}
+/* Return the first tracked descriptor >= fd, -1 if there is none. */
+static int tracked_fds_next(int fd) {
+    assert(fd >= 0);
+
+    long next;
+
+    if (fd < TRACKFDS_STATIC_COUNT) {
+        next = tracked_fds_bitmap_next(state.tracked_fds,
+                                       TRACKFDS_STATIC_WORDS, (size_t)fd);
+        if (next >= 0) {
+            return (int)next;
+        }
+        fd = TRACKFDS_STATIC_COUNT;
+    }
+    if (atomic_load_relaxed(&tracked_fds_leaves_count) == 0) {
+        return -1;
+    }
+
+    size_t leaf;
+    size_t start = TRACKFDS_LEAF_INDEX(fd);
+    for (leaf = TRACKFDS_LEAF(fd); leaf < TRACKFDS_LEAVES; leaf++, start = 0) {
+        if (!atomic_load_relaxed(&tracked_fds_leaves[leaf])) {
+            continue;
+        }
+        struct tracked_fds_leaf *entry = tracked_fds_pin_leaf(leaf, 0);
+        if (!entry) {
+            continue;
+        }
+        next = tracked_fds_bitmap_next(entry->tracked, TRACKFDS_LEAF_WORDS,
+                                       start);
+        tracked_fds_unpin_leaf(leaf, entry, 0);
+        if (next >= 0) {
+            return (int)(leaf * TRACKFDS_LEAF_COUNT + (size_t)next);
+        }
+    }
+    return -1;
+}
+#endif
+
+static int tracked_fds_find_slow(int fd) {
+    assert(fd >= 0);
+
+    size_t i = TRACKFDS_LEAF_INDEX(fd);
+    unsigned long handle, word;
+    do {
+        handle = tracked_fds_handle(fd);
+        if (!handle) {
+            return 0;
+        }
+        word = atomic_load_acquire(
+                &tracked_fds_handle_leaf(handle)->tracked[TRACKFDS_WORD(i)]);
+        /* The leaf was freed in the meantime, try again. */
+    } while (tracked_fds_handle(fd) != handle);
+
+    return (word & TRACKFDS_BIT(i)) != 0;
 }
 
 #endif
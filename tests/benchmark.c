@@ -0,0 +1,503 @@
+/*
+ * Microbenchmarks of the hooked functions, run with `make bench`.
+ *
+ * Copyright (C) 2013-2018  Simon Ruderich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Usage: benchmark <library> [<iterations>]
+ *
+ * Each function is measured with stdout and stderr connected to a terminal
+ * (pty from openpty()), a regular file and /dev/null; without the library,
+ * with the library but untracked descriptors and with tracked descriptors.
+ * The library reads its settings on startup, therefore each combination runs
+ * in a new process (this program executed with "--run"). Only the measured
+ * process uses 'LD_PRELOAD', not this driver.
+ *
+ * The results are written to stdout as tab separated values, one line per
+ * function and combination (see print_header()). write_syscalls_per_call is
+ * taken from syscw in /proc/self/io (Linux only, "-" otherwise); it counts
+ * write(), writev() and similar system calls but not dup2(), close(), etc.
+ */
+
+#include <config.h>
+
+/* For {fwrite,fputs}_unlocked(), if available. */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_ERR_H
+# include <err.h>
+#endif
+#ifdef HAVE_OPENPTY
+# if defined(HAVE_PTY_H)
+#  include <pty.h>
+# elif defined(HAVE_UTIL_H)
+#  include <util.h>
+# elif defined(HAVE_LIBUTIL_H)
+#  include <libutil.h>
+# endif
+#endif
+
+#include "../src/compiler.h"
+
+
+/* Hardening functions (-D_FORTIFY_SOURCE=2), not declared without it. */
+#ifdef __GLIBC__
+extern int __printf_chk(int flag, char const *format, ...);
+extern int __fprintf_chk(FILE *stream, int flag, char const *format, ...);
+#endif
+
+/* The measured process writes its results to this descriptor, stdout and
+ * stderr are the target. */
+#define RESULT_FD 3
+/* Descriptor used by dup2(), must be unused. */
+#define SPARE_FD  5
+/* Tracked descriptors of the measured process. The untracked case still
+ * tracks a (closed) descriptor, otherwise the library binds all hooks
+ * directly to the libc and is not measured at all. */
+#define FDS_TRACKED   "COLORED_STDERR_FDS=1,2,"
+#define FDS_UNTRACKED "COLORED_STDERR_FDS=9,"
+
+#define FILE_TARGET "benchmark.tmp"
+
+#define DEFAULT_ITERATIONS 20000UL
+
+enum target {
+    TARGET_PTY,
+    TARGET_FILE,
+    TARGET_DEVNULL,
+};
+static char const *target_names[] = { "pty", "file", "devnull" };
+
+
+/* The measured functions, each called on stdout/stderr. */
+
+static char const message[] = "benchmark output\n";
+/* Not constant so the compiler can't replace printf() with puts(), etc. */
+static int value = 42;
+
+static void vfprintf_helper(FILE *stream, char const *format, ...) noinline;
+static void vfprintf_helper(FILE *stream, char const *format, ...) {
+    va_list ap;
+
+    va_start(ap, format);
+    vfprintf(stream, format, ap);
+    va_end(ap);
+}
+
+static void bench_write(void) {
+    if (write(STDOUT_FILENO, message, sizeof(message) - 1) == -1) {
+        abort();
+    }
+}
+static void bench_writev(void) {
+    struct iovec iov[2];
+    iov[0].iov_base = (void *)message;
+    iov[0].iov_len  = 10;
+    iov[1].iov_base = (void *)(message + 10);
+    iov[1].iov_len  = sizeof(message) - 1 - 10;
+    if (writev(STDOUT_FILENO, iov, 2) == -1) {
+        abort();
+    }
+}
+#ifdef HAVE_VDPRINTF
+static void bench_dprintf(void) {
+    dprintf(STDOUT_FILENO, "benchmark %d\n", value);
+}
+#endif
+static void bench_fwrite(void) {
+    fwrite(message, 1, sizeof(message) - 1, stdout);
+}
+#ifdef HAVE_FWRITE_UNLOCKED
+static void bench_fwrite_unlocked(void) {
+    fwrite_unlocked(message, 1, sizeof(message) - 1, stdout);
+}
+#endif
+static void bench_fputs(void) {
+    fputs(message, stdout);
+}
+#ifdef HAVE_FPUTS_UNLOCKED
+static void bench_fputs_unlocked(void) {
+    fputs_unlocked(message, stdout);
+}
+#endif
+static void bench_fputc(void) {
+    fputc('x', stdout);
+}
+static void bench_putc(void) {
+    putc('x', stdout);
+}
+static void bench_putchar(void) {
+    putchar('x');
+}
+static void bench_puts(void) {
+    puts("benchmark");
+}
+static void bench_printf(void) {
+    printf("benchmark %d\n", value);
+}
+static void bench_fprintf(void) {
+    fprintf(stdout, "benchmark %d\n", value);
+}
+static void bench_vfprintf(void) {
+    vfprintf_helper(stdout, "benchmark %d\n", value);
+}
+#ifdef __GLIBC__
+static void bench___printf_chk(void) {
+    __printf_chk(1, "benchmark %d\n", value);
+}
+static void bench___fprintf_chk(void) {
+    __fprintf_chk(stdout, 1, "benchmark %d\n", value);
+}
+#endif
+static void bench_fprintf_stderr(void) {
+    fprintf(stderr, "benchmark %d\n", value);
+}
+static void bench_perror(void) {
+    errno = ENOENT;
+    perror("benchmark");
+}
+#ifdef HAVE_ERR_H
+static void bench_warnx(void) {
+    warnx("benchmark %d", value);
+}
+#endif
+static void bench_dup2(void) {
+    if (dup2(STDOUT_FILENO, SPARE_FD) == -1) {
+        abort();
+    }
+}
+static void bench_dup_close(void) {
+    int fd = dup(STDOUT_FILENO);
+    if (fd == -1 || close(fd) == -1) {
+        abort();
+    }
+}
+static void bench_fcntl_setfd(void) {
+    if (fcntl(STDOUT_FILENO, F_SETFD, 0) == -1) {
+        abort();
+    }
+}
+
+struct benchmark {
+    char const *name;
+    void (*func)(void);
+};
+static struct benchmark const benchmarks[] = {
+    { "write",            bench_write },
+    { "writev",           bench_writev },
+#ifdef HAVE_VDPRINTF
+    { "dprintf",          bench_dprintf },
+#endif
+    { "fwrite",           bench_fwrite },
+#ifdef HAVE_FWRITE_UNLOCKED
+    { "fwrite_unlocked",  bench_fwrite_unlocked },
+#endif
+    { "fputs",            bench_fputs },
+#ifdef HAVE_FPUTS_UNLOCKED
+    { "fputs_unlocked",   bench_fputs_unlocked },
+#endif
+    { "fputc",            bench_fputc },
+    { "putc",             bench_putc },
+    { "putchar",          bench_putchar },
+    { "puts",             bench_puts },
+    { "printf",           bench_printf },
+    { "fprintf",          bench_fprintf },
+    { "vfprintf",         bench_vfprintf },
+#ifdef __GLIBC__
+    { "__printf_chk",     bench___printf_chk },
+    { "__fprintf_chk",    bench___fprintf_chk },
+#endif
+    { "fprintf(stderr)",  bench_fprintf_stderr },
+    { "perror",           bench_perror },
+#ifdef HAVE_ERR_H
+    { "warnx",            bench_warnx },
+#endif
+    { "dup2",             bench_dup2 },
+    { "dup+close",        bench_dup_close },
+    { "fcntl(F_SETFD)",   bench_fcntl_setfd },
+};
+
+
+/* Number of write system calls of this process, -1 if unknown. */
+static long write_syscalls(void) {
+    char buffer[512];
+
+    int fd = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t size = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (size <= 0) {
+        return -1;
+    }
+    buffer[size] = 0;
+
+    char const *x = strstr(buffer, "syscw: ");
+    if (!x) {
+        return -1;
+    }
+    return atol(x + strlen("syscw: "));
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/* Measure all functions in this process and print the results to
+ * RESULT_FD. */
+static int run(char const *target, char const *preload, char const *tracked,
+               unsigned long iterations) {
+    FILE *results = fdopen(RESULT_FD, "w");
+    if (!results) {
+        return EXIT_FAILURE;
+    }
+
+    /* Like stderr, so each call writes. */
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    size_t i;
+    for (i = 0; i < sizeof(benchmarks) / sizeof(*benchmarks); i++) {
+        void (*func)(void) = benchmarks[i].func;
+        unsigned long j;
+
+        /* Warm up (resolve symbols, fill caches). */
+        for (j = 0; j < iterations / 10; j++) {
+            func();
+        }
+
+        long syscalls = write_syscalls();
+        double start = now();
+        for (j = 0; j < iterations; j++) {
+            func();
+        }
+        double end = now();
+        long syscalls_end = write_syscalls();
+
+        fprintf(results, "%s\t%s\t%s\t%s\t%.1f\t",
+                benchmarks[i].name, target, preload, tracked,
+                (end - start) / (double)iterations);
+        if (syscalls >= 0 && syscalls_end >= syscalls) {
+            fprintf(results, "%.2f\n",
+                    (double)(syscalls_end - syscalls) / (double)iterations);
+        } else {
+            fprintf(results, "-\n");
+        }
+    }
+
+    return fclose(results) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/* Environment of the measured process: ours without settings of the library
+ * (and its 'LD_PRELOAD'), plus the given entries. */
+static char **child_environment(char const *preload, char const *fds) {
+    extern char **environ;
+    size_t count = 0;
+    char **x;
+
+    for (x = environ; *x; x++) {
+        count++;
+    }
+    char **env = malloc((count + 3) * sizeof(*env));
+    if (!env) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    count = 0;
+    for (x = environ; *x; x++) {
+        if (!strncmp(*x, "LD_PRELOAD=", strlen("LD_PRELOAD="))
+                || !strncmp(*x, "COLORED_STDERR_",
+                            strlen("COLORED_STDERR_"))) {
+            continue;
+        }
+        env[count++] = *x;
+    }
+    if (preload) {
+        env[count++] = (char *)preload;
+        env[count++] = (char *)fds;
+    }
+    env[count] = NULL;
+    return env;
+}
+
+/* Open the target, returns the descriptor for the measured process. *drain
+ * is set to a descriptor which must be read until the process exits (-1 if
+ * none). */
+static int open_target(enum target target, int *drain) {
+    int fd = -1;
+
+    *drain = -1;
+    switch (target) {
+        case TARGET_PTY:
+#ifdef HAVE_OPENPTY
+            if (openpty(drain, &fd, NULL, NULL, NULL) == -1) {
+                perror("openpty");
+                exit(EXIT_FAILURE);
+            }
+            fcntl(*drain, F_SETFD, FD_CLOEXEC);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+            break;
+        case TARGET_FILE:
+            fd = open(FILE_TARGET, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      0600);
+            break;
+        case TARGET_DEVNULL:
+            fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+            break;
+    }
+    if (fd == -1) {
+        perror(target_names[target]);
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+/* Run the benchmarks in a new process for the given combination. */
+static void run_child(char const *argv0, enum target target,
+                      char const *preload, int tracked,
+                      char const *iterations) {
+    int drain;
+    int fd = open_target(target, &drain);
+
+    char **env = child_environment(preload,
+                                   tracked ? FDS_TRACKED : FDS_UNTRACKED);
+    char *argv[] = {
+        (char *)argv0, (char *)"--run", (char *)target_names[target],
+        (char *)(preload ? "1" : "0"), (char *)(tracked ? "1" : "0"),
+        (char *)iterations, NULL,
+    };
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    } else if (pid == 0) {
+        /* The target may use RESULT_FD, move stdout away first. */
+        int result = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, RESULT_FD + 1);
+        if (result == -1
+                || dup2(fd, STDOUT_FILENO) == -1
+                || dup2(fd, STDERR_FILENO) == -1
+                || dup2(result, RESULT_FD) == -1) {
+            _exit(EXIT_FAILURE);
+        }
+        execve(argv0, argv, env);
+        _exit(EXIT_FAILURE);
+    }
+    free(env);
+
+    close(fd);
+    if (drain != -1) {
+        /* Read the output so writes to the terminal don't block. Fails with
+         * EIO once the process has exited. */
+        char buffer[4096];
+        while (read(drain, buffer, sizeof(buffer)) > 0 || errno == EINTR) {
+        }
+        close(drain);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+        perror("waitpid");
+        exit(EXIT_FAILURE);
+    }
+    if (target == TARGET_FILE) {
+        unlink(FILE_TARGET);
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        fprintf(stderr, "benchmark failed: %s %s %s\n",
+                argv[2], argv[3], argv[4]);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void print_header(unsigned long iterations) {
+    printf("# iterations: %lu\n", iterations);
+    printf("# function\ttarget\tpreload\ttracked\tns_per_call"
+           "\twrite_syscalls_per_call\n");
+}
+
+
+int main(int argc, char **argv) {
+    if (argc == 6 && !strcmp(argv[1], "--run")) {
+        return run(argv[2], argv[3], argv[4], strtoul(argv[5], NULL, 10));
+    }
+
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "usage: %s <library> [<iterations>]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (getenv("LD_PRELOAD")) {
+        fprintf(stderr, "%s: run without LD_PRELOAD\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    unsigned long iterations = DEFAULT_ITERATIONS;
+    if (argc == 3) {
+        iterations = strtoul(argv[2], NULL, 10);
+        if (iterations == 0) {
+            fprintf(stderr, "%s: invalid iterations: %s\n", argv[0], argv[2]);
+            return EXIT_FAILURE;
+        }
+    }
+    char iterations_string[32];
+    snprintf(iterations_string, sizeof(iterations_string), "%lu", iterations);
+
+    /* 'LD_PRELOAD' entry for the measured process. */
+    char *preload = malloc(strlen("LD_PRELOAD=") + strlen(argv[1]) + 1);
+    if (!preload) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    strcpy(preload, "LD_PRELOAD=");
+    strcat(preload, argv[1]);
+
+    print_header(iterations);
+
+    int target;
+    for (target = 0; target <= TARGET_DEVNULL; target++) {
+#ifndef HAVE_OPENPTY
+        if (target == TARGET_PTY) {
+            fprintf(stderr, "%s: openpty() not available, skipping pty\n",
+                    argv[0]);
+            continue;
+        }
+#endif
+        run_child(argv[0], (enum target)target, NULL, 0, iterations_string);
+        run_child(argv[0], (enum target)target, preload, 0, iterations_string);
+        run_child(argv[0], (enum target)target, preload, 1, iterations_string);
+    }
+
+    free(preload);
+    return EXIT_SUCCESS;
+}
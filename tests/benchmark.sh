@@ -0,0 +1,26 @@
+#!/bin/sh
+
+# Run the microbenchmarks (see benchmark.c), used by `make bench`.
+
+# Copyright (C) 2013-2018  Simon Ruderich
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+test "x$srcdir" = x && srcdir=.
+. "$srcdir/lib.sh"
+
+test "x$BENCH_ITERATIONS" = x && BENCH_ITERATIONS=20000
+
+"$builddir/benchmark" "$library" "$BENCH_ITERATIONS"
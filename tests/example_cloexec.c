@@ -0,0 +1,120 @@
+/*
+ * Test descriptors with close-on-exec flag.
+ *
+ * Copyright (C) 2013-2018  Simon Ruderich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#define _GNU_SOURCE /* for dup3() */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "example.h"
+
+
+/* Print the tracked descriptors passed to a child process. */
+static void print_fds(char const *argv0) {
+    pid_t pid;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    } else if (pid == 0) {
+        execl(argv0, argv0, "exec", NULL);
+        _exit(EXIT_FAILURE);
+    }
+    if (waitpid(pid, NULL, 0) == -1) {
+        perror("waitpid");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void xfcntl(int fd, int cmd, int arg) {
+    if (fcntl(fd, cmd, arg) == -1) {
+        perror("fcntl");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+int main(int argc, char **argv) {
+    pid_t pid;
+
+    /* Executed by the child. */
+    if (argc > 1) {
+        char const *fds = getenv("COLORED_STDERR_PRIVATE_FDS");
+        printf("COLORED_STDERR_PRIVATE_FDS=%s\n", fds ? fds : "(unset)");
+        return EXIT_SUCCESS;
+    }
+
+    /* 4, 5 and 301 are closed by exec*(). */
+    xdup2(STDERR_FILENO, 3);
+    if (dup3(STDERR_FILENO, 4, O_CLOEXEC) != 4) {
+        perror("dup3");
+        return EXIT_FAILURE;
+    }
+    if (fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 5) != 5) {
+        perror("fcntl");
+        return EXIT_FAILURE;
+    }
+    if (fcntl(STDERR_FILENO, F_DUPFD, 300) != 300) {
+        perror("fcntl");
+        return EXIT_FAILURE;
+    }
+    xdup2(STDERR_FILENO, 301);
+    xfcntl(301, F_SETFD, FD_CLOEXEC);
+    print_fds(argv[0]);
+
+    /* But they are still colored. */
+    xwrite(4, "4\n", 2);
+    xwrite(5, "5\n", 2);
+    xwrite(301, "301\n", 4);
+
+    /* The flag is cleared by F_SETFD and dup2(), set again for 3. */
+    xfcntl(4, F_SETFD, 0);
+    xdup2(STDERR_FILENO, 5);
+    xfcntl(3, F_SETFD, FD_CLOEXEC);
+    xfcntl(301, F_SETFD, 0);
+    print_fds(argv[0]);
+
+    /* dup2() to the same descriptor keeps the flag. */
+    xdup2(3, 3);
+    print_fds(argv[0]);
+
+    /* Changes by the child don't affect us. */
+    pid = vfork();
+    if (pid == 0) {
+        fcntl(3, F_SETFD, 0);
+        fcntl(300, F_SETFD, FD_CLOEXEC);
+        dup3(STDERR_FILENO, 6, O_CLOEXEC);
+        execl(argv[0], argv[0], "exec", NULL);
+        _exit(EXIT_FAILURE);
+    }
+    if (waitpid(pid, NULL, 0) == -1) {
+        perror("waitpid");
+        return EXIT_FAILURE;
+    }
+    print_fds(argv[0]);
+
+    return EXIT_SUCCESS;
+}
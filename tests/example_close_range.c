@@ -0,0 +1,110 @@
+/*
+ * Test close_range() and closefrom().
+ *
+ * Copyright (C) 2013-2018  Simon Ruderich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#define _GNU_SOURCE /* for close_range() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "example.h"
+
+
+#ifndef CLOSE_RANGE_CLOEXEC
+# define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+
+/* Print the tracked descriptors passed to a child process. */
+static void print_fds(char const *argv0) {
+    pid_t pid;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    } else if (pid == 0) {
+        execl(argv0, argv0, "exec", NULL);
+        _exit(EXIT_FAILURE);
+    }
+    if (waitpid(pid, NULL, 0) == -1) {
+        perror("waitpid");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+int main(int argc, char **argv) {
+    pid_t pid;
+
+    /* Executed by the child. */
+    if (argc > 1) {
+        char const *fds = getenv("COLORED_STDERR_PRIVATE_FDS");
+        printf("COLORED_STDERR_PRIVATE_FDS=%s\n", fds ? fds : "(unset)");
+        return EXIT_SUCCESS;
+    }
+
+    /* Across bitmap words and the leaves. */
+    xdup2(STDERR_FILENO, 3);
+    xdup2(STDERR_FILENO, 4);
+    xdup2(STDERR_FILENO, 63);
+    xdup2(STDERR_FILENO, 64);
+    xdup2(STDERR_FILENO, 300);
+    xdup2(STDERR_FILENO, 301);
+    xdup2(STDERR_FILENO, 700);
+    print_fds(argv[0]);
+
+    /* 3, 301 and 700 stay open. */
+    if (close_range(4, 300, 0) != 0) {
+        perror("close_range");
+        return EXIT_FAILURE;
+    }
+    print_fds(argv[0]);
+    xwrite(3, "3\n", 2);
+    xwrite(301, "301\n", 4);
+
+    /* Not closed, but not passed to new programs. */
+    if (close_range(301, 700, CLOSE_RANGE_CLOEXEC) != 0) {
+        perror("close_range");
+        return EXIT_FAILURE;
+    }
+    print_fds(argv[0]);
+
+    closefrom(4);
+    print_fds(argv[0]);
+
+    /* The child closes only its descriptors. */
+    pid = vfork();
+    if (pid == 0) {
+        close_range(3, ~0U, 0);
+        execl(argv[0], argv[0], "exec", NULL);
+        _exit(EXIT_FAILURE);
+    }
+    if (waitpid(pid, NULL, 0) == -1) {
+        perror("waitpid");
+        return EXIT_FAILURE;
+    }
+    print_fds(argv[0]);
+    xwrite(3, "3\n", 2);
+
+    return EXIT_SUCCESS;
+}
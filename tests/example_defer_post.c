@@ -0,0 +1,92 @@
+/*
+ * Test deferring the post string until other output needs it.
+ *
+ * Copyright (C) 2013-2018  Simon Ruderich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "example.h"
+#include "../src/compiler.h"
+
+
+/* Written to stdout which isn't tracked, must never be colored. */
+static void MARKER(void) {
+    xwrite(STDOUT_FILENO, "|", 1);
+}
+
+
+int main(void) {
+    pid_t pid;
+    char c;
+    int fd, saved;
+
+    /* Continuous output of the same descriptor. */
+    xwrite(STDERR_FILENO, "write()\n", 8);
+    fputs("fputs()\n", stderr);
+    fprintf(stderr, "%s\n", "fprintf()");
+    MARKER();
+    xwrite(STDOUT_FILENO, "\n", 1);
+
+    /* Reading input. */
+    fd = open("/dev/null", O_RDWR);
+    if (fd == -1) {
+        perror("open");
+        return EXIT_FAILURE;
+    }
+    xwrite(STDERR_FILENO, "read()\n", 7);
+    if (read(fd, &c, 1) != 0) {
+        return EXIT_FAILURE;
+    }
+    MARKER();
+    xwrite(STDERR_FILENO, "\n", 1);
+
+    /* Replacing the descriptor, the post string must not get lost. */
+    saved = dup(STDERR_FILENO);
+    if (saved == -1) {
+        perror("dup");
+        return EXIT_FAILURE;
+    }
+    xwrite(STDERR_FILENO, "dup2()", 6);
+    xdup2(fd, STDERR_FILENO);
+    xwrite(STDERR_FILENO, "discarded", 9);
+    xdup2(saved, STDERR_FILENO);
+    MARKER();
+    xwrite(STDERR_FILENO, "\n", 1);
+    close(saved);
+    close(fd);
+
+    /* fork() */
+    xwrite(STDERR_FILENO, "fork()", 6);
+    FORKED_TEST(pid) {
+        xwrite(STDERR_FILENO, "child", 5);
+        /* Reset at exit. */
+        exit(EXIT_SUCCESS);
+    }
+    MARKER();
+    xwrite(STDERR_FILENO, "\n", 1);
+
+    /* _exit() */
+    xwrite(STDERR_FILENO, "_exit()", 7);
+    _exit(EXIT_SUCCESS);
+}
@@ -23,6 +23,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -44,6 +45,24 @@ int main(int argc unused, char **argv unused) {
     warn("warning: %s", "message");
     warnx("warning: %s", "message");
 
+    errno = ENOMEM;
+    warn(NULL);
+    warnx(NULL);
+
+    /* Longer than the buffer used to write the message at once. */
+    char message[1500];
+    memset(message, 'x', sizeof(message) - 1);
+    message[sizeof(message) - 1] = '\0';
+    errno = ENOMEM;
+    warn("%s", message);
+
+    errno = ENOMEM;
+    perror("perror");
+    errno = ENOMEM;
+    perror("");
+    errno = ENOMEM;
+    perror(NULL);
+
     /* v*() functions are implicitly tested - the implementation uses them. */
 
     printf("\n");
@@ -333,13 +333,13 @@ int main(int argc unused, char **argv) {
     /* Fake output to let the test pass. */
     } else if (!skip--) {
         puts("argv[0] = |./example_exec|");
-        puts("environ[0] = |COLORED_STDERR_PRIVATE_FDS=2,|");
+        puts("environ[0] = |COLORED_STDERR_PRIVATE_FDS=@1E|");
         puts("environ[1] = |TEST=54|");
         puts("");
         puts("argv[0] = |./example_exec|");
         puts("argv[1] = |foo|");
         puts("argv[2] = |bar|");
-        puts("environ[0] = |COLORED_STDERR_PRIVATE_FDS=2,|");
+        puts("environ[0] = |COLORED_STDERR_PRIVATE_FDS=@1E|");
         puts("environ[1] = |TEST=55|");
         puts("");
 #endif
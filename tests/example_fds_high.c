@@ -0,0 +1,144 @@
+/*
+ * Test tracking of descriptors >= TRACKFDS_STATIC_COUNT.
+ *
+ * Copyright (C) 2013-2018  Simon Ruderich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "example.h"
+
+
+/* More ranges than preallocated leaves (TRACKFDS_ARENA_LEAVES), each leaf
+ * stores 4096 descriptors (TRACKFDS_LEAF_COUNT). Fewer if RLIMIT_NOFILE
+ * doesn't permit that many descriptors, then the ranges are reused. */
+#define RANGES 100
+#define FD(range) (256 + (range) * 4096 + (range))
+
+/* Execute a child which writes writes times to the count descriptors fds. */
+static void run(char *argv0, int writes, int count, int *fds) {
+    char buffer[count + 1][16];
+    char *args[count + 4];
+    pid_t pid;
+    int i;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    } else if (pid == 0) {
+        args[0] = argv0;
+        args[1] = (char *)"child";
+        for (i = 0; i <= count; i++) {
+            snprintf(buffer[i], sizeof(buffer[i]), "%d",
+                     i == 0 ? writes : fds[i - 1]);
+            args[i + 2] = buffer[i];
+        }
+        args[count + 3] = NULL;
+        execv(argv0, args);
+        _exit(EXIT_FAILURE);
+    }
+    if (waitpid(pid, NULL, 0) == -1) {
+        perror("waitpid");
+        exit(EXIT_FAILURE);
+    }
+    xwrite(STDOUT_FILENO, "\n", 1);
+}
+
+
+int main(int argc, char **argv) {
+    struct rlimit limit;
+    int fds[RANGES];
+    int ranges;
+    int i;
+
+    /* Executed by the child, the inherited descriptors must be tracked. */
+    if (argc > 3 && !strcmp(argv[1], "child")) {
+        for (i = 0; i < atoi(argv[2]); i++) {
+            xwrite(atoi(argv[3 + i % (argc - 3)]), ".", 1);
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        perror("getrlimit");
+        return EXIT_FAILURE;
+    }
+    if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur <= FD(RANGES)) {
+        limit.rlim_cur = FD(RANGES) + 1;
+        if (limit.rlim_max != RLIM_INFINITY
+                && limit.rlim_max < limit.rlim_cur) {
+            limit.rlim_max = limit.rlim_cur;
+        }
+        /* Raising the hard limit is not permitted, use what we have. */
+        if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+            if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+                perror("getrlimit");
+                return EXIT_FAILURE;
+            }
+            limit.rlim_cur = limit.rlim_max;
+            if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+                perror("setrlimit");
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    for (ranges = 0; ranges < RANGES
+                     && (limit.rlim_cur == RLIM_INFINITY
+                         || (rlim_t)FD(ranges) < limit.rlim_cur); ranges++) {
+    }
+    if (limit.rlim_cur <= 1000) {
+        fprintf(stderr, "RLIMIT_NOFILE too small\n");
+        return EXIT_FAILURE;
+    }
+
+    /* Descriptors >= TRACKFDS_STATIC_COUNT are passed to child processes. */
+    fds[0] = xdup2(STDERR_FILENO, 1000);
+    fds[1] = xdup2(STDERR_FILENO, limit.rlim_cur > 70000
+                                  ? 70000 : (int)limit.rlim_cur - 1);
+    run(argv[0], 2, 2, fds);
+    close(fds[0]);
+    close(fds[1]);
+
+    /* Leaves of closed descriptors are freed and reused. */
+    for (i = 0; i < RANGES; i++) {
+        xdup2(STDERR_FILENO, FD(i % ranges));
+        xwrite(FD(i % ranges), ".", 1);
+        close(FD(i % ranges));
+    }
+    xwrite(STDOUT_FILENO, "\n", 1);
+
+    /* Many leaves (if permitted more than preallocated ones) are used at the
+     * same time. */
+    for (i = 0; i < ranges; i++) {
+        fds[i] = xdup2(STDERR_FILENO, FD(i));
+    }
+    run(argv[0], RANGES, ranges, fds);
+    for (i = 0; i < ranges; i++) {
+        close(fds[i]);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,120 @@
+/*
+ * Test freopen() on stderr connected to a terminal.
+ *
+ * Copyright (C) 2013-2018  Simon Ruderich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if defined(HAVE_PTY_H)
+# include <pty.h>
+#elif defined(HAVE_UTIL_H)
+# include <util.h>
+#elif defined(HAVE_LIBUTIL_H)
+# include <libutil.h>
+#endif
+
+#include "example.h"
+
+
+#define LOG_FILE "example_freopen.log"
+
+/* Print data written to the terminal, without the \r added by the terminal
+ * (ONLCR). */
+static void print_terminal(int fd) {
+    char buffer[4096];
+    ssize_t size, i;
+
+    while ((size = read(fd, buffer, sizeof(buffer))) > 0) {
+        for (i = 0; i < size; i++) {
+            if (buffer[i] != '\r') {
+                putchar(buffer[i]);
+            }
+        }
+    }
+}
+
+static void print_file(char const *path) {
+    FILE *fp = fopen(path, "r");
+    int c;
+
+    if (!fp) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+    while ((c = getc(fp)) != EOF) {
+        putchar(c);
+    }
+    fclose(fp);
+}
+
+
+int main(int argc, char **argv) {
+    int master, slave;
+    pid_t pid;
+
+    /* Executed by the child, stderr is the terminal. */
+    if (argc > 1) {
+        fputs("terminal\n", stderr);
+
+        if (!freopen(LOG_FILE, "w", stderr)) {
+            return EXIT_FAILURE;
+        }
+        /* Not a terminal anymore, not colored. */
+        fputs("file\n", stderr);
+        xwrite(STDERR_FILENO, "write\n", 6);
+        fclose(stderr);
+        return EXIT_SUCCESS;
+    }
+
+    if (openpty(&master, &slave, NULL, NULL, NULL) == -1) {
+        perror("openpty");
+        return EXIT_FAILURE;
+    }
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return EXIT_FAILURE;
+    } else if (pid == 0) {
+        /* The dup2() untracks stderr, track it again in the child. */
+        xdup2(slave, STDERR_FILENO);
+        setenv("COLORED_STDERR_FDS", "2,", 1);
+        execl(argv[0], argv[0], "child", NULL);
+        _exit(EXIT_FAILURE);
+    }
+    close(slave);
+
+    if (waitpid(pid, NULL, 0) == -1) {
+        perror("waitpid");
+        return EXIT_FAILURE;
+    }
+    printf("terminal:\n");
+    print_terminal(master);
+    printf("%s:\n", LOG_FILE);
+    print_file(LOG_FILE);
+    unlink(LOG_FILE);
+
+    return EXIT_SUCCESS;
+}
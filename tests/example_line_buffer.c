@@ -0,0 +1,97 @@
+/*
+ * Test collecting single characters in the line buffer.
+ *
+ * Copyright (C) 2013-2018  Simon Ruderich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "example.h"
+#include "../src/compiler.h"
+
+
+/* Written to stdout which isn't tracked, shows when the line buffer is
+ * flushed. */
+static void MARKER(void) {
+    xwrite(STDOUT_FILENO, "|", 1);
+}
+
+
+int main(void) {
+    pid_t pid;
+    char c;
+    int fd, i;
+
+    /* Written together at the end of the line. */
+    fputc('a', stderr);
+    putc('b', stderr);
+    MARKER();
+    fputc('\n', stderr);
+
+    /* Other output of this thread flushes the line buffer first. */
+    putc('c', stderr);
+    fputs("fputs()\n", stderr);
+    putc('d', stderr);
+    xwrite(STDERR_FILENO, "write()\n", 8);
+
+    /* fflush() */
+    putc('e', stderr);
+    fflush(stderr);
+    MARKER();
+    putc('\n', stderr);
+
+    /* Reading input. */
+    fd = open("/dev/null", O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        return EXIT_FAILURE;
+    }
+    putc('f', stderr);
+    if (read(fd, &c, 1) != 0) {
+        return EXIT_FAILURE;
+    }
+    MARKER();
+    putc('\n', stderr);
+    close(fd);
+
+    /* Full buffer. */
+    for (i = 0; i < 600; i++) {
+        putc('0' + i % 10, stderr);
+    }
+    MARKER();
+    putc('\n', stderr);
+
+    /* fork(), the child must not write the line of the parent again. */
+    putc('g', stderr);
+    FORKED_TEST(pid) {
+        putc('h', stderr);
+        /* Flushed at exit. */
+        exit(EXIT_SUCCESS);
+    }
+    MARKER();
+    putc('\n', stderr);
+
+    /* _exit() */
+    putc('i', stderr);
+    _exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,98 @@
+/*
+ * Test merging colored regions in the buffer of buffered streams.
+ *
+ * Copyright (C) 2013-2018  Simon Ruderich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "example.h"
+#include "../src/compiler.h"
+
+
+static char buffer[64];
+
+
+int main(void) {
+    int i, out;
+
+    out = dup(STDOUT_FILENO);
+    if (out == -1) {
+        perror("dup");
+        return EXIT_FAILURE;
+    }
+    /* Fully buffered stream writing to a tracked descriptor. */
+    xdup2(STDERR_FILENO, STDOUT_FILENO);
+    setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+
+    /* Continuous calls share a single pre/post string. */
+    fputs("fputs()", stdout);
+    putc(' ', stdout);
+    printf("%s", "printf()");
+    puts("");
+    fflush(stdout);
+    xwrite(out, "|\n", 2);
+
+    /* Data written without a hooked function (putc_unlocked() is a macro in
+     * glibc) in between is not colored, see example_stdio.c. */
+    fputs("a", stdout);
+    putc_unlocked('b', stdout);
+    fputs("c\n", stdout);
+    fflush(stdout);
+    xwrite(out, "|\n", 2);
+
+    /* Flushing in between. */
+    fputs("d", stdout);
+    fflush(stdout);
+    xwrite(out, "|", 1);
+    fputs("e\n", stdout);
+    fflush(stdout);
+    xwrite(out, "|\n", 2);
+
+    /* Output to stderr in between. */
+    fputs("f", stdout);
+    fflush(stdout);
+    fputs("g", stderr);
+    fputs("h\n", stdout);
+    fflush(stdout);
+    xwrite(out, "|\n", 2);
+
+    /* Mixing fwrite() and fputc(). */
+    fwrite("k", 1, 1, stdout);
+    fputc('l', stdout);
+    fwrite("mn", 1, 2, stdout);
+    fputc('o', stdout);
+    fwrite("\n", 1, 1, stdout);
+    fflush(stdout);
+    xwrite(out, "|\n", 2);
+
+    /* More than the buffer. */
+    for (i = 0; i < 100; i++) {
+        putc('0' + i % 10, stdout);
+    }
+    putc('\n', stdout);
+    fflush(stdout);
+    xwrite(out, "|\n", 2);
+
+    /* Flushed at exit. */
+    fputs("i", stdout);
+    fputs("j\n", stdout);
+    return EXIT_SUCCESS;
+}
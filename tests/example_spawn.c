@@ -0,0 +1,362 @@
+/*
+ * Test posix_spawn(), posix_spawnp(), system() and popen().
+ *
+ * Copyright (C) 2013-2018  Simon Ruderich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#ifdef HAVE_PTHREAD_CLEANUP_PUSH
+# include <pthread.h>
+#endif
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "example.h"
+#include "../src/compiler.h"
+
+
+extern char **environ;
+
+
+/* Print the tracked descriptors and write to each descriptor in argv. */
+static int child(char **argv) {
+    char const *fds = getenv("COLORED_STDERR_PRIVATE_FDS");
+    printf("COLORED_STDERR_PRIVATE_FDS=%s\n", fds ? fds : "(unset)");
+    fflush(stdout);
+
+    while (*argv) {
+        int fd = atoi(*argv++);
+
+        char buffer[32];
+        int length = snprintf(buffer, sizeof(buffer), "fd %d\n", fd);
+        xwrite(fd, buffer, (size_t)length);
+    }
+    return EXIT_SUCCESS;
+}
+
+static void xwait(pid_t pid) {
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+        perror("waitpid");
+        exit(EXIT_FAILURE);
+    }
+    fflush(stdout);
+}
+static void spawn(posix_spawn_file_actions_t const *file_actions,
+                  char *argv[], char *envp[], int path) {
+    pid_t pid;
+
+    int result;
+    if (path) {
+        result = posix_spawnp(&pid, argv[0], file_actions, NULL, argv, envp);
+    } else {
+        result = posix_spawn(&pid, argv[0], file_actions, NULL, argv, envp);
+    }
+    if (result != 0) {
+        fprintf(stderr, "posix_spawn: %s\n", strerror(result));
+        exit(EXIT_FAILURE);
+    }
+    xwait(pid);
+}
+
+static volatile sig_atomic_t sigint_received;
+static void sigint_handler(int signal) {
+    (void)signal;
+    sigint_received = 1;
+}
+static void print_sigint(char const *name) {
+    struct sigaction action;
+    if (sigaction(SIGINT, NULL, &action) == -1) {
+        perror("sigaction");
+        exit(EXIT_FAILURE);
+    }
+    printf("%s: SIGINT %s, handler %s\n", name,
+           sigint_received ? "received" : "ignored",
+           action.sa_handler == sigint_handler ? "restored" : "lost");
+    sigint_received = 0;
+}
+
+#ifdef HAVE_PTHREAD_CLEANUP_PUSH
+static int system_pipe[2];
+static void *system_thread(void *arg) {
+    char command[64];
+    /* Tell the main thread the shell is running. */
+    sprintf(command, "echo >&%d; exec sleep 10", system_pipe[1]);
+    system(command);
+    return arg;
+}
+#endif
+
+
+int main(int argc, char **argv) {
+    if (argc > 1 && !strcmp(argv[1], "child")) {
+        return child(argv + 2);
+    }
+
+    char ldpreload[strlen("LD_PRELOAD=") + strlen(getenv("LD_PRELOAD")) + 1];
+    strcpy(ldpreload, "LD_PRELOAD=");
+    strcat(ldpreload, getenv("LD_PRELOAD"));
+
+    posix_spawn_file_actions_t actions;
+
+    /* Without file actions. */
+    {
+        char *args[] = { argv[0], "child", "2", NULL };
+        spawn(NULL, args, environ, 0);
+    }
+
+    /* Duplicating a tracked descriptor. */
+    {
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, 2, 5);
+
+        char *args[] = { argv[0], "child", "2", "5", NULL };
+        spawn(&actions, args, environ, 0);
+
+        posix_spawn_file_actions_destroy(&actions);
+    }
+
+    /* Overwriting a tracked descriptor. */
+    {
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, 1, 2);
+
+        char *args[] = { argv[0], "child", "2", NULL };
+        spawn(&actions, args, environ, 0);
+
+        posix_spawn_file_actions_destroy(&actions);
+    }
+
+    /* Opening and closing tracked descriptors; the actions are applied in
+     * order. */
+    {
+        xdup2(2, 6);
+
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_addopen(&actions, 6, "/dev/null", O_WRONLY, 0);
+        posix_spawn_file_actions_adddup2(&actions, 6, 7);
+        posix_spawn_file_actions_adddup2(&actions, 2, 8);
+        posix_spawn_file_actions_addclose(&actions, 2);
+
+        char *args[] = { argv[0], "child", "6", "7", "8", NULL };
+        spawn(&actions, args, environ, 0);
+
+        posix_spawn_file_actions_destroy(&actions);
+        close(6);
+    }
+
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+    {
+        xdup2(2, 3);
+        xdup2(2, 9);
+
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, 3, 4);
+        posix_spawn_file_actions_addclosefrom_np(&actions, 5);
+
+        char *args[] = { argv[0], "child", "3", "4", NULL };
+        spawn(&actions, args, environ, 0);
+
+        posix_spawn_file_actions_destroy(&actions);
+        close(3);
+        close(9);
+    }
+#else
+    /* Fake output to let the test pass. */
+    puts("COLORED_STDERR_PRIVATE_FDS=@1c");
+    fflush(stdout);
+    xwrite(2, "fd 3\n", 5);
+    xwrite(2, "fd 4\n", 5);
+#endif
+
+    /* Descriptors >= 256 are encoded differently. */
+    {
+        xdup2(2, 300);
+
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, 2, 1000);
+
+        char *args[] = { argv[0], "child", "300", "1000", NULL };
+        spawn(&actions, args, environ, 0);
+
+        posix_spawn_file_actions_destroy(&actions);
+        close(300);
+    }
+
+    /* Duplicating a descriptor to itself clears the close-on-exec flag
+     * (glibc >= 2.29). */
+    {
+        xdup2(2, 10);
+        if (fcntl(10, F_SETFD, FD_CLOEXEC) == -1) {
+            perror("fcntl");
+            return EXIT_FAILURE;
+        }
+
+#if !defined(__GLIBC__) || __GLIBC__ > 2 \
+        || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29)
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, 10, 10);
+
+        char *args[] = { argv[0], "child", "10", NULL };
+        spawn(&actions, args, environ, 0);
+
+        posix_spawn_file_actions_destroy(&actions);
+#else
+        /* Fake output to let the test pass. */
+        puts("COLORED_STDERR_PRIVATE_FDS=@1EQ");
+        fflush(stdout);
+        xwrite(2, "fd 10\n", 6);
+#endif
+        close(10);
+    }
+
+    /* With a custom environment. */
+    {
+        char *args[] = { argv[0], "child", NULL };
+        char *envp[] = { ldpreload, "COLORED_STDERR_PRIVATE_FDS=5,", NULL };
+        spawn(NULL, args, envp, 1);
+    }
+
+    /* system() and popen() use the normal environment, but don't modify
+     * it. */
+    {
+        char const *fds = getenv("COLORED_STDERR_PRIVATE_FDS");
+        char old_fds[strlen(fds) + 1];
+        strcpy(old_fds, fds);
+
+        xdup2(2, 7);
+
+        char command[strlen(argv[0]) + 32];
+        sprintf(command, "%s child 2 7", argv[0]);
+        system(command);
+        fflush(stdout);
+
+        close(7);
+
+        fds = getenv("COLORED_STDERR_PRIVATE_FDS");
+        printf("environ %s\n",
+               fds && !strcmp(fds, old_fds) ? "unchanged" : "changed");
+    }
+    {
+        xdup2(2, 0);
+
+        char command[strlen(argv[0]) + 32];
+        sprintf(command, "%s child 2", argv[0]);
+        FILE *fp = popen(command, "w");
+        if (!fp) {
+            perror("popen");
+            return EXIT_FAILURE;
+        }
+        pclose(fp);
+        fflush(stdout);
+    }
+    {
+        char command[strlen(argv[0]) + 32];
+        sprintf(command, "%s child 2", argv[0]);
+        FILE *fp = popen(command, "r");
+        if (!fp) {
+            perror("popen");
+            return EXIT_FAILURE;
+        }
+        char buffer[128];
+        while (fgets(buffer, sizeof(buffer), fp)) {
+            printf("popen: %s", buffer);
+        }
+        printf("pclose: %d\n", pclose(fp));
+    }
+
+    /* SIGINT and SIGQUIT are ignored while system() runs (the shell sends
+     * SIGINT to us) and restored afterwards. */
+    {
+        signal(SIGINT, sigint_handler);
+        system("kill -INT $PPID");
+        print_sigint("system");
+    }
+    /* Also if the thread is cancelled while waiting for the shell: it's
+     * killed and reaped. */
+    {
+#ifdef HAVE_PTHREAD_CLEANUP_PUSH
+        pthread_t thread;
+        void *result;
+        char buffer[1];
+
+        if (pipe(system_pipe) == -1) {
+            perror("pipe");
+            return EXIT_FAILURE;
+        }
+        if (pthread_create(&thread, NULL, system_thread, NULL)) {
+            fprintf(stderr, "pthread_create failed\n");
+            return EXIT_FAILURE;
+        }
+        if (read(system_pipe[0], buffer, sizeof(buffer)) != 1) {
+            perror("read");
+            return EXIT_FAILURE;
+        }
+        pthread_cancel(thread);
+        pthread_join(thread, &result);
+        close(system_pipe[0]);
+        close(system_pipe[1]);
+
+        printf("system cancelled: %s, child %s\n",
+               result == PTHREAD_CANCELED ? "yes" : "no",
+               waitpid(-1, NULL, WNOHANG) == -1 ? "reaped" : "running");
+        print_sigint("system cancelled");
+#else
+        /* Fake output to let the test pass. */
+        printf("system cancelled: yes, child reaped\n");
+        printf("system cancelled: SIGINT ignored, handler restored\n");
+#endif
+    }
+
+    /* pclose() of a stream not returned by our popen() (here the libc's
+     * popen()) is passed to the libc. */
+    {
+#ifdef __GLIBC__
+        void *libc = dlopen("libc.so.6", RTLD_LAZY | RTLD_NOLOAD);
+        FILE *(*libc_popen)(char const *, char const *) = NULL;
+        if (libc) {
+            libc_popen = (FILE *(*)(char const *, char const *))
+                         dlsym(libc, "popen");
+        }
+        if (!libc_popen) {
+            fprintf(stderr, "dlsym: %s\n", dlerror());
+            return EXIT_FAILURE;
+        }
+        FILE *fp = libc_popen("exit 3", "r");
+        if (!fp) {
+            perror("popen");
+            return EXIT_FAILURE;
+        }
+        int status = pclose(fp);
+        printf("pclose (libc popen): %d\n",
+               WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+#else
+        /* Fake output to let the test pass. */
+        printf("pclose (libc popen): 3\n");
+#endif
+    }
+
+    printf("Done.\n");
+    return EXIT_SUCCESS;
+}
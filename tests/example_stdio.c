@@ -25,6 +25,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <string.h>
+#include <sys/uio.h>
 
 #include "example.h"
 #include "../src/compiler.h"
@@ -46,12 +48,21 @@ static int fputc_unlocked(int c, FILE *stream) {
     return fputc(c, stream);
 }
 #endif
+/* Linux-specific. */
+#ifndef HAVE_PWRITEV2
+static ssize_t pwritev2(int fd, struct iovec const *iov, int iovcnt,
+                        off_t offset unused, int flags unused) {
+    return writev(fd, iov, iovcnt);
+}
+#endif
 
 
 static int out;
+static struct iovec iov[32];
 
 static void test_vprintf(char const *format, ...) noinline;
 static void test_vfprintf(FILE *stream, char const *format, ...) noinline;
+static void test_vdprintf(int fd, char const *format, ...) noinline;
 static void NEWLINE(void) noinline;
 
 static void test_vprintf(char const *format, ...) {
@@ -69,12 +80,55 @@ static void test_vfprintf(FILE *stream, char const *format, ...) {
     va_end(ap);
 }
 
+static void test_vdprintf(int fd, char const *format, ...) {
+    va_list ap;
+
+    va_start(ap, format);
+    vdprintf(fd, format, ap);
+    va_end(ap);
+}
+
 static void NEWLINE(void) {
     fflush(stdout);
     fflush(stderr);
     xwrite(out, "\n", 1);
 }
 
+static void set_iov(size_t i, char const *s) {
+    iov[i].iov_base = (void *)s;
+    iov[i].iov_len  = strlen(s);
+}
+static void xwritev(int fd, int iovcnt, size_t count) {
+    ssize_t result = writev(fd, iov, iovcnt);
+    if (result != (ssize_t)count) {
+        perror("writev");
+        exit(EXIT_FAILURE);
+    }
+}
+static void test_writev(int fd) {
+    size_t i;
+
+    set_iov(0, "writev");
+    set_iov(1, "");
+    set_iov(2, "()");
+    xwritev(fd, 3, 8);                      NEWLINE();
+    xwritev(fd, 0, 0);
+    xwritev(fd, 1, 6); xwritev(fd, 3, 8);   NEWLINE();
+
+    /* More entries than fit in the fixed array. */
+    for (i = 0; i < sizeof(iov) / sizeof(*iov); i++) {
+        set_iov(i, i % 2 ? "-" : "+");
+    }
+    xwritev(fd, 32, 32);                    NEWLINE();
+
+    set_iov(0, "pwritev2()");
+    if (pwritev2(fd, iov, 1, -1, 0) != 10) {
+        perror("pwritev2");
+        exit(EXIT_FAILURE);
+    }
+    NEWLINE();
+}
+
 
 int main(int argc, char **argv unused) {
     /* stdout */
@@ -93,6 +147,7 @@ int main(int argc, char **argv unused) {
 
     xwrite(STDOUT_FILENO, "write()", 7); NEWLINE();
     fwrite("fwrite()", 8, 1, stdout);   NEWLINE();
+    test_writev(STDOUT_FILENO);
 
     /* puts(3) */
     fputs("fputs()", stdout); NEWLINE();
@@ -107,6 +162,12 @@ int main(int argc, char **argv unused) {
     test_vprintf("%s [%d]", "vprintf()", argc);           NEWLINE();
     test_vfprintf(stdout, "%s [%d]", "vfprintf()", argc); NEWLINE();
 
+    /* dprintf(3) */
+    dprintf(STDOUT_FILENO, "%s [%d]", "dprintf()", argc);            NEWLINE();
+    test_vdprintf(STDOUT_FILENO, "%s [%d]", "vdprintf()", argc);     NEWLINE();
+    /* Larger than the buffer. */
+    dprintf(STDOUT_FILENO, "%s%1100d", "dprintf() ", argc);          NEWLINE();
+
     /* unlocked_stdio(3) */
     fwrite_unlocked("fwrite_unlocked()", 17, 1, stdout); NEWLINE();
     fputs_unlocked("fputs_unlocked()", stdout);          NEWLINE();
@@ -120,6 +181,7 @@ int main(int argc, char **argv unused) {
 
     xwrite(STDERR_FILENO, "write()", 7); NEWLINE();
     fwrite("fwrite()", 8, 1, stderr);   NEWLINE();
+    test_writev(STDERR_FILENO);
 
     /* puts(3) */
     fputs("fputs()", stderr); NEWLINE();
@@ -130,6 +192,11 @@ int main(int argc, char **argv unused) {
     fprintf(stderr, "%s [%d]", "fprintf()", argc);        NEWLINE();
     test_vfprintf(stderr, "%s [%d]", "vfprintf()", argc); NEWLINE();
 
+    /* dprintf(3) */
+    dprintf(STDERR_FILENO, "%s [%d]", "dprintf()", argc);            NEWLINE();
+    test_vdprintf(STDERR_FILENO, "%s [%d]", "vdprintf()", argc);     NEWLINE();
+    dprintf(STDERR_FILENO, "%s%1100d", "dprintf() ", argc);          NEWLINE();
+
     /* unlocked_stdio(3) */
     fwrite_unlocked("fwrite_unlocked()", 17, 1, stderr); NEWLINE();
     fputs_unlocked("fputs_unlocked()", stderr);          NEWLINE();
@@ -0,0 +1,95 @@
+/*
+ * Test tracking descriptors changed by multiple threads.
+ *
+ * Copyright (C) 2013-2018  Simon Ruderich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "example.h"
+
+
+#define THREADS    8
+#define ITERATIONS 2000
+
+/* Each thread changes neighbouring descriptors, all in the same bitmap word
+ * (< and >= TRACKFDS_STATIC_COUNT). */
+#define FD_LOW(i)  (20 + (i))
+#define FD_HIGH(i) (300 + (i))
+
+static int null;
+
+static void *thread(void *arg) {
+    int i = (int)(size_t)arg;
+    int n;
+
+    for (n = 0; n < ITERATIONS; n++) {
+        xdup2(STDERR_FILENO, FD_LOW(i));
+        xdup2(STDERR_FILENO, FD_HIGH(i));
+        if (n % 2 == 0) {
+            close(FD_LOW(i));
+            close(FD_HIGH(i));
+        } else {
+            xdup2(null, FD_LOW(i));
+            xdup2(null, FD_HIGH(i));
+        }
+    }
+
+    /* Leave the descriptors tracked. */
+    xdup2(STDERR_FILENO, FD_LOW(i));
+    xdup2(STDERR_FILENO, FD_HIGH(i));
+    return NULL;
+}
+
+
+int main(void) {
+    pthread_t threads[THREADS];
+    size_t i;
+
+    null = open("/dev/null", O_WRONLY);
+    if (null == -1) {
+        perror("open");
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < THREADS; i++) {
+        if (pthread_create(&threads[i], NULL, thread, (void *)i)) {
+            fprintf(stderr, "pthread_create failed\n");
+            return EXIT_FAILURE;
+        }
+    }
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    /* All updates must be visible, none may be lost. */
+    for (i = 0; i < THREADS; i++) {
+        char buffer[32];
+        int length = snprintf(buffer, sizeof(buffer), "%zu\n", i);
+
+        xwrite(FD_LOW(i), buffer, (size_t)length);
+        xwrite(FD_HIGH(i), buffer, (size_t)length);
+        xwrite(STDOUT_FILENO, "\n", 1);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,104 @@
+/*
+ * Test descriptors passed to child processes while other threads change the
+ * tracked descriptors.
+ *
+ * Copyright (C) 2013-2018  Simon Ruderich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "example.h"
+
+
+#define ROUNDS 200
+
+/* Alternate between descriptors < and >= TRACKFDS_STATIC_COUNT. */
+#define FD(round) ((round) % 2 == 0 ? 20 : 300)
+
+extern char **environ;
+
+static volatile int started;
+static volatile int done;
+
+static void *thread(void *arg) {
+    int fd = (int)(size_t)arg;
+
+    while (!started) {
+    }
+    xdup2(STDERR_FILENO, fd);
+    done = 1;
+    return NULL;
+}
+
+
+int main(int argc, char **argv) {
+    char *exec_argv[] = { NULL };
+    int round;
+
+    /* Executed by the child, the descriptor must be tracked (colored). */
+    if (argc > 2 && !strcmp(argv[1], "child")) {
+        xwrite(atoi(argv[2]), "x", 1);
+        return EXIT_SUCCESS;
+    }
+
+    for (round = 0; round < ROUNDS; round++) {
+        pthread_t id;
+        pid_t pid;
+
+        started = 0;
+        done = 0;
+        if (pthread_create(&id, NULL, thread, (void *)(size_t)FD(round))) {
+            fprintf(stderr, "pthread_create failed\n");
+            return EXIT_FAILURE;
+        }
+        /* Encode the tracked descriptors for new programs (exec fails)
+         * while the thread adds one. */
+        started = 1;
+        while (!done) {
+            execve("/nonexistent/example_threads_exec", exec_argv, environ);
+        }
+        pthread_join(id, NULL);
+
+        /* The child must inherit the added descriptor. */
+        pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            return EXIT_FAILURE;
+        } else if (pid == 0) {
+            char buffer[32];
+            snprintf(buffer, sizeof(buffer), "%d", FD(round));
+            execl(argv[0], argv[0], "child", buffer, NULL);
+            _exit(EXIT_FAILURE);
+        }
+        if (waitpid(pid, NULL, 0) == -1) {
+            perror("waitpid");
+            return EXIT_FAILURE;
+        }
+
+        close(FD(round));
+    }
+
+    xwrite(STDOUT_FILENO, "\n", 1);
+    return EXIT_SUCCESS;
+}
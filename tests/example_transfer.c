@@ -0,0 +1,145 @@
+/*
+ * Test zero-copy transfers (sendfile(), splice(), copy_file_range()).
+ *
+ * Copyright (C) 2013-2018  Simon Ruderich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+/* For splice() and copy_file_range(). */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(HAVE_SYS_SENDFILE_H) && defined(HAVE_SENDFILE)
+# include <sys/sendfile.h>
+#endif
+
+#include "example.h"
+#include "../src/compiler.h"
+
+
+/* These are Linux-specific, emulate them with read()/write(). */
+static ssize_t copy(int in, int out, size_t count) {
+    char buffer[64];
+    if (count > sizeof(buffer)) {
+        count = sizeof(buffer);
+    }
+    ssize_t result = read(in, buffer, count);
+    if (result > 0) {
+        xwrite(out, buffer, (size_t)result);
+    }
+    return result;
+}
+#if !defined(HAVE_SYS_SENDFILE_H) || !defined(HAVE_SENDFILE)
+static ssize_t sendfile(int out_fd, int in_fd, off_t *offset unused,
+                        size_t count) {
+    return copy(in_fd, out_fd, count);
+}
+#endif
+#ifndef HAVE_SPLICE
+static ssize_t splice(int fd_in, void *off_in unused, int fd_out,
+                      void *off_out unused, size_t len,
+                      unsigned int flags unused) {
+    return copy(fd_in, fd_out, len);
+}
+#endif
+#ifndef HAVE_COPY_FILE_RANGE
+static ssize_t copy_file_range(int fd_in, void *off_in unused, int fd_out,
+                               void *off_out unused, size_t len,
+                               unsigned int flags unused) {
+    return copy(fd_in, fd_out, len);
+}
+#endif
+
+static void check(ssize_t result, ssize_t expected, char const *name) {
+    if (result != expected) {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+int main(void) {
+    char path[] = "example_transfer.XXXXXX";
+    int fd, fds[2];
+
+    fd = mkstemp(path);
+    if (fd == -1) {
+        perror("mkstemp");
+        return EXIT_FAILURE;
+    }
+    unlink(path);
+    xwrite(fd, "sendfile()\ncopy_file_range()\n", 29);
+
+    /* Partial transfers. */
+    if (lseek(fd, 0, SEEK_SET) != 0) {
+        perror("lseek");
+        return EXIT_FAILURE;
+    }
+    check(sendfile(STDERR_FILENO, fd, NULL, 4), 4, "sendfile");
+    check(sendfile(STDERR_FILENO, fd, NULL, 7), 7, "sendfile");
+
+    /* Destination not tracked. */
+    off_t offset = 0;
+    check(sendfile(STDOUT_FILENO, fd, &offset, 11), 11, "sendfile");
+
+    /* Only with a regular file as destination (the test's output). */
+    check(copy_file_range(fd, NULL, STDERR_FILENO, NULL, 100, 0), 18,
+          "copy_file_range");
+
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return EXIT_FAILURE;
+    }
+    if (fcntl(fds[0], F_SETFL, O_NONBLOCK) != 0) {
+        perror("fcntl");
+        return EXIT_FAILURE;
+    }
+    xwrite(fds[1], "splice()\n", 9);
+    check(splice(fds[0], NULL, STDERR_FILENO, NULL, 100, 0), 9, "splice");
+
+    xwrite(STDOUT_FILENO, "nothing:\n", 9);
+
+    /* Nothing to transfer, errno must be kept. No pre/post strings are
+     * written. */
+    check(splice(fds[0], NULL, STDERR_FILENO, NULL, 100, 0), -1, "splice");
+    if (errno != EAGAIN) {
+        perror("splice");
+        return EXIT_FAILURE;
+    }
+    xwrite(STDOUT_FILENO, "EAGAIN\n", 7);
+
+    errno = 0;
+    check(sendfile(STDERR_FILENO, -1, NULL, 100), -1, "sendfile");
+    if (errno != EBADF) {
+        perror("sendfile");
+        return EXIT_FAILURE;
+    }
+    xwrite(STDOUT_FILENO, "EBADF\n", 6);
+
+    check(sendfile(STDERR_FILENO, fd, NULL, 0), 0, "sendfile");
+    xwrite(STDOUT_FILENO, "empty\n", 6);
+
+    close(fds[1]);
+    check(splice(fds[0], NULL, STDERR_FILENO, NULL, 100, 0), 0, "splice");
+    xwrite(STDOUT_FILENO, "end of file\n", 12);
+
+    return EXIT_SUCCESS;
+}
@@ -21,15 +21,25 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include "example.h"
 #include "../src/compiler.h"
 
 
-int main(int argc unused, char **argv unused) {
+int main(int argc, char **argv) {
     pid_t pid;
 
+    /* Executed by the child. */
+    if (argc > 1) {
+        char const *fds = getenv("COLORED_STDERR_PRIVATE_FDS");
+        printf("COLORED_STDERR_PRIVATE_FDS=%s\n", fds ? fds : "(unset)");
+        return EXIT_SUCCESS;
+    }
+
     fprintf(stderr, "Before vfork().\n");
 
     pid = vfork();
@@ -44,6 +54,26 @@ int main(int argc unused, char **argv unused) {
 
     fprintf(stderr, "After vfork().\n");
     puts("");
+    fflush(stdout);
+
+    /* The child passes its descriptors to exec*() but doesn't modify ours. */
+    pid = vfork();
+    if (pid == 0) {
+        dup2(STDERR_FILENO, 4);
+        dup2(STDOUT_FILENO, STDERR_FILENO);
+        xwrite(STDERR_FILENO, "child\n", 6);
+
+        execl(argv[0], argv[0], "exec", NULL);
+        _exit(1);
+    }
+    if (waitpid(pid, NULL, 0) == -1) {
+        perror("waitpid");
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "After exec.\n");
+    fflush(stdout);
 
-    return EXIT_SUCCESS;
+    execl(argv[0], argv[0], "exec", NULL);
+    return EXIT_FAILURE;
 }
@@ -0,0 +1,129 @@
+/*
+ * Test wide character output functions.
+ *
+ * Copyright (C) 2013-2018  Simon Ruderich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+/* For {fputwc,putwc,putwchar,fputws}_unlocked(), if available. */
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#include "example.h"
+#include "../src/compiler.h"
+
+
+/* These are not in POSIX. */
+#ifndef HAVE_FPUTWC_UNLOCKED
+static wint_t fputwc_unlocked(wchar_t c, FILE *stream) {
+    return fputwc(c, stream);
+}
+#endif
+#ifndef HAVE_PUTWC_UNLOCKED
+static wint_t putwc_unlocked(wchar_t c, FILE *stream) {
+    return putwc(c, stream);
+}
+#endif
+#ifndef HAVE_PUTWCHAR_UNLOCKED
+static wint_t putwchar_unlocked(wchar_t c) {
+    return putwchar(c);
+}
+#endif
+#ifndef HAVE_FPUTWS_UNLOCKED
+static int fputws_unlocked(wchar_t const *s, FILE *stream) {
+    return fputws(s, stream);
+}
+#endif
+
+
+static int out;
+
+static void test_vwprintf(wchar_t const *format, ...) noinline;
+static void test_vfwprintf(FILE *stream, wchar_t const *format, ...) noinline;
+static void NEWLINE(void) noinline;
+
+static void test_vwprintf(wchar_t const *format, ...) {
+    va_list ap;
+
+    va_start(ap, format);
+    vwprintf(format, ap);
+    va_end(ap);
+}
+static void test_vfwprintf(FILE *stream, wchar_t const *format, ...) {
+    va_list ap;
+
+    va_start(ap, format);
+    vfwprintf(stream, format, ap);
+    va_end(ap);
+}
+
+static void NEWLINE(void) {
+    fflush(stdout);
+    fflush(stderr);
+    xwrite(out, "\n", 1);
+}
+
+
+int main(int argc, char **argv unused) {
+    out = dup(STDOUT_FILENO);
+    if (out == -1) {
+        perror("dup");
+        return EXIT_FAILURE;
+    }
+
+    /* Redirect stdout to stderr to test the buffered stream. */
+    xdup2(STDERR_FILENO, STDOUT_FILENO);
+
+    /* stdout redirected to stderr. */
+
+    fputws(L"fputws()", stdout); NEWLINE();
+    fputwc(L'a', stdout);        NEWLINE();
+    putwc(L'b', stdout);         NEWLINE();
+    putwchar(L'c');              NEWLINE();
+
+    wprintf(L"%ls [%d]", L"wprintf()", argc);                 NEWLINE();
+    fwprintf(stdout, L"%ls [%d]", L"fwprintf()", argc);       NEWLINE();
+    test_vwprintf(L"%ls [%d]", L"vwprintf()", argc);          NEWLINE();
+    test_vfwprintf(stdout, L"%ls [%d]", L"vfwprintf()", argc); NEWLINE();
+
+    fputws_unlocked(L"fputws_unlocked()", stdout); NEWLINE();
+    fputwc_unlocked(L'x', stdout);                 NEWLINE();
+    putwc_unlocked(L'y', stdout);                  NEWLINE();
+    putwchar_unlocked(L'z');                       NEWLINE();
+
+
+    /* stderr (unbuffered) */
+
+    fputws(L"fputws()", stderr); NEWLINE();
+    fputwc(L'a', stderr);        NEWLINE();
+    putwc(L'b', stderr);         NEWLINE();
+
+    fwprintf(stderr, L"%ls [%d]", L"fwprintf()", argc);       NEWLINE();
+    test_vfwprintf(stderr, L"%ls [%d]", L"vfwprintf()", argc); NEWLINE();
+    /* Larger than the buffer. */
+    fwprintf(stderr, L"%ls%300d", L"fwprintf() ", argc);      NEWLINE();
+
+    fputws_unlocked(L"fputws_unlocked()", stderr); NEWLINE();
+    fputwc_unlocked(L'x', stderr);                 NEWLINE();
+    putwc_unlocked(L'y', stderr);                  NEWLINE();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,84 @@
+/*
+ * Test errors when writing to a colored stream.
+ *
+ * Copyright (C) 2013-2018  Simon Ruderich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "example.h"
+
+
+static void result(char const *name, int success) {
+    printf("%s: %s, ferror() %d, %s\n", name, success ? "success" : "error",
+           ferror(stderr) != 0, errno == EPIPE ? "EPIPE" : "other errno");
+    clearerr(stderr);
+    errno = 0;
+}
+
+
+int main(int argc, char **argv) {
+    int fds[2];
+    pid_t pid;
+
+    /* Executed by the child, stderr is a pipe without reader. */
+    if (argc > 1) {
+        signal(SIGPIPE, SIG_IGN);
+        errno = 0;
+
+        result("fputs", fputs("fputs\n", stderr) != EOF);
+        result("fprintf", fprintf(stderr, "%s\n", "fprintf") >= 0);
+        result("fputc", fputc('x', stderr) != EOF);
+        result("fwrite", fwrite("fwrite\n", 7, 1, stderr) == 1);
+        result("write", write(STDERR_FILENO, "write\n", 6) == 6);
+        return EXIT_SUCCESS;
+    }
+
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return EXIT_FAILURE;
+    }
+    close(fds[0]);
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return EXIT_FAILURE;
+    } else if (pid == 0) {
+        /* The dup2() untracks stderr, track it again in the child. */
+        xdup2(fds[1], STDERR_FILENO);
+        setenv("COLORED_STDERR_FDS", "2,", 1);
+        execl(argv[0], argv[0], "child", NULL);
+        _exit(EXIT_FAILURE);
+    }
+    close(fds[1]);
+
+    if (waitpid(pid, NULL, 0) == -1) {
+        perror("waitpid");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
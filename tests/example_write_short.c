@@ -0,0 +1,180 @@
+/*
+ * Test short writes of colored write() and writev() calls.
+ *
+ * Copyright (C) 2013-2018  Simon Ruderich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "example.h"
+
+
+#define OUTPUT_FILE "example_write_short.tmp"
+
+static struct rlimit old_limit;
+
+/* Writes beyond the limit are short (or fail with EFBIG), like writes to a
+ * full pipe or disk but deterministic. The limit applies to all files,
+ * including stdout. */
+static void set_limit(rlim_t size) {
+    struct rlimit limit = old_limit;
+
+    limit.rlim_cur = size;
+    if (setrlimit(RLIMIT_FSIZE, &limit) == -1) {
+        perror("setrlimit");
+        exit(EXIT_FAILURE);
+    }
+}
+/* Start with an empty file. */
+static void reset(void) {
+    if (ftruncate(STDERR_FILENO, 0) == -1
+            || lseek(STDERR_FILENO, 0, SEEK_SET) == -1) {
+        perror("ftruncate");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Print the result of a write and the content of the file. */
+static void result(char const *name, ssize_t written) {
+    char buffer[128];
+    ssize_t size;
+    int fd;
+    int saved_errno = errno;
+
+    if (setrlimit(RLIMIT_FSIZE, &old_limit) == -1) {
+        perror("setrlimit");
+        exit(EXIT_FAILURE);
+    }
+    errno = saved_errno;
+
+    printf("%s: ", name);
+    if (written < 0) {
+        printf("%s\n", errno == EFBIG ? "EFBIG" : "other errno");
+    } else {
+        printf("%zd\n", written);
+    }
+
+    fd = open(OUTPUT_FILE, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+    size = read(fd, buffer, sizeof(buffer));
+    if (size < 0) {
+        perror("read");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    printf("[%.*s]\n", (int)size, buffer);
+    fflush(stdout);
+}
+
+
+int main(int argc, char **argv) {
+    pid_t pid;
+    int fd;
+
+    /* Executed by the child, stderr is the file. The pre/post strings
+     * ">STDERR>" and "<STDERR<" have 8 bytes each. */
+    if (argc > 1) {
+        struct iovec iov[2];
+
+        signal(SIGXFSZ, SIG_IGN);
+        if (getrlimit(RLIMIT_FSIZE, &old_limit) == -1) {
+            perror("getrlimit");
+            return EXIT_FAILURE;
+        }
+
+        /* Everything was written. */
+        reset();
+        set_limit(100);
+        result("complete", write(STDERR_FILENO, "0123456789", 10));
+
+        /* Only the post string is short, the data was written. */
+        reset();
+        set_limit(8 + 10 + 3);
+        result("short post", write(STDERR_FILENO, "0123456789", 10));
+
+        /* Short write in the middle of the data. The caller writes the
+         * rest with a new pre string. */
+        reset();
+        set_limit(8 + 4);
+        result("short data", write(STDERR_FILENO, "0123456789", 10));
+        result("rest", write(STDERR_FILENO, "456789", 6));
+
+        /* Not even the pre string fits, no data was written. */
+        reset();
+        set_limit(3);
+        result("short pre", write(STDERR_FILENO, "0123456789", 10));
+
+        /* Nothing fits. */
+        reset();
+        set_limit(0);
+        result("nothing", write(STDERR_FILENO, "0123456789", 10));
+
+        /* writev(), short in the second entry. */
+        iov[0].iov_base = (void *)"abc";
+        iov[0].iov_len  = 3;
+        iov[1].iov_base = (void *)"defgh";
+        iov[1].iov_len  = 5;
+        reset();
+        set_limit(8 + 5);
+        result("writev short data", writev(STDERR_FILENO, iov, 2));
+        reset();
+        result("writev complete", writev(STDERR_FILENO, iov, 2));
+
+        return EXIT_SUCCESS;
+    }
+
+    fd = open(OUTPUT_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        perror("open");
+        return EXIT_FAILURE;
+    }
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return EXIT_FAILURE;
+    } else if (pid == 0) {
+        /* The dup2() untracks stderr, track it again in the child. */
+        xdup2(fd, STDERR_FILENO);
+        setenv("COLORED_STDERR_FDS", "2,", 1);
+        execl(argv[0], argv[0], "child", NULL);
+        _exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    if (waitpid(pid, NULL, 0) == -1) {
+        perror("waitpid");
+        return EXIT_FAILURE;
+    }
+    unlink(OUTPUT_FILE);
+    return EXIT_SUCCESS;
+}
@@ -44,6 +44,9 @@ unset LANGUAGE
 # Clear user defined variables.
 unset COLORED_STDERR_FDS
 unset COLORED_STDERR_FORCE_WRITE
+unset COLORED_STDERR_DEFER_POST
+unset COLORED_STDERR_LINE_BUFFER
+unset COLORED_STDERR_MERGE_BUFFERED
 # Set default COLORED_STDERR_PRIVATE_FDS value.
 fds=2,
 
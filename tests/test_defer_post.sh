@@ -0,0 +1,34 @@
+#!/bin/sh
+
+# Copyright (C) 2013-2018  Simon Ruderich
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+test "x$srcdir" = x && srcdir=.
+. "$srcdir/lib.sh"
+
+COLORED_STDERR_DEFER_POST=1
+export COLORED_STDERR_DEFER_POST
+
+test_program          example_defer_post
+test_program_subshell example_defer_post
+
+# The merged output must match the regular one.
+test_program          example
+test_program_subshell example
+test_program          example_exec
+test_program_subshell example_exec
+test_program          example_stdio
+test_program_subshell example_stdio
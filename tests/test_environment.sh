@@ -45,6 +45,31 @@ fds=-20,-30,2,-1,
 test_program          example example_environment
 test_program_subshell example example_environment
 
+echo 'Compact format.'
+fds=@1E
+test_program          example example_environment
+test_program_subshell example example_environment
+fds=@1
+test_program          example example_environment_empty
+test_program_subshell example example_environment_empty
+fds=@1AB.AB
+test_program          example example_environment_empty
+test_program_subshell example example_environment_empty
+fds=@1E.AB
+test_program          example example_environment
+test_program_subshell example example_environment
+
+echo 'Invalid compact format.'
+fds=@2E
+test_program          example example_environment_empty
+test_program_subshell example example_environment_empty
+fds=@1!E
+test_program          example example_environment_empty
+test_program_subshell example example_environment_empty
+fds=@1E.!
+test_program          example example_environment
+test_program_subshell example example_environment
+
 echo 'Test COLORED_STDERR_FDS overwrites COLORED_STDERR_PRIVATE_FDS.'
 # Additional tests in example_exec.
 
@@ -71,8 +96,37 @@ if test -x /proc/self/exe; then
     test_program          example example_environment_empty
     test_program_subshell example example_environment_empty
 
+    COLORED_STDERR_IGNORED_BINARIES="some,$abs_builddir/exam*"
+    export COLORED_STDERR_IGNORED_BINARIES
+    test_program          example example_environment_empty
+    test_program_subshell example example_environment_empty
+
     COLORED_STDERR_IGNORED_BINARIES=",some,other,path,,"
     export COLORED_STDERR_IGNORED_BINARIES
     test_program          example example_environment
     test_program_subshell example example_environment
 fi
+
+# Basenames and wildcards don't require /proc/ on Linux.
+if test -x /proc/self/exe || test "$(uname -s)" = Linux; then
+    COLORED_STDERR_IGNORED_BINARIES="some,example"
+    export COLORED_STDERR_IGNORED_BINARIES
+    test_program          example example_environment_empty
+    test_program_subshell example example_environment_empty
+
+    COLORED_STDERR_IGNORED_BINARIES="ex*le"
+    export COLORED_STDERR_IGNORED_BINARIES
+    test_program          example example_environment_empty
+    test_program_subshell example example_environment_empty
+
+    # Children of ignored binaries are ignored as well.
+    COLORED_STDERR_IGNORED_BINARIES="sh"
+    export COLORED_STDERR_IGNORED_BINARIES
+    test_program          example example_environment
+    test_program_subshell example example_environment_empty
+
+    COLORED_STDERR_IGNORED_BINARIES="exam,example?,[!e]xample,*/example"
+    export COLORED_STDERR_IGNORED_BINARIES
+    test_program          example example_environment
+    test_program_subshell example example_environment
+fi